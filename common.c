@@ -3,15 +3,20 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
+#include "cpu.h"
 
 // The global trace flag
 int g_trace = 0;
 // The global disassembly flag
 int g_disassemble = 0;
-// The global indentation amount
-int g_indent = 0;
+// The indentation amount of the current thread
+_Thread_local int g_indent = 0;
 
 #define MORE(b) (((b) & 0x80) != 0)
 #define ERROR (len != NULL ? *len = -(ptr - start) : 0), 0
@@ -38,22 +43,154 @@ int g_indent = 0;
   }									\
   return ERROR;
 
-int32_t decode_i32leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+// Decoding one byte at a time; used near the end of a buffer.
+static int32_t decode_i32leb_slow(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
   BODY(int32_t, 0xF8, 0x78);
 }
 
-uint32_t decode_u32leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+static uint32_t decode_u32leb_slow(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
   BODY(uint32_t, 0xF8, 0x08);
 }
 
-int64_t decode_i64leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+static int64_t decode_i64leb_slow(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
   BODY(int64_t, 0xFF, 0x7F);
 }
 
-uint64_t decode_u64leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+static uint64_t decode_u64leb_slow(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
   BODY(int64_t, 0xFF, 0x01);
 }
 
+// The number of readable bytes the fast decoders need, enough for the longest
+// (10-byte) LEB plus an unaligned 8-byte load of its tail.
+#define LEB_WINDOW 16
+
+// Returns the number of bytes up to and including the first one without the
+// continuation bit in the window at {ptr}, or more than 16 if there is none.
+static inline uint32_t leb_length(const uint8_t* ptr) {
+#if defined(__SSE2__)
+  if (g_cpu_level >= CPU_SSE) {
+    __m128i v = _mm_loadu_si128((const __m128i*)ptr);
+    uint32_t more = (uint32_t)_mm_movemask_epi8(v);
+    return __builtin_ctz(~more) + 1;
+  }
+#endif
+  uint64_t lo, hi;
+  memcpy(&lo, ptr, 8);
+  memcpy(&hi, ptr + 8, 8);
+  uint64_t stops_lo = ~lo & 0x8080808080808080ull;
+  uint64_t stops_hi = ~hi & 0x8080808080808080ull;
+  if (stops_lo != 0) return (__builtin_ctzll(stops_lo) >> 3) + 1;
+  if (stops_hi != 0) return (__builtin_ctzll(stops_hi) >> 3) + 9;
+  return 17;
+}
+
+// Packs the 7-bit payloads of the 8 little-endian bytes in {word} into 56 bits.
+static inline uint64_t leb_gather(uint64_t word) {
+  word &= 0x7F7F7F7F7F7F7F7Full;
+  word = (word & 0x007F007F007F007Full) | ((word & 0x7F007F007F007F00ull) >> 1);
+  word = (word & 0x00003FFF00003FFFull) | ((word & 0x3FFF00003FFF0000ull) >> 2);
+  word = (word & 0x000000000FFFFFFFull) | ((word & 0x0FFFFFFF00000000ull) >> 4);
+  return word;
+}
+
+// Decodes a 32-bit LEB from a window of {LEB_WINDOW} readable bytes, with the
+// same results and error lengths as {BODY}. A 32-bit LEB fits in one word, so
+// this avoids both the vector unit's latency and any length-dependent branch.
+static inline uint32_t decode_leb32_fast(const uint8_t* ptr, ssize_t *len,
+                                         uint8_t mask, uint8_t legal) {
+  uint64_t word;
+  memcpy(&word, ptr, 8);
+  uint32_t n = (__builtin_ctzll((~word & 0x8080808080808080ull) | (1ull << 63)) >> 3) + 1;
+  uint32_t k = n < 5 ? n : 5;
+  uint64_t result = leb_gather(word & (~0ull >> (64 - 8 * k)));
+  if ((0x7F & mask) == legal) {
+    // sign-extend unless the last byte was reached
+    uint32_t rem = n < 5 ? 64 - 7 * n : 0;
+    result = (uint64_t)((int64_t)(result << rem) >> rem);
+  }
+  // the last byte must terminate and not have bits out of range
+  uint8_t upper = ptr[4] & mask;
+  if ((n > 5) | ((n == 5) & (upper != 0) & (upper != legal))) {
+    if (len != NULL) *len = -5;
+    return 0;
+  }
+  if (len != NULL) *len = n;
+  return (uint32_t)result;
+}
+
+// Decodes a 64-bit LEB from a window of {LEB_WINDOW} readable bytes, with the
+// same results and error lengths as {BODY}.
+static inline uint64_t decode_leb64_fast(const uint8_t* ptr, ssize_t *len,
+                                         uint8_t mask, uint8_t legal) {
+  uint32_t n = leb_length(ptr);
+  uint64_t word;
+  memcpy(&word, ptr, 8);
+  if (n < 10) {
+    // terminated before the last byte; sign-extend if signed
+    uint64_t result = n <= 8 ? leb_gather(word & (~0ull >> (64 - 8 * n)))
+      : leb_gather(word) | ((uint64_t)(ptr[8] & 0x7F) << 56);
+    if ((0x7F & mask) == legal) {
+      uint32_t rem = 64 - 7 * n;
+      result = (uint64_t)((int64_t)(result << rem) >> rem);
+    }
+    if (len != NULL) *len = n;
+    return result;
+  }
+  // the last byte must terminate and not have bits out of range
+  uint8_t b = ptr[9];
+  uint8_t upper = b & mask;
+  if (n > 10 || (upper != 0 && upper != legal)) {
+    if (len != NULL) *len = -10;
+    return 0;
+  }
+  if (len != NULL) *len = 10;
+  return leb_gather(word) | ((uint64_t)(ptr[8] & 0x7F) << 56) | ((uint64_t)b << 63);
+}
+
+int32_t decode_i32leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+  if (limit - ptr < LEB_WINDOW || g_cpu_level == CPU_SCALAR) {
+    return decode_i32leb_slow(ptr, limit, len);
+  }
+  if (ptr[0] < 0x80) {
+    if (len != NULL) *len = 1;
+    return (int32_t)((uint32_t)ptr[0] << 25) >> 25;
+  }
+  if (ptr[1] < 0x80) {
+    if (len != NULL) *len = 2;
+    return (int32_t)(((ptr[0] & 0x7F) | ((uint32_t)ptr[1] << 7)) << 18) >> 18;
+  }
+  return (int32_t)decode_leb32_fast(ptr, len, 0xF8, 0x78);
+}
+
+uint32_t decode_u32leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+  if (limit - ptr < LEB_WINDOW || g_cpu_level == CPU_SCALAR) {
+    return decode_u32leb_slow(ptr, limit, len);
+  }
+  if (ptr[0] < 0x80) {
+    if (len != NULL) *len = 1;
+    return ptr[0];
+  }
+  if (ptr[1] < 0x80) {
+    if (len != NULL) *len = 2;
+    return (ptr[0] & 0x7F) | ((uint32_t)ptr[1] << 7);
+  }
+  return decode_leb32_fast(ptr, len, 0xF8, 0x08);
+}
+
+int64_t decode_i64leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+  if (limit - ptr < LEB_WINDOW || g_cpu_level == CPU_SCALAR) {
+    return decode_i64leb_slow(ptr, limit, len);
+  }
+  return (int64_t)decode_leb64_fast(ptr, len, 0xFF, 0x7F);
+}
+
+uint64_t decode_u64leb(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
+  if (limit - ptr < LEB_WINDOW || g_cpu_level == CPU_SCALAR) {
+    return decode_u64leb_slow(ptr, limit, len);
+  }
+  return decode_leb64_fast(ptr, len, 0xFF, 0x01);
+}
+
 uint32_t decode_u32(const uint8_t* ptr, const uint8_t* limit, ssize_t *len) {
   ssize_t remain = limit - ptr;
   if (remain < 4) {
@@ -25,14 +25,14 @@ ssize_t load_file(const char* path, byte** start, byte** end);
 // Unload a file previously loaded into memory using {load_file}.
 ssize_t unload_file(byte** start, byte** end);
 
-// The global trace flag.
+// The global trace flag. The flags are set before any threads are started.
 extern int g_trace;
 extern int g_disassemble;
-extern int g_indent;
+extern _Thread_local int g_indent;
 
 // Helper macros to trace and to print errors.
 #define TRACE(...) do { if(g_trace) fprintf(stderr, __VA_ARGS__); } while(0)
-#define TRACE_INDENT(...) do { for (int i = 0; i < g_indent; i++) fprintf(stderr, "  "); TRACE(__VA_ARGS__); } while(0)
+#define TRACE_INDENT(...) do { if(g_trace) { for (int i = 0; i < g_indent; i++) fprintf(stderr, "  "); fprintf(stderr, __VA_ARGS__); } } while(0)
 #define DISASS(...) do { if(g_disassemble) fprintf(stderr, __VA_ARGS__); } while(0)
 #define ERR(...) fprintf(stderr, __VA_ARGS__)
 
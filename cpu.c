@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86 1
+#endif
+
+#include "common.h"
+#include "cpu.h"
+
+#if defined(__SSE2__)
+int g_cpu_level = CPU_SSE;
+#else
+int g_cpu_level = CPU_SCALAR;
+#endif
+
+static void copy_bytes_scalar(byte* dst, const byte* src, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    memcpy(dst + i, &word, 8);
+  }
+  for (; i < size; i++) dst[i] = src[i];
+}
+
+#if CPU_X86
+__attribute__((target("sse2")))
+static void copy_bytes_sse(byte* dst, const byte* src, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), v);
+  }
+  copy_bytes_scalar(dst + i, src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_bytes_avx2(byte* dst, const byte* src, size_t size) {
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+    _mm256_storeu_si256((__m256i*)(dst + i), a);
+    _mm256_storeu_si256((__m256i*)(dst + i + 32), b);
+  }
+  copy_bytes_sse(dst + i, src + i, size - i);
+}
+#endif
+
+cpu_kernels_t g_kernels = { copy_bytes_scalar };
+
+int detect_cpu_level() {
+#if CPU_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return CPU_AVX2;
+  if (__builtin_cpu_supports("sse2")) return CPU_SSE;
+#endif
+  return CPU_SCALAR;
+}
+
+int init_cpu_kernels(int level) {
+  int detected = detect_cpu_level();
+  if (level < 0) level = detected;
+  if (level > detected) return -1;
+#if !defined(__SSE2__)
+  // the LEB decoders' vector path is only compiled in with SSE2
+  if (level > CPU_SCALAR) level = CPU_SCALAR;
+#endif
+  g_cpu_level = level;
+  switch (level) {
+#if CPU_X86
+  case CPU_AVX2: g_kernels.copy_bytes = copy_bytes_avx2; break;
+  case CPU_SSE: g_kernels.copy_bytes = copy_bytes_sse; break;
+#endif
+  default: g_kernels.copy_bytes = copy_bytes_scalar; break;
+  }
+  TRACE("cpu: detected %s, using %s\n", cpu_level_name(detected), cpu_level_name(level));
+  return level;
+}
+
+int cpu_level_by_name(const char* name) {
+  if (strcmp(name, "scalar") == 0) return CPU_SCALAR;
+  if (strcmp(name, "sse") == 0) return CPU_SSE;
+  if (strcmp(name, "avx2") == 0) return CPU_AVX2;
+  return -1;
+}
+
+const char* cpu_level_name(int level) {
+  switch (level) {
+  case CPU_SCALAR: return "scalar";
+  case CPU_SSE: return "sse";
+  case CPU_AVX2: return "avx2";
+  default: return "unknown";
+  }
+}
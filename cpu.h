@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Levels of CPU support for the vectorized kernels, from least to most capable.
+#define CPU_SCALAR 0 // portable code only
+#define CPU_SSE 1    // SSE2
+#define CPU_AVX2 2   // AVX2
+
+// The selected level, which the LEB decoders in common.c also consult.
+extern int g_cpu_level;
+
+// The implementations of hot kernels selected for the CPU.
+typedef struct {
+  // Copies {size} bytes that do not overlap, e.g. data segments into memory.
+  void (*copy_bytes)(byte* dst, const byte* src, size_t size);
+} cpu_kernels_t;
+
+extern cpu_kernels_t g_kernels;
+
+// Returns the most capable level the running CPU supports.
+int detect_cpu_level();
+
+// Selects the kernels for {level}, or for the detected level if {level} is
+// negative. Returns < 0 if the CPU does not support {level}.
+int init_cpu_kernels(int level);
+
+// Returns the level with the given name ("scalar", "sse", "avx2"), or -1.
+int cpu_level_by_name(const char* name);
+
+// Returns the name of a level.
+const char* cpu_level_name(int level);
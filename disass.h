@@ -31,6 +31,9 @@ const char* bytecode_name(byte b);
 // Prints a bytecode to standard out.
 void print_bytecode(buffer_t* buf);
 
+// Prints a bytecode to {out}.
+void fprint_bytecode(FILE* out, buffer_t* buf);
+
 // Skips to the next bytecode.
 void skip_bytecode(buffer_t* buf);
 
@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "ir.h"
+#include "interp.h"
+#include "events.h"
+
+uint32_t g_event_capacity = 0;
+_Thread_local event_ring_t* t_event_ring = NULL;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static event_ring_t* rings = NULL; // the most recently created first
+static uint32_t num_rings = 0;
+static const char* events_path = NULL;
+
+event_ring_t* new_thread_events() {
+  event_ring_t* ring = (event_ring_t*)calloc(1, sizeof(event_ring_t));
+  ring->mask = g_event_capacity - 1;
+  ring->events = (event_t*)malloc(sizeof(event_t) * g_event_capacity);
+  pthread_mutex_lock(&rings_lock);
+  ring->tid = ++num_rings;
+  ring->link = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  t_event_ring = ring;
+  return ring;
+}
+
+void start_events(const char* path, uint32_t capacity) {
+  uint32_t c = 1;
+  while (c < capacity && c < (1u << 31)) c <<= 1;
+  events_path = path;
+  g_event_capacity = c;
+}
+
+const char* event_type_name(uint8_t type) {
+  switch (type) {
+  case EVENT_LOAD: return "load";
+  case EVENT_PARSE: return "parse";
+  case EVENT_REWRITE: return "rewrite";
+  case EVENT_INSTANTIATE: return "instantiate";
+  case EVENT_START: return "start";
+  case EVENT_MAIN: return "main";
+  case EVENT_CALL: return "call";
+  case EVENT_HOST_CALL: return "host call";
+  case EVENT_TRAP: return "trap";
+  default: return "unknown";
+  }
+}
+
+// Returns the number of events left in {ring}.
+static uint64_t ring_count(event_ring_t* ring) {
+  return ring->next < (uint64_t)ring->mask + 1 ? ring->next : (uint64_t)ring->mask + 1;
+}
+
+// Writes {str} as the contents of a JSON string.
+static void write_json_chars(FILE* file, const char* str) {
+  for (const char* p = str; *p; p++) {
+    if (*p == '"' || *p == '\\') fprintf(file, "\\%c", *p);
+    else if ((unsigned char)*p < 0x20) fprintf(file, "\\u%04x", *p);
+    else fputc(*p, file);
+  }
+}
+
+// Writes one event of {ring} as a JSON object, at a time relative to {epoch}.
+static void write_event(FILE* file, wasm_module_t* module, event_ring_t* ring, const event_t* e,
+                        uint64_t epoch, int* first) {
+  static const char phases[] = {'B', 'E', 'i'};
+  fprintf(file, "%s\n{\"name\":\"", *first ? "" : ",");
+  *first = 0;
+  if (e->type == EVENT_CALL || e->type == EVENT_HOST_CALL) {
+    const char* name = module != NULL && e->index < module->num_funcs ? wasm_func_debug_name(module, e->index) : NULL;
+    if (name != NULL) write_json_chars(file, name);
+    else fprintf(file, "func[%u]", e->index);
+  } else if (e->type == EVENT_TRAP) {
+    fprintf(file, "trap: ");
+    write_json_chars(file, trap_name((wasm_trap_t)e->index));
+  } else {
+    fprintf(file, "%s", event_type_name(e->type));
+  }
+  fprintf(file, "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+          e->type >= EVENT_CALL ? event_type_name(e->type) : "phase",
+          phases[e->phase], (double)(e->time - epoch) / 1000.0, ring->tid);
+  if (e->phase == EVENT_INSTANT) fprintf(file, ",\"s\":\"t\"");
+  if (e->type == EVENT_REWRITE && e->phase == EVENT_BEGIN) fprintf(file, ",\"args\":{\"func\":%u}", e->index);
+  fprintf(file, "}");
+}
+
+// Writes the events left in {ring}. Ends whose beginning was overwritten are
+// dropped, and spans that never ended, such as the calls a trap unwound, end
+// with the last event.
+static void write_ring(FILE* file, wasm_module_t* module, event_ring_t* ring, uint64_t epoch, int* first) {
+  uint64_t count = ring_count(ring);
+  uint64_t depth = 0;
+  const event_t* last = NULL;
+  for (uint64_t i = ring->next - count; i < ring->next; i++) {
+    const event_t* e = &ring->events[i & ring->mask];
+    if (e->phase == EVENT_END) {
+      if (depth == 0) continue;
+      depth--;
+    }
+    if (e->phase == EVENT_BEGIN) depth++;
+    write_event(file, module, ring, e, epoch, first);
+    last = e;
+  }
+  for (; depth > 0; depth--) {
+    fprintf(file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            (double)(last->time - epoch) / 1000.0, ring->tid);
+  }
+}
+
+int finish_events(wasm_module_t* module) {
+  if (g_event_capacity == 0) return 0;
+  g_event_capacity = 0;
+  t_event_ring = NULL;
+  pthread_mutex_lock(&rings_lock);
+  event_ring_t* list = rings;
+  rings = NULL;
+  num_rings = 0;
+  pthread_mutex_unlock(&rings_lock);
+
+  uint64_t epoch = UINT64_MAX;
+  for (event_ring_t* ring = list; ring != NULL; ring = ring->link) {
+    uint64_t count = ring_count(ring);
+    const event_t* oldest = &ring->events[(ring->next - count) & ring->mask];
+    if (count > 0 && oldest->time < epoch) epoch = oldest->time;
+  }
+  FILE* file = fopen(events_path, "w");
+  if (file == NULL) ERR("!failed to open %s\n", events_path);
+  else fprintf(file, "{\"traceEvents\":[");
+  int first = 1;
+  while (list != NULL) {
+    event_ring_t* ring = list;
+    list = ring->link;
+    if (file != NULL) write_ring(file, module, ring, epoch, &first);
+    free(ring->events);
+    free(ring);
+  }
+  if (file == NULL) return -1;
+  fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  return fclose(file) == 0 ? 0 : -1;
+}
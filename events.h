@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ir.h"
+#include "stats.h"
+
+// A binary log of timed events, such as the load phases of a module and the
+// calls of the interpreter, kept in a ring buffer per thread so that recording
+// an event is a clock read and a few stores. When a ring is full the oldest
+// events are overwritten.
+
+// What a span of time is spent on. The phases of loading and running a module
+// come first, and are what -stats times.
+typedef enum {
+  EVENT_LOAD = 0, // reading a module file
+  EVENT_PARSE,
+  EVENT_REWRITE, // validating and rewriting the body of a function
+  EVENT_INSTANTIATE,
+  EVENT_START, // running the start function
+  EVENT_MAIN, // calling "main"
+  EVENT_CALL, // a wasm function
+  EVENT_HOST_CALL, // a host function or an intrinsic
+  EVENT_TRAP, // an instant, whose index is the trap reason
+} event_type_t;
+
+#define EVENT_BEGIN 0
+#define EVENT_END 1
+#define EVENT_INSTANT 2
+
+typedef struct {
+  uint64_t time; // nanoseconds on the monotonic clock
+  uint8_t phase; // EVENT_BEGIN, EVENT_END or EVENT_INSTANT
+  uint8_t type; // an event_type_t
+  uint32_t index; // the function, or the trap reason
+} event_t;
+
+typedef struct event_ring {
+  uint32_t tid; // numbered from 1 in the order threads first recorded
+  uint32_t mask; // the capacity, a power of 2, minus 1
+  uint64_t next; // the number of events ever recorded
+  event_t* events;
+  struct event_ring* link; // the ring of another thread
+} event_ring_t;
+
+// The capacity of the rings of threads that start recording, or 0 if events
+// are not recorded.
+extern uint32_t g_event_capacity;
+extern _Thread_local event_ring_t* t_event_ring;
+
+event_ring_t* new_thread_events();
+
+// Returns the ring of the calling thread, or NULL if events are not recorded.
+static inline event_ring_t* thread_events() {
+  if (g_event_capacity == 0) return NULL;
+  return t_event_ring != NULL ? t_event_ring : new_thread_events();
+}
+
+static inline void record_event(event_ring_t* ring, uint8_t phase, uint8_t type, uint32_t index) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  event_t* e = &ring->events[ring->next++ & ring->mask];
+  e->time = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  e->phase = phase;
+  e->type = type;
+  e->index = index;
+}
+
+// Records an event in {ring} and counts it in {stats}, either of which may be NULL.
+static inline void emit_event(event_ring_t* ring, run_stats_t* stats, uint8_t phase, uint8_t type,
+                              uint32_t index) {
+  if (ring != NULL) record_event(ring, phase, type, index);
+  if (stats != NULL) count_event(stats, phase, type);
+}
+
+// Records and counts an event on the calling thread, if events are recorded or
+// stats collected.
+static inline void log_event(uint8_t phase, uint8_t type, uint32_t index) {
+  emit_event(thread_events(), thread_stats(), phase, type, index);
+}
+
+// Returns the name of an event type.
+const char* event_type_name(uint8_t type);
+
+// Starts recording events on every thread, keeping the last {capacity} of each,
+// to be written to {path} by {finish_events}.
+void start_events(const char* path, uint32_t capacity);
+
+// Writes the recorded events to the path given to {start_events} in the Chrome
+// trace event format, naming functions after those of {module} if it is not
+// NULL, and stops recording. Threads other than the caller must not record
+// events any more. Returns < 0 if the file cannot be written, and 0 if events
+// were not recorded.
+int finish_events(wasm_module_t* module);
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "weewasm.h"
+#include "ir.h"
+#include "imports.h"
+
+// The functions importable from the "weewasm" module.
+static const host_func_t weewasm_imports[] = {
+  {"weewasm", "puti", "i:", WEEWASM_INTRINSIC_PUTI, NULL, NULL},
+  {"weewasm", "putd", "d:", WEEWASM_INTRINSIC_PUTD, NULL, NULL},
+  {"weewasm", "puts", "ii:", WEEWASM_INTRINSIC_PUTS, NULL, NULL},
+  {"weewasm", "obj.new", ":r", WEEWASM_INTRINSIC_OBJ_NEW, NULL, NULL},
+  {"weewasm", "obj.get", "rr:r", WEEWASM_INTRINSIC_OBJ_GET, NULL, NULL},
+  {"weewasm", "obj.set", "rrr:", WEEWASM_INTRINSIC_OBJ_SET, NULL, NULL},
+  {"weewasm", "obj.box_i32", "i:r", WEEWASM_INTRINSIC_OBJ_BOX_I32, NULL, NULL},
+  {"weewasm", "obj.box_f64", "d:r", WEEWASM_INTRINSIC_OBJ_BOX_F64, NULL, NULL},
+  {"weewasm", "i32.unbox", "r:i", WEEWASM_INTRINSIC_I32_UNBOX, NULL, NULL},
+  {"weewasm", "f64.unbox", "r:d", WEEWASM_INTRINSIC_F64_UNBOX, NULL, NULL},
+  {"weewasm", "obj.eq", "rr:i", WEEWASM_INTRINSIC_OBJ_EQ, NULL, NULL},
+};
+
+// An open-addressed table of imports, hashed by module and member name.
+static struct {
+  uint32_t count;
+  uint32_t capacity; // a power of 2
+  host_func_t** entries;
+} registry;
+
+static uint32_t hash_name(const char* mod_name, const char* member_name) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (const char* p = mod_name; *p; p++) h = (h ^ (byte)*p) * 16777619u;
+  h = (h ^ 0xFF) * 16777619u; // a separator that no name contains
+  for (const char* p = member_name; *p; p++) h = (h ^ (byte)*p) * 16777619u;
+  return h;
+}
+
+// Returns the slot for the given name, which is empty if it is not registered.
+static host_func_t** find_slot(const char* mod_name, const char* member_name) {
+  uint32_t mask = registry.capacity - 1;
+  for (uint32_t i = hash_name(mod_name, member_name) & mask;; i = (i + 1) & mask) {
+    host_func_t* entry = registry.entries[i];
+    if (entry == NULL) return &registry.entries[i];
+    if (strcmp(entry->member_name, member_name) == 0 && strcmp(entry->mod_name, mod_name) == 0) {
+      return &registry.entries[i];
+    }
+  }
+}
+
+static void insert(host_func_t* func) {
+  if (2 * (registry.count + 1) > registry.capacity) {
+    // grow, keeping the load factor at most 1/2
+    host_func_t** old = registry.entries;
+    uint32_t old_capacity = registry.capacity;
+    registry.capacity = old_capacity == 0 ? 32 : old_capacity * 2;
+    registry.entries = (host_func_t**)calloc(registry.capacity, sizeof(host_func_t*));
+    for (uint32_t i = 0; i < old_capacity; i++) {
+      if (old[i] != NULL) *find_slot(old[i]->mod_name, old[i]->member_name) = old[i];
+    }
+    free(old);
+  }
+  host_func_t** slot = find_slot(func->mod_name, func->member_name);
+  if (*slot == NULL) registry.count++;
+  *slot = func;
+}
+
+static void init_registry() {
+  if (registry.capacity != 0) return;
+  for (size_t i = 0; i < sizeof(weewasm_imports) / sizeof(weewasm_imports[0]); i++) {
+    insert((host_func_t*)&weewasm_imports[i]);
+  }
+}
+
+// Returns 1 if {sig} is a well-formed signature string.
+static int valid_sig(const char* sig) {
+  int colons = 0;
+  for (const char* p = sig; *p; p++) {
+    if (*p == ':') colons++;
+    else if (*p != 'i' && *p != 'd' && *p != 'r') return 0;
+  }
+  return colons == 1;
+}
+
+int register_host_func(const char* mod_name, const char* member_name, const char* sig,
+                       wasm_host_fn_t fn, void* data) {
+  init_registry();
+  if (!valid_sig(sig) || fn == NULL) {
+    ERR("!invalid host function %s.%s: %s\n", mod_name, member_name, sig);
+    return -1;
+  }
+  host_func_t** slot = find_slot(mod_name, member_name);
+  if (*slot != NULL && (*slot)->intrinsic != WEEWASM_INTRINSIC_HOST) {
+    ERR("!cannot replace intrinsic %s.%s\n", mod_name, member_name);
+    return -1;
+  }
+  host_func_t* func = (host_func_t*)malloc(sizeof(host_func_t));
+  func->mod_name = strdup(mod_name);
+  func->member_name = strdup(member_name);
+  func->sig = strdup(sig);
+  func->intrinsic = WEEWASM_INTRINSIC_HOST;
+  func->fn = fn;
+  func->data = data;
+  // entries are never freed, since instances keep pointers to them
+  insert(func);
+  return 0;
+}
+
+const host_func_t* lookup_import(const char* mod_name, const char* member_name) {
+  init_registry();
+  return *find_slot(mod_name, member_name);
+}
+
+static char type_char(wasm_type_t type) {
+  switch (type) {
+  case I32: return 'i';
+  case F64: return 'd';
+  default: return 'r';
+  }
+}
+
+int sig_matches(wasm_sig_decl_t* decl, const char* sig) {
+  for (uint32_t i = 0; i < decl->num_params; i++) {
+    if (*sig++ != type_char(decl->params[i])) return 0;
+  }
+  if (*sig++ != ':') return 0;
+  for (uint32_t i = 0; i < decl->num_results; i++) {
+    if (*sig++ != type_char(decl->results[i])) return 0;
+  }
+  return *sig == 0;
+}
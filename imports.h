@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ir.h"
+#include "interp.h"
+
+// A function supplied by the host. Reads its arguments from {args} and writes
+// its results over them, like the intrinsics do. It can instead return
+// TRAP_PENDING to suspend the instance, and supply the results later when
+// resuming it.
+typedef wasm_trap_t (*wasm_host_fn_t)(wasm_instance_t* instance, void* data, wasm_value_t* args);
+
+// A function that modules can import. A signature lists the parameter types,
+// a colon, then the result types, with i = i32, d = f64, r = externref.
+typedef struct host_func {
+  const char* mod_name;
+  const char* member_name;
+  const char* sig;
+  uint8_t intrinsic; // WEEWASM_INTRINSIC_HOST for functions with a {fn}
+  wasm_host_fn_t fn;
+  void* data;
+} host_func_t;
+
+// Registers {fn} as the import {mod_name}.{member_name} with the signature {sig},
+// replacing any previous registration. The names and signature are copied.
+// Returns < 0 if the signature is malformed or the name is taken by an intrinsic.
+int register_host_func(const char* mod_name, const char* member_name, const char* sig,
+                       wasm_host_fn_t fn, void* data);
+
+// Returns the registered import with the given name, or NULL. The weewasm
+// intrinsics are always registered.
+const host_func_t* lookup_import(const char* mod_name, const char* member_name);
+
+// Returns 1 if {decl} has the signature described by {sig}.
+int sig_matches(wasm_sig_decl_t* decl, const char* sig);
@@ -0,0 +1,483 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common.h"
+#include "weewasm.h"
+#include "ir.h"
+#include "disass.h"
+#include "interp.h"
+#include "cpu.h"
+#include "obj.h"
+#include "out.h"
+#include "imports.h"
+#include "pool.h"
+#include "profile.h"
+#include "opstats.h"
+#include "events.h"
+
+#define MAX_MEMORY_PAGES 65536
+
+// The maximum number of values on the operand stack, including locals.
+#define STACK_SIZE (1024 * 1024)
+// The maximum call depth.
+#define MAX_FRAMES 50000
+
+// Marks an uninitialized table entry.
+#define NULL_FUNC 0xFFFFFFFFu
+
+// Returns a human-readable description of a trap reason.
+const char* trap_name(wasm_trap_t trap) {
+  switch (trap) {
+  case TRAP_NONE: return "none";
+  case TRAP_UNREACHABLE: return "unreachable";
+  case TRAP_MEM_OUT_OF_BOUNDS: return "memory access out of bounds";
+  case TRAP_DIV_BY_ZERO: return "integer divide by zero";
+  case TRAP_DIV_OVERFLOW: return "integer overflow";
+  case TRAP_INVALID_CONVERSION: return "invalid conversion to integer";
+  case TRAP_TABLE_OUT_OF_BOUNDS: return "table index out of bounds";
+  case TRAP_NULL_FUNCTION: return "uninitialized table element";
+  case TRAP_SIG_MISMATCH: return "indirect call signature mismatch";
+  case TRAP_STACK_OVERFLOW: return "stack overflow";
+  case TRAP_UNBOUND_IMPORT: return "call to unbound import";
+  case TRAP_INVALID_ARGS: return "invalid arguments";
+  case TRAP_NULL_REFERENCE: return "null reference";
+  case TRAP_TYPE_MISMATCH: return "reference type mismatch";
+  case TRAP_OUT_OF_FUEL: return "out of fuel";
+  case TRAP_INTERRUPTED: return "interrupted";
+  case TRAP_PENDING: return "host call pending";
+  default: return "unknown";
+  }
+}
+
+// Returns the zero value of a type.
+static wasm_value_t default_value(wasm_type_t type) {
+  switch (type) {
+  case F64: return wasm_f64_value(0);
+  case EXTERNREF: return wasm_ref_value(NULL);
+  default: return wasm_i32_value(0);
+  }
+}
+
+static wasm_trap_t instantiate(wasm_module_t* module, wasm_instance_t* instance) {
+  memset(instance, 0, sizeof(wasm_instance_t));
+  instance->module = module;
+  instance->fuel = FUEL_UNLIMITED;
+
+  //==== Allocate and initialize memory ==============================
+  uint32_t pages = module->mem_limits.initial;
+  if (pages > MAX_MEMORY_PAGES) return TRAP_MEM_OUT_OF_BOUNDS;
+  size_t mem_size = (size_t)pages * WASM_PAGE_SIZE;
+  instance->mem_start = (byte*)calloc(mem_size > 0 ? mem_size : 1, 1);
+  instance->mem_end = instance->mem_start + mem_size;
+  for (uint32_t i = 0; i < module->num_data; i++) {
+    wasm_data_decl_t* data = &module->data[i];
+    uint32_t count = data->bytes_end - data->bytes_start;
+    if ((uint64_t)data->mem_offset + count > mem_size) return TRAP_MEM_OUT_OF_BOUNDS;
+    g_kernels.copy_bytes(instance->mem_start + data->mem_offset, module->bytes_start + data->bytes_start, count);
+  }
+
+  //==== Allocate and initialize the table ===========================
+  if (module->table != NULL) {
+    uint32_t size = module->table->limits.initial;
+    instance->table = (uint32_t*)malloc(sizeof(uint32_t) * (size > 0 ? size : 1));
+    instance->table_size = size;
+    for (uint32_t i = 0; i < size; i++) instance->table[i] = NULL_FUNC;
+  }
+  for (uint32_t i = 0; i < module->num_elems; i++) {
+    wasm_elems_decl_t* elems = &module->elems[i];
+    if ((uint64_t)elems->table_offset + elems->length > instance->table_size) return TRAP_TABLE_OUT_OF_BOUNDS;
+    for (uint32_t j = 0; j < elems->length; j++) {
+      uint32_t func_index = elems->func_indexes[j];
+      if (func_index >= module->num_funcs) return TRAP_NULL_FUNCTION;
+      instance->table[elems->table_offset + j] = func_index;
+    }
+  }
+
+  //==== Initialize globals ==========================================
+  instance->globals = (wasm_value_t*)malloc(sizeof(wasm_value_t) * (module->num_globals + 1));
+  for (uint32_t i = 0; i < module->num_globals; i++) {
+    wasm_global_decl_t* global = &module->globals[i];
+    if (global->init.tag == global->type) instance->globals[i] = global->init;
+    else instance->globals[i] = default_value(global->type);
+  }
+
+  //==== Allocate the stacks =========================================
+  instance->stack_start = (wasm_value_t*)malloc(sizeof(wasm_value_t) * STACK_SIZE);
+  instance->stack_end = instance->stack_start + STACK_SIZE;
+  instance->frames_start = (wasm_frame_t*)malloc(sizeof(wasm_frame_t) * MAX_FRAMES);
+  instance->frames_end = instance->frames_start + MAX_FRAMES;
+  instance->heap = new_obj_heap();
+  instance->caches = (obj_cache_t*)calloc(module->num_caches + 1, sizeof(obj_cache_t));
+  obj_roots_t roots = {instance->stack_start, instance->globals, module->num_globals,
+                       instance->caches, module->num_caches};
+  obj_set_roots(instance->heap, &roots);
+
+  //==== Bind imports to host functions ==============================
+  instance->imports = (const host_func_t**)calloc(module->num_imports + 1, sizeof(host_func_t*));
+  for (uint32_t i = 0; i < module->num_imports; i++) {
+    wasm_import_decl_t* decl = &module->imports[i];
+    if (module->funcs[decl->index].intrinsic != WEEWASM_INTRINSIC_HOST) continue;
+    const host_func_t* host = lookup_import(decl->mod_name, decl->member_name);
+    if (host == NULL || host->intrinsic != WEEWASM_INTRINSIC_HOST) {
+      ERR("!unresolved import: %s.%s\n", decl->mod_name, decl->member_name);
+    } else if (!sig_matches(&module->sigs[module->funcs[decl->index].sig_index], host->sig)) {
+      ERR("!signature mismatch for import: %s.%s\n", decl->mod_name, decl->member_name);
+    } else {
+      instance->imports[decl->index] = host;
+    }
+  }
+  return TRAP_NONE;
+}
+
+wasm_trap_t instantiate_wasm_module(wasm_module_t* module, wasm_instance_t* instance) {
+  log_event(EVENT_BEGIN, EVENT_INSTANTIATE, 0);
+  wasm_trap_t trap = instantiate(module, instance);
+  log_event(EVENT_END, EVENT_INSTANTIATE, 0);
+  if (thread_stats() != NULL) {
+    count_bytes(BYTES_MEMORY, (uint64_t)(instance->mem_end - instance->mem_start));
+    count_bytes(BYTES_INSTANCE, sizeof(uint32_t) * instance->table_size +
+                sizeof(wasm_value_t) * (module->num_globals + STACK_SIZE) +
+                sizeof(wasm_frame_t) * MAX_FRAMES + sizeof(obj_cache_t) * module->num_caches);
+  }
+  return trap;
+}
+
+void free_wasm_instance(wasm_instance_t* instance) {
+  if (instance->heap != NULL) count_bytes(BYTES_OBJECTS, obj_gc_stats(instance->heap)->allocated_bytes);
+  if (instance->template != NULL) free_instance_template(instance);
+  else free(instance->mem_start);
+  free(instance->table);
+  free(instance->globals);
+  free(instance->stack_start);
+  free(instance->frames_start);
+  free_obj_heap(instance->heap);
+  free(instance->caches);
+  free(instance->imports);
+  memset(instance, 0, sizeof(wasm_instance_t));
+}
+
+// Writes {length} bytes of memory at {offset} to the output.
+static wasm_trap_t put_string(wasm_instance_t* instance, uint32_t offset, uint32_t length) {
+  if ((uint64_t)offset + length > (uint64_t)(instance->mem_end - instance->mem_start)) {
+    return TRAP_MEM_OUT_OF_BOUNDS;
+  }
+  out_bytes(instance->mem_start + offset, length);
+  return TRAP_NONE;
+}
+
+// Calls a host intrinsic with the arguments at {args}, which also receives the results.
+static wasm_trap_t call_intrinsic(wasm_instance_t* instance, wasm_func_decl_t* func, wasm_value_t* args) {
+  switch (func->intrinsic) {
+  case WEEWASM_INTRINSIC_PUTI: {
+    out_i32((int32_t)args[0].val.i32);
+    return TRAP_NONE;
+  }
+  case WEEWASM_INTRINSIC_PUTD: {
+    out_f64(args[0].val.f64);
+    return TRAP_NONE;
+  }
+  case WEEWASM_INTRINSIC_PUTS: {
+    return put_string(instance, args[0].val.i32, args[1].val.i32);
+  }
+  case WEEWASM_INTRINSIC_OBJ_NEW: {
+    args[0] = wasm_ref_value(obj_new(instance->heap, args));
+    return TRAP_NONE;
+  }
+  case WEEWASM_INTRINSIC_OBJ_GET: {
+    void* result;
+    wasm_trap_t trap = obj_get(args[0].val.ref, args[1].val.ref, &result);
+    args[0] = wasm_ref_value(result);
+    return trap;
+  }
+  case WEEWASM_INTRINSIC_OBJ_SET: {
+    return obj_set(instance->heap, args[0].val.ref, args[1].val.ref, args[2].val.ref);
+  }
+  case WEEWASM_INTRINSIC_OBJ_BOX_I32: {
+    args[0] = wasm_ref_value(obj_box_i32((int32_t)args[0].val.i32));
+    return TRAP_NONE;
+  }
+  case WEEWASM_INTRINSIC_OBJ_BOX_F64: {
+    args[0] = wasm_ref_value(obj_box_f64(args[0].val.f64));
+    return TRAP_NONE;
+  }
+  case WEEWASM_INTRINSIC_I32_UNBOX: {
+    int32_t result = 0;
+    wasm_trap_t trap = obj_unbox_i32(args[0].val.ref, &result);
+    args[0] = wasm_i32_value(result);
+    return trap;
+  }
+  case WEEWASM_INTRINSIC_F64_UNBOX: {
+    double result = 0;
+    wasm_trap_t trap = obj_unbox_f64(args[0].val.ref, &result);
+    args[0] = wasm_f64_value(result);
+    return trap;
+  }
+  case WEEWASM_INTRINSIC_OBJ_EQ: {
+    args[0] = wasm_i32_value(obj_eq(args[0].val.ref, args[1].val.ref));
+    return TRAP_NONE;
+  }
+  default:
+    return TRAP_UNBOUND_IMPORT;
+  }
+}
+
+// Returns 1 if the two signatures are structurally equal.
+static int sigs_equal(wasm_module_t* module, uint32_t a, uint32_t b) {
+  if (a == b) return 1;
+  wasm_sig_decl_t* x = &module->sigs[a];
+  wasm_sig_decl_t* y = &module->sigs[b];
+  if (x->num_params != y->num_params || x->num_results != y->num_results) return 0;
+  for (uint32_t i = 0; i < x->num_params; i++) {
+    if (x->params[i] != y->params[i]) return 0;
+  }
+  for (uint32_t i = 0; i < x->num_results; i++) {
+    if (x->results[i] != y->results[i]) return 0;
+  }
+  return 1;
+}
+
+// Decodes an unsigned LEB immediate from validated code.
+static inline uint32_t next_u32leb(const byte** ip, const byte* end) {
+  uint32_t b = **ip;
+  if (b < 0x80) {
+    (*ip)++;
+    return b;
+  }
+  ssize_t len = 0;
+  uint32_t val = decode_u32leb(*ip, end, &len);
+  *ip += len;
+  return val;
+}
+
+// Decodes a signed LEB immediate from validated code.
+static inline int32_t next_i32leb(const byte** ip, const byte* end) {
+  ssize_t len = 0;
+  int32_t val = decode_i32leb(*ip, end, &len);
+  *ip += len;
+  return val;
+}
+
+// Decodes a memory argument and computes the effective address of an access of
+// {size} bytes, returning NULL if the access is out of bounds.
+static inline byte* effective_address(wasm_instance_t* instance, const byte** ip, const byte* end,
+                                      uint32_t addr, uint32_t size) {
+  (*ip)++; // alignment, not used
+  uint32_t offset = next_u32leb(ip, end);
+  uint64_t ea = (uint64_t)addr + offset;
+  if (ea + size > (uint64_t)(instance->mem_end - instance->mem_start)) return NULL;
+  return instance->mem_start + ea;
+}
+
+#define TRAP(t) do { trap = (t); goto done; } while (0)
+
+#define SET_I32(slot, v) do { (slot).tag = I32; (slot).val.i32 = (uint32_t)(v); } while (0)
+#define SET_F64(slot, v) do { (slot).tag = F64; (slot).val.f64 = (v); } while (0)
+#define SET_REF(slot, v) do { (slot).tag = EXTERNREF; (slot).val.ref = (v); } while (0)
+
+#define I32_UNOP(expr) do { uint32_t a = sp[-1].val.i32; sp[-1].val.i32 = (uint32_t)(expr); } while (0)
+#define I32_BINOP(expr) do { uint32_t b = (--sp)->val.i32; uint32_t a = sp[-1].val.i32; sp[-1].val.i32 = (uint32_t)(expr); } while (0)
+#define F64_BINOP(expr) do { double b = (--sp)->val.f64; double a = sp[-1].val.f64; sp[-1].val.f64 = (expr); } while (0)
+#define F64_CMPOP(expr) do { double b = (--sp)->val.f64; double a = sp[-1].val.f64; SET_I32(sp[-1], (expr)); } while (0)
+
+#define LOAD(ctype, size, SET) do {                                     \
+    byte* p = effective_address(instance, &ip, code_end, sp[-1].val.i32, size); \
+    if (p == NULL) TRAP(TRAP_MEM_OUT_OF_BOUNDS);                        \
+    ctype v;                                                            \
+    memcpy(&v, p, size);                                                \
+    SET(sp[-1], v);                                                     \
+  } while (0)
+
+#define STORE(ctype, size, field) do {                                  \
+    sp -= 2;                                                            \
+    byte* p = effective_address(instance, &ip, code_end, sp[0].val.i32, size); \
+    if (p == NULL) TRAP(TRAP_MEM_OUT_OF_BOUNDS);                        \
+    ctype v = (ctype)sp[1].val.field;                                   \
+    memcpy(p, &v, size);                                                \
+  } while (0)
+
+// Takes the branch whose 4-byte pc delta is at {pcdelta}, using the side table
+// {entry} to adjust the operand stack and the side table pointer.
+#define TAKE_BRANCH(pcdelta, entry) do {                                \
+    const wasm_sidetable_entry_t* e = (entry);                          \
+    int32_t delta;                                                      \
+    memcpy(&delta, (pcdelta), 4);                                       \
+    ip = (pcdelta) + delta;                                             \
+    if (e->pop_count != 0) {                                            \
+      wasm_value_t* vals = sp - e->val_count;                           \
+      sp = vals - e->pop_count;                                         \
+      for (uint32_t i = 0; i < e->val_count; i++) *sp++ = vals[i];      \
+    }                                                                   \
+    stp = e + e->stp_delta;                                             \
+    if (delta < 0) {                                                    \
+      GC_SAFEPOINT();                                                   \
+      CHARGE_FUEL();                                                    \
+      POLL();                                                           \
+    }                                                                   \
+  } while (0)
+
+// Handles the requests in the instance's poll word, which is checked at the same
+// places fuel is charged.
+#define POLL() do {                                                     \
+    if (instance->poll != 0) {                                          \
+      trap = handle_poll(instance, frame, ip);                          \
+      if (trap != TRAP_NONE) goto done;                                 \
+    }                                                                   \
+  } while (0)
+
+// Loop back-edges take a step of incremental marking, if it is in progress.
+#define GC_SAFEPOINT() do {                                             \
+    if (obj_is_marking(instance->heap)) obj_gc_step(instance->heap, sp, OBJ_MARK_BUDGET); \
+  } while (0)
+
+// Handlers are labels reached through a dispatch table generated from the opcode
+// specification, and each handler dispatches the next instruction itself, after
+// the tracing and counting of the variant of the loop, if any.
+#define CASE(name) op_##name
+#define NEXT() do {                                                     \
+    TRACE_OP();                                                         \
+    COUNT_OP();                                                         \
+    goto *dispatch_table[*ip++];                                        \
+  } while (0)
+#define DISPATCH_ENTRY(name, code, mnemonic, imm) [code] = &&op_##name,
+
+// Takes the requests in the poll word of {instance}, where {frame} is executing
+// at {ip}. Returns TRAP_INTERRUPTED if it was interrupted.
+static wasm_trap_t handle_poll(wasm_instance_t* instance, wasm_frame_t* frame, const byte* ip) {
+  int poll = __atomic_fetch_and(&instance->poll, ~POLL_SAMPLE, __ATOMIC_RELAXED);
+  if ((poll & POLL_SAMPLE) && instance->profile != NULL && frame != NULL) {
+    profile_sample(instance->profile, instance, frame, (uint32_t)(ip - instance->module->bytes_start));
+  }
+  return (poll & POLL_INTERRUPT) ? TRAP_INTERRUPTED : TRAP_NONE;
+}
+
+// Returns the index of the function that imports {intrinsic}, for the events of
+// the intrinsics whose immediate the loader replaced with a cache index.
+static uint32_t intrinsic_func_index(wasm_module_t* module, uint8_t intrinsic) {
+  uint32_t i = 0;
+  while (i < module->num_funcs && module->funcs[i].intrinsic != intrinsic) i++;
+  return i;
+}
+
+// The variants of the interpreter loop, each of which adds to the one before.
+// Tracing is a global switch, so the tracing variant does everything the others
+// do. The variants from the observed one on check whether the instance has fuel
+// before charging it, so only the plain and metered variants are specialized
+// to what their instance asks for. The plain variant has no instrumentation, but
+// still makes the checks the runtime needs on every run: at each loop back-edge
+// it takes a step of incremental marking if the heap is being marked, and at
+// each back-edge and call it tests the poll word, for weerun_interrupt() and
+// the sampling profiler. Each call also checks the stacks for overflow.
+#define EXECUTE execute_plain
+#define INTERP_TRACE 0
+#define INTERP_FUEL 0
+#define INTERP_EVENTS 0
+#define INTERP_COUNT 0
+#include "interp_loop.h"
+#undef EXECUTE
+#undef INTERP_FUEL
+#define EXECUTE execute_metered
+#define INTERP_FUEL 1
+#include "interp_loop.h"
+#undef EXECUTE
+#undef INTERP_EVENTS
+#define EXECUTE execute_observed
+#define INTERP_EVENTS 1
+#include "interp_loop.h"
+#undef EXECUTE
+#undef INTERP_COUNT
+#define EXECUTE execute_profiling
+#define INTERP_COUNT 1
+#include "interp_loop.h"
+#undef EXECUTE
+#undef INTERP_TRACE
+#define EXECUTE execute_tracing
+#define INTERP_TRACE 1
+#include "interp_loop.h"
+#undef EXECUTE
+#undef INTERP_TRACE
+#undef INTERP_FUEL
+#undef INTERP_EVENTS
+#undef INTERP_COUNT
+
+// Executes the function at {func_index}, whose arguments are on the stack below {sp},
+// or continues the suspended call in {resume} if it is not NULL. The results are
+// left at the start of the stack. Picks the variant of the loop on each entry, so
+// fuel set while the loop runs applies from the next entry.
+static wasm_trap_t execute(wasm_instance_t* instance, uint32_t func_index, wasm_value_t* sp,
+                           const wasm_suspension_t* resume) {
+  if (g_trace) return execute_tracing(instance, func_index, sp, resume);
+  if (instance->opstats != NULL) return execute_profiling(instance, func_index, sp, resume);
+  if (g_event_capacity != 0 || g_stats) return execute_observed(instance, func_index, sp, resume);
+  if (instance->fuel != FUEL_UNLIMITED) return execute_metered(instance, func_index, sp, resume);
+  return execute_plain(instance, func_index, sp, resume);
+}
+
+// Returns {trap}, logging it like the traps of the interpreter loop unless it is
+// a suspension, for the calls that return before the loop starts.
+static wasm_trap_t log_trap(wasm_trap_t trap) {
+  if (trap != TRAP_NONE && trap != TRAP_PENDING) log_event(EVENT_INSTANT, EVENT_TRAP, trap);
+  return trap;
+}
+
+wasm_trap_t invoke_wasm_function(wasm_instance_t* instance, uint32_t func_index,
+                                 wasm_value_t* args, wasm_value_t* results) {
+  wasm_module_t* module = instance->module;
+  wasm_func_decl_t* func = &module->funcs[func_index];
+  wasm_sig_decl_t* sig = &module->sigs[func->sig_index];
+  wasm_value_t* sp = instance->stack_start;
+  if (instance->suspension.active) return TRAP_PENDING; // the stack is in use
+  for (uint32_t i = 0; i < sig->num_params; i++) {
+    if (args[i].tag != sig->params[i]) return log_trap(TRAP_INVALID_ARGS);
+    *sp++ = args[i];
+  }
+  wasm_trap_t trap;
+  instance->suspension.entry_func = func_index;
+  if (func->intrinsic == WEEWASM_INTRINSIC_HOST) {
+    const host_func_t* host = instance->imports[func_index];
+    log_event(EVENT_BEGIN, EVENT_HOST_CALL, func_index);
+    trap = host == NULL ? TRAP_UNBOUND_IMPORT : host->fn(instance, host->data, instance->stack_start);
+    log_event(EVENT_END, EVENT_HOST_CALL, func_index);
+    log_trap(trap);
+    if (trap == TRAP_PENDING) {
+      wasm_suspension_t* s = &instance->suspension;
+      s->active = 1;
+      s->frame = NULL;
+      s->args = instance->stack_start;
+      s->sig = sig;
+    }
+  } else if (func->intrinsic != 0) {
+    log_event(EVENT_BEGIN, EVENT_HOST_CALL, func_index);
+    trap = call_intrinsic(instance, func, instance->stack_start);
+    log_event(EVENT_END, EVENT_HOST_CALL, func_index);
+    log_trap(trap);
+  } else {
+    trap = execute(instance, func_index, sp, NULL);
+  }
+  if (trap != TRAP_NONE) return trap;
+  for (uint32_t i = 0; i < sig->num_results; i++) results[i] = instance->stack_start[i];
+  return TRAP_NONE;
+}
+
+wasm_trap_t resume_wasm_function(wasm_instance_t* instance, const wasm_value_t* host_results,
+                                 wasm_value_t* results) {
+  wasm_suspension_t* s = &instance->suspension;
+  if (!s->active) return log_trap(TRAP_INVALID_ARGS);
+  for (uint32_t i = 0; i < s->sig->num_results; i++) {
+    if (host_results[i].tag != s->sig->results[i]) return log_trap(TRAP_INVALID_ARGS);
+    s->args[i] = host_results[i];
+  }
+  s->active = 0;
+  wasm_trap_t trap = TRAP_NONE;
+  if (s->frame != NULL) {
+    wasm_suspension_t resume = *s;
+    trap = execute(instance, s->entry_func, NULL, &resume);
+  }
+  if (trap != TRAP_NONE) return trap;
+  wasm_module_t* module = instance->module;
+  wasm_sig_decl_t* sig = &module->sigs[module->funcs[s->entry_func].sig_index];
+  for (uint32_t i = 0; i < sig->num_results; i++) results[i] = instance->stack_start[i];
+  return TRAP_NONE;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ir.h"
+
+// The size of a page of linear memory.
+#define WASM_PAGE_SIZE 65536
+
+// The reasons execution can trap.
+typedef enum {
+  TRAP_NONE = 0,
+  TRAP_UNREACHABLE,
+  TRAP_MEM_OUT_OF_BOUNDS,
+  TRAP_DIV_BY_ZERO,
+  TRAP_DIV_OVERFLOW,
+  TRAP_INVALID_CONVERSION,
+  TRAP_TABLE_OUT_OF_BOUNDS,
+  TRAP_NULL_FUNCTION,
+  TRAP_SIG_MISMATCH,
+  TRAP_STACK_OVERFLOW,
+  TRAP_UNBOUND_IMPORT,
+  TRAP_INVALID_ARGS,
+  TRAP_NULL_REFERENCE,
+  TRAP_TYPE_MISMATCH,
+  TRAP_OUT_OF_FUEL,
+  TRAP_INTERRUPTED,
+  TRAP_PENDING, // not a trap: a host function suspended the instance
+} wasm_trap_t;
+
+// The fuel of an instance that is not metered.
+#define FUEL_UNLIMITED INT64_MAX
+
+// Returns a human-readable description of a trap reason.
+const char* trap_name(wasm_trap_t trap);
+
+// Allocates memory, table, and globals for {module} and initializes them from
+// the data and element segments. Does not run the start function.
+wasm_trap_t instantiate_wasm_module(wasm_module_t* module, wasm_instance_t* instance);
+
+// Frees the storage of an instance created by {instantiate_wasm_module}.
+void free_wasm_instance(wasm_instance_t* instance);
+
+// Calls the function at {func_index} with the given arguments, which must match its
+// signature, writing its results (if any) into {results}. Returns TRAP_PENDING if
+// a host function suspended the instance, which must then be resumed before it
+// can be called again.
+wasm_trap_t invoke_wasm_function(wasm_instance_t* instance, uint32_t func_index,
+                                 wasm_value_t* args, wasm_value_t* results);
+
+// Completes the host call that suspended {instance} with {host_results} and
+// continues the suspended call, writing its results into {results} when it
+// returns. Returns TRAP_PENDING if it is suspended again.
+wasm_trap_t resume_wasm_function(wasm_instance_t* instance, const wasm_value_t* host_results,
+                                 wasm_value_t* results);
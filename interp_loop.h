@@ -0,0 +1,482 @@
+// The interpreter loop. interp.c includes this file once for each variant of
+// the loop, after defining EXECUTE as the name of the variant and INTERP_TRACE,
+// INTERP_FUEL, INTERP_EVENTS and INTERP_COUNT as 0 or 1, so that the
+// instrumentation a variant does not have is not compiled into it at all.
+
+#if INTERP_TRACE
+#define TRACE_OP() TRACE("  @+%d %s\n", (int)(ip - bytes), bytecode_name(*ip))
+#define TRACE_FRAME(...) TRACE_INDENT(__VA_ARGS__)
+#define SET_INDENT(n) (g_indent = (n))
+#else
+#define TRACE_OP() do { } while (0)
+#define TRACE_FRAME(...) do { } while (0)
+#define SET_INDENT(n) do { } while (0)
+#endif
+
+// Fuel is charged once per loop iteration and per call, which bounds every run
+// while leaving straight-line code unmetered. The variants that also log
+// events, count or trace run instances with and without fuel, so they skip
+// unlimited ones.
+#if INTERP_FUEL && (INTERP_EVENTS || INTERP_COUNT || INTERP_TRACE)
+#define CHARGE_FUEL() do {                                              \
+    if (instance->fuel != FUEL_UNLIMITED && --instance->fuel < 0) {     \
+      TRAP(TRAP_OUT_OF_FUEL);                                           \
+    }                                                                   \
+  } while (0)
+#elif INTERP_FUEL
+#define CHARGE_FUEL() do {                                              \
+    if (--instance->fuel < 0) TRAP(TRAP_OUT_OF_FUEL);                   \
+  } while (0)
+#else
+#define CHARGE_FUEL() do { } while (0)
+#endif
+
+// The tracing variant also counts, but only if the instance has opstats.
+#if INTERP_COUNT && INTERP_TRACE
+#define COUNT_OP() do { if (instance->opstats != NULL) opstats_count(instance->opstats, ip); } while (0)
+#elif INTERP_COUNT
+#define COUNT_OP() opstats_count(instance->opstats, ip)
+#else
+#define COUNT_OP() do { } while (0)
+#endif
+
+// Records and counts an event if the thread records events or collects stats.
+// The {index} is only evaluated if it does.
+#if INTERP_EVENTS
+#define EVENT(phase, type, index) do {                                  \
+    if (observed) emit_event(events, stats, phase, type, index);        \
+  } while (0)
+#else
+#define EVENT(phase, type, index) do { (void)sizeof(index); } while (0)
+#endif
+
+// Intrinsics the loader lowered into opcodes are logged like calls to host
+// functions. They are counted in a local, which is added to the stats when the
+// loop returns, so the events only go to the ring. The variants without events
+// never collect stats, so they do neither.
+#if INTERP_EVENTS
+#define INTRINSIC_BEGIN(index) do {                                     \
+    intrinsic_calls++;                                                  \
+    if (events != NULL) record_event(events, EVENT_BEGIN, EVENT_HOST_CALL, index); \
+  } while (0)
+#define INTRINSIC_END(index) do {                                       \
+    if (events != NULL) record_event(events, EVENT_END, EVENT_HOST_CALL, index); \
+  } while (0)
+#define COUNT_INTRINSICS() count_intrinsic_calls(intrinsic_calls)
+#else
+#define INTRINSIC_BEGIN(index) do { (void)sizeof(index); } while (0)
+#define INTRINSIC_END(index) do { (void)sizeof(index); } while (0)
+#define COUNT_INTRINSICS() do { } while (0)
+#endif
+
+static wasm_trap_t EXECUTE(wasm_instance_t* instance, uint32_t func_index, wasm_value_t* sp,
+                           const wasm_suspension_t* resume) {
+  wasm_module_t* module = instance->module;
+  const byte* bytes = module->bytes_start;
+  wasm_frame_t* frame = NULL;
+  wasm_func_decl_t* func = NULL;
+  wasm_value_t* fp = NULL;
+  const byte* ip = NULL;
+  const byte* code_end = NULL;
+  const wasm_sidetable_entry_t* stp = NULL;
+  wasm_trap_t trap = TRAP_NONE;
+  uint32_t callee = func_index;
+#if INTERP_EVENTS
+  uint64_t intrinsic_calls = 0;
+  event_ring_t* events = thread_events();
+  run_stats_t* stats = thread_stats();
+  int observed = events != NULL || stats != NULL;
+#endif
+  // every opcode starts out illegal and the implemented ones override that
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static const void* dispatch_table[256] = {
+    [0 ... 255] = &&op_illegal,
+    FOREACH_OPCODE(DISPATCH_ENTRY)
+    FOREACH_INTERNAL_OPCODE(DISPATCH_ENTRY)
+  };
+#pragma GCC diagnostic pop
+  if (resume == NULL) goto do_call;
+  frame = resume->frame;
+  func = &module->funcs[frame->func_index];
+  fp = frame->fp;
+  ip = frame->ip;
+  stp = frame->stp;
+  code_end = bytes + func->code_end;
+  sp = resume->args + resume->sig->num_results;
+  SET_INDENT((int)(frame - instance->frames_start) + 1);
+  NEXT();
+
+  CASE(UNREACHABLE): TRAP(TRAP_UNREACHABLE);
+  CASE(NOP): NEXT();
+  CASE(BLOCK): // fall through
+  CASE(LOOP): ip++; NEXT(); // skip empty block type
+  CASE(END): {
+    if (ip == code_end) goto do_return;
+    NEXT();
+  }
+  CASE(JMP): {
+    TAKE_BRANCH(ip, stp);
+    NEXT();
+  }
+  CASE(JMP_IF): {
+    if ((--sp)->val.i32 != 0) {
+      TAKE_BRANCH(ip, stp);
+    } else {
+      ip += 4;
+      stp++;
+    }
+    NEXT();
+  }
+  CASE(JMP_TABLE): {
+    uint32_t count = next_u32leb(&ip, code_end);
+    uint32_t index = (--sp)->val.i32;
+    if (index > count) index = count;
+    TAKE_BRANCH(ip + 4 * index, stp + index);
+    NEXT();
+  }
+  CASE(RETURN): goto do_return;
+  CASE(CALL): {
+    callee = next_u32leb(&ip, code_end);
+    goto do_call;
+  }
+  CASE(CALL_INDIRECT): {
+    uint32_t sig_index = next_u32leb(&ip, code_end);
+    next_u32leb(&ip, code_end); // table index
+    uint32_t index = (--sp)->val.i32;
+    if (index >= instance->table_size) TRAP(TRAP_TABLE_OUT_OF_BOUNDS);
+    callee = instance->table[index];
+    if (callee == NULL_FUNC) TRAP(TRAP_NULL_FUNCTION);
+    if (!sigs_equal(module, module->funcs[callee].sig_index, sig_index)) TRAP(TRAP_SIG_MISMATCH);
+    goto do_call;
+  }
+  CASE(SKIP): {
+    uint32_t count = next_u32leb(&ip, code_end);
+    ip += count;
+    NEXT();
+  }
+  // intrinsics, lowered from calls by the loader; the immediate is the function index
+  CASE(PUTI): {
+    callee = next_u32leb(&ip, code_end);
+    INTRINSIC_BEGIN(callee);
+    out_i32((int32_t)(--sp)->val.i32);
+    INTRINSIC_END(callee);
+    NEXT();
+  }
+  CASE(PUTD): {
+    callee = next_u32leb(&ip, code_end);
+    INTRINSIC_BEGIN(callee);
+    out_f64((--sp)->val.f64);
+    INTRINSIC_END(callee);
+    NEXT();
+  }
+  CASE(PUTS): {
+    callee = next_u32leb(&ip, code_end);
+    sp -= 2;
+    INTRINSIC_BEGIN(callee);
+    wasm_trap_t t = put_string(instance, sp[0].val.i32, sp[1].val.i32);
+    INTRINSIC_END(callee);
+    if (t != TRAP_NONE) TRAP(t);
+    NEXT();
+  }
+  CASE(OBJ_NEW): {
+    callee = next_u32leb(&ip, code_end);
+    INTRINSIC_BEGIN(callee);
+    void* obj = obj_new(instance->heap, sp);
+    INTRINSIC_END(callee);
+    SET_REF(*sp, obj);
+    sp++;
+    NEXT();
+  }
+  CASE(OBJ_BOX_I32): {
+    callee = next_u32leb(&ip, code_end);
+    INTRINSIC_BEGIN(callee);
+    SET_REF(sp[-1], obj_box_i32((int32_t)sp[-1].val.i32));
+    INTRINSIC_END(callee);
+    NEXT();
+  }
+  CASE(OBJ_BOX_F64): {
+    callee = next_u32leb(&ip, code_end);
+    INTRINSIC_BEGIN(callee);
+    SET_REF(sp[-1], obj_box_f64(sp[-1].val.f64));
+    INTRINSIC_END(callee);
+    NEXT();
+  }
+  CASE(I32_UNBOX): {
+    callee = next_u32leb(&ip, code_end);
+    int32_t result;
+    INTRINSIC_BEGIN(callee);
+    wasm_trap_t t = obj_unbox_i32(sp[-1].val.ref, &result);
+    INTRINSIC_END(callee);
+    if (t != TRAP_NONE) TRAP(t);
+    SET_I32(sp[-1], result);
+    NEXT();
+  }
+  CASE(F64_UNBOX): {
+    callee = next_u32leb(&ip, code_end);
+    double result;
+    INTRINSIC_BEGIN(callee);
+    wasm_trap_t t = obj_unbox_f64(sp[-1].val.ref, &result);
+    INTRINSIC_END(callee);
+    if (t != TRAP_NONE) TRAP(t);
+    SET_F64(sp[-1], result);
+    NEXT();
+  }
+  CASE(OBJ_EQ): {
+    callee = next_u32leb(&ip, code_end);
+    sp--;
+    INTRINSIC_BEGIN(callee);
+    SET_I32(sp[-1], obj_eq(sp[-1].val.ref, sp[0].val.ref));
+    INTRINSIC_END(callee);
+    NEXT();
+  }
+  // the immediate of these is the index of their cache instead
+  CASE(OBJ_GET_CACHED): {
+    obj_cache_t* cache = &instance->caches[next_u32leb(&ip, code_end)];
+    void* result;
+    sp--;
+    INTRINSIC_BEGIN(intrinsic_func_index(module, WEEWASM_INTRINSIC_OBJ_GET));
+    wasm_trap_t t = obj_get_cached(cache, sp[-1].val.ref, sp[0].val.ref, &result);
+    INTRINSIC_END(intrinsic_func_index(module, WEEWASM_INTRINSIC_OBJ_GET));
+    if (t != TRAP_NONE) TRAP(t);
+    sp[-1].val.ref = result;
+    NEXT();
+  }
+  CASE(OBJ_SET_CACHED): {
+    obj_cache_t* cache = &instance->caches[next_u32leb(&ip, code_end)];
+    sp -= 3;
+    INTRINSIC_BEGIN(intrinsic_func_index(module, WEEWASM_INTRINSIC_OBJ_SET));
+    wasm_trap_t t = obj_set_cached(instance->heap, cache, sp[0].val.ref, sp[1].val.ref, sp[2].val.ref);
+    INTRINSIC_END(intrinsic_func_index(module, WEEWASM_INTRINSIC_OBJ_SET));
+    if (t != TRAP_NONE) TRAP(t);
+    NEXT();
+  }
+  CASE(DROP): sp--; NEXT();
+  CASE(SELECT): {
+    sp -= 2;
+    if (sp[1].val.i32 == 0) sp[-1] = sp[0];
+    NEXT();
+  }
+  CASE(LOCAL_GET): *sp++ = fp[next_u32leb(&ip, code_end)]; NEXT();
+  CASE(LOCAL_SET): fp[next_u32leb(&ip, code_end)] = *--sp; NEXT();
+  CASE(LOCAL_TEE): fp[next_u32leb(&ip, code_end)] = sp[-1]; NEXT();
+  CASE(GLOBAL_GET): *sp++ = instance->globals[next_u32leb(&ip, code_end)]; NEXT();
+  CASE(GLOBAL_SET): {
+    wasm_value_t* global = &instance->globals[next_u32leb(&ip, code_end)];
+    *global = *--sp;
+    if (global->tag == EXTERNREF && obj_is_marking(instance->heap)) obj_shade(instance->heap, global->val.ref);
+    NEXT();
+  }
+  CASE(I32_LOAD): LOAD(int32_t, 4, SET_I32); NEXT();
+  CASE(F64_LOAD): LOAD(double, 8, SET_F64); NEXT();
+  CASE(I32_LOAD8_S): LOAD(int8_t, 1, SET_I32); NEXT();
+  CASE(I32_LOAD8_U): LOAD(uint8_t, 1, SET_I32); NEXT();
+  CASE(I32_LOAD16_S): LOAD(int16_t, 2, SET_I32); NEXT();
+  CASE(I32_LOAD16_U): LOAD(uint16_t, 2, SET_I32); NEXT();
+  CASE(I32_STORE): STORE(uint32_t, 4, i32); NEXT();
+  CASE(F64_STORE): STORE(double, 8, f64); NEXT();
+  CASE(I32_STORE8): STORE(uint8_t, 1, i32); NEXT();
+  CASE(I32_STORE16): STORE(uint16_t, 2, i32); NEXT();
+  CASE(I32_CONST): {
+    SET_I32(*sp, next_i32leb(&ip, code_end));
+    sp++;
+    NEXT();
+  }
+  CASE(F64_CONST): {
+    double v;
+    memcpy(&v, ip, 8);
+    ip += 8;
+    SET_F64(*sp, v);
+    sp++;
+    NEXT();
+  }
+  CASE(I32_EQZ): I32_UNOP(a == 0); NEXT();
+  CASE(I32_EQ): I32_BINOP(a == b); NEXT();
+  CASE(I32_NE): I32_BINOP(a != b); NEXT();
+  CASE(I32_LT_S): I32_BINOP((int32_t)a < (int32_t)b); NEXT();
+  CASE(I32_LT_U): I32_BINOP(a < b); NEXT();
+  CASE(I32_GT_S): I32_BINOP((int32_t)a > (int32_t)b); NEXT();
+  CASE(I32_GT_U): I32_BINOP(a > b); NEXT();
+  CASE(I32_LE_S): I32_BINOP((int32_t)a <= (int32_t)b); NEXT();
+  CASE(I32_LE_U): I32_BINOP(a <= b); NEXT();
+  CASE(I32_GE_S): I32_BINOP((int32_t)a >= (int32_t)b); NEXT();
+  CASE(I32_GE_U): I32_BINOP(a >= b); NEXT();
+  CASE(F64_EQ): F64_CMPOP(a == b); NEXT();
+  CASE(F64_NE): F64_CMPOP(a != b); NEXT();
+  CASE(F64_LT): F64_CMPOP(a < b); NEXT();
+  CASE(F64_GT): F64_CMPOP(a > b); NEXT();
+  CASE(F64_LE): F64_CMPOP(a <= b); NEXT();
+  CASE(F64_GE): F64_CMPOP(a >= b); NEXT();
+  CASE(I32_CLZ): I32_UNOP(a == 0 ? 32 : __builtin_clz(a)); NEXT();
+  CASE(I32_CTZ): I32_UNOP(a == 0 ? 32 : __builtin_ctz(a)); NEXT();
+  CASE(I32_POPCNT): I32_UNOP(__builtin_popcount(a)); NEXT();
+  CASE(I32_ADD): I32_BINOP(a + b); NEXT();
+  CASE(I32_SUB): I32_BINOP(a - b); NEXT();
+  CASE(I32_MUL): I32_BINOP(a * b); NEXT();
+  CASE(I32_DIV_S): {
+    int32_t b = (int32_t)sp[-1].val.i32;
+    int32_t a = (int32_t)sp[-2].val.i32;
+    if (b == 0) TRAP(TRAP_DIV_BY_ZERO);
+    if (a == INT32_MIN && b == -1) TRAP(TRAP_DIV_OVERFLOW);
+    sp--;
+    sp[-1].val.i32 = (uint32_t)(a / b);
+    NEXT();
+  }
+  CASE(I32_DIV_U): {
+    if (sp[-1].val.i32 == 0) TRAP(TRAP_DIV_BY_ZERO);
+    I32_BINOP(a / b);
+    NEXT();
+  }
+  CASE(I32_REM_S): {
+    int32_t b = (int32_t)sp[-1].val.i32;
+    int32_t a = (int32_t)sp[-2].val.i32;
+    if (b == 0) TRAP(TRAP_DIV_BY_ZERO);
+    sp--;
+    sp[-1].val.i32 = b == -1 ? 0 : (uint32_t)(a % b);
+    NEXT();
+  }
+  CASE(I32_REM_U): {
+    if (sp[-1].val.i32 == 0) TRAP(TRAP_DIV_BY_ZERO);
+    I32_BINOP(a % b);
+    NEXT();
+  }
+  CASE(I32_AND): I32_BINOP(a & b); NEXT();
+  CASE(I32_OR): I32_BINOP(a | b); NEXT();
+  CASE(I32_XOR): I32_BINOP(a ^ b); NEXT();
+  CASE(I32_SHL): I32_BINOP(a << (b & 31)); NEXT();
+  CASE(I32_SHR_S): I32_BINOP((int32_t)a >> (b & 31)); NEXT();
+  CASE(I32_SHR_U): I32_BINOP(a >> (b & 31)); NEXT();
+  CASE(I32_ROTL): I32_BINOP((a << (b & 31)) | (a >> ((32 - (b & 31)) & 31))); NEXT();
+  CASE(I32_ROTR): I32_BINOP((a >> (b & 31)) | (a << ((32 - (b & 31)) & 31))); NEXT();
+  CASE(F64_ADD): F64_BINOP(a + b); NEXT();
+  CASE(F64_SUB): F64_BINOP(a - b); NEXT();
+  CASE(F64_MUL): F64_BINOP(a * b); NEXT();
+  CASE(F64_DIV): F64_BINOP(a / b); NEXT();
+  CASE(I32_TRUNC_F64_S): {
+    double a = sp[-1].val.f64;
+    if (!(a > -2147483649.0 && a < 2147483648.0)) TRAP(TRAP_INVALID_CONVERSION);
+    SET_I32(sp[-1], (int32_t)a);
+    NEXT();
+  }
+  CASE(I32_TRUNC_F64_U): {
+    double a = sp[-1].val.f64;
+    if (!(a > -1.0 && a < 4294967296.0)) TRAP(TRAP_INVALID_CONVERSION);
+    SET_I32(sp[-1], (uint32_t)a);
+    NEXT();
+  }
+  CASE(F64_CONVERT_I32_S): SET_F64(sp[-1], (double)(int32_t)sp[-1].val.i32); NEXT();
+  CASE(F64_CONVERT_I32_U): SET_F64(sp[-1], (double)sp[-1].val.i32); NEXT();
+  CASE(I32_EXTEND8_S): I32_UNOP((int8_t)a); NEXT();
+  CASE(I32_EXTEND16_S): I32_UNOP((int16_t)a); NEXT();
+  CASE(BR): // fall through
+  CASE(BR_IF): // fall through
+  CASE(BR_TABLE): // rewritten by the loader
+  op_illegal: TRAP(TRAP_UNREACHABLE); // rejected by validation
+
+  do_call: {
+    wasm_func_decl_t* target = &module->funcs[callee];
+    wasm_sig_decl_t* sig = &module->sigs[target->sig_index];
+    wasm_value_t* args = sp - sig->num_params;
+    TRACE_FRAME("call func[%u]\n", callee);
+    if (target->intrinsic == WEEWASM_INTRINSIC_HOST) {
+      const host_func_t* host = instance->imports[callee];
+      if (host == NULL) TRAP(TRAP_UNBOUND_IMPORT);
+      EVENT(EVENT_BEGIN, EVENT_HOST_CALL, callee);
+      trap = host->fn(instance, host->data, args);
+      EVENT(EVENT_END, EVENT_HOST_CALL, callee);
+      if (trap == TRAP_PENDING && frame != NULL) {
+        frame->ip = ip;
+        frame->stp = stp;
+        wasm_suspension_t* s = &instance->suspension;
+        s->active = 1;
+        s->frame = frame;
+        s->args = args;
+        s->sig = sig;
+        TRACE_FRAME("suspend in func[%u]\n", callee);
+        COUNT_INTRINSICS();
+        return trap;
+      }
+      if (trap != TRAP_NONE) goto done;
+      sp = args + sig->num_results;
+      NEXT();
+    }
+    if (target->intrinsic != 0) {
+      EVENT(EVENT_BEGIN, EVENT_HOST_CALL, callee);
+      trap = call_intrinsic(instance, target, args);
+      EVENT(EVENT_END, EVENT_HOST_CALL, callee);
+      if (trap != TRAP_NONE) goto done;
+      sp = args + sig->num_results;
+      NEXT();
+    }
+    if (target->code_end == 0) TRAP(TRAP_UNBOUND_IMPORT);
+    CHARGE_FUEL();
+    POLL();
+    wasm_frame_t* next = frame == NULL ? instance->frames_start : frame + 1;
+    if (next >= instance->frames_end) TRAP(TRAP_STACK_OVERFLOW);
+    if (sp + target->num_locals + target->max_stack > instance->stack_end) TRAP(TRAP_STACK_OVERFLOW);
+    if (frame != NULL) {
+      frame->ip = ip;
+      frame->stp = stp;
+    }
+    next->func_index = callee;
+    next->fp = args;
+    for (uint32_t i = 0; i < target->num_locals; i++) {
+      *sp++ = default_value(target->local_types[i]);
+    }
+    frame = next;
+    func = target;
+    fp = args;
+    ip = bytes + target->instr_start;
+    code_end = bytes + target->code_end;
+    stp = target->sidetable;
+    SET_INDENT(g_indent + 1);
+    EVENT(EVENT_BEGIN, EVENT_CALL, callee);
+    NEXT();
+  }
+
+  do_return: {
+    wasm_sig_decl_t* sig = &module->sigs[func->sig_index];
+    wasm_value_t* results = sp - sig->num_results;
+    for (uint32_t i = 0; i < sig->num_results; i++) fp[i] = results[i];
+    sp = fp + sig->num_results;
+    SET_INDENT(g_indent - 1);
+    TRACE_FRAME("return func[%u]\n", frame->func_index);
+    EVENT(EVENT_END, EVENT_CALL, frame->func_index);
+    if (frame == instance->frames_start) goto done;
+    frame--;
+    func = &module->funcs[frame->func_index];
+    fp = frame->fp;
+    ip = frame->ip;
+    stp = frame->stp;
+    code_end = bytes + func->code_end;
+    NEXT();
+  }
+
+ done:
+  if (trap != TRAP_NONE) {
+    TRACE("trap: %s\n", trap_name(trap));
+    SET_INDENT(0);
+#if INTERP_EVENTS
+    if (observed) {
+      // the trap unwinds every frame, which ends their calls
+      emit_event(events, stats, EVENT_INSTANT, EVENT_TRAP, trap);
+      for (wasm_frame_t* f = frame; f != NULL; f = f == instance->frames_start ? NULL : f - 1) {
+        emit_event(events, stats, EVENT_END, EVENT_CALL, f->func_index);
+      }
+    }
+#endif
+    out_flush();
+  }
+  COUNT_INTRINSICS();
+  return trap;
+}
+
+#undef TRACE_OP
+#undef TRACE_FRAME
+#undef SET_INDENT
+#undef CHARGE_FUEL
+#undef COUNT_OP
+#undef EVENT
+#undef INTRINSIC_BEGIN
+#undef INTRINSIC_END
+#undef COUNT_INTRINSICS
@@ -89,3 +89,74 @@ void init_wasm_module(wasm_module_t* module) {
   module->start_func = -1;
   module->main_func = -1;
 }
+
+const char* wasm_func_name(const wasm_module_t* module, uint32_t func_index) {
+  for (uint32_t i = 0; i < module->num_func_names; i++) {
+    if (module->func_names[i].index == func_index) return module->func_names[i].name;
+  }
+  return NULL;
+}
+
+const char* wasm_func_debug_name(const wasm_module_t* module, uint32_t func_index) {
+  const char* name = wasm_func_name(module, func_index);
+  for (uint32_t i = 0; name == NULL && i < module->num_exports; i++) {
+    wasm_export_decl_t* export = &module->exports[i];
+    if (export->kind == FUNC && export->index == func_index) name = export->name;
+  }
+  return name;
+}
+
+uint64_t wasm_module_size(const wasm_module_t* module) {
+  uint64_t size = sizeof(wasm_module_t);
+  if (module->table != NULL) size += sizeof(wasm_table_decl_t);
+  size += sizeof(wasm_sig_decl_t) * module->num_sigs;
+  for (uint32_t i = 0; i < module->num_sigs; i++) {
+    size += sizeof(wasm_type_t) * (module->sigs[i].num_params + module->sigs[i].num_results);
+  }
+  size += sizeof(wasm_import_decl_t) * module->num_imports;
+  for (uint32_t i = 0; i < module->num_imports; i++) {
+    size += strlen(module->imports[i].mod_name) + strlen(module->imports[i].member_name) + 2;
+  }
+  size += sizeof(wasm_export_decl_t) * module->num_exports;
+  for (uint32_t i = 0; i < module->num_exports; i++) size += strlen(module->exports[i].name) + 1;
+  size += sizeof(wasm_func_decl_t) * module->num_funcs;
+  for (uint32_t i = 0; i < module->num_funcs; i++) {
+    size += sizeof(wasm_type_t) * module->funcs[i].num_locals;
+    size += sizeof(wasm_sidetable_entry_t) * module->funcs[i].sidetable_length;
+  }
+  size += sizeof(wasm_global_decl_t) * module->num_globals;
+  size += sizeof(wasm_data_decl_t) * module->num_data;
+  size += sizeof(wasm_elems_decl_t) * module->num_elems;
+  for (uint32_t i = 0; i < module->num_elems; i++) size += sizeof(uint32_t) * module->elems[i].length;
+  size += sizeof(wasm_func_name_t) * module->num_func_names;
+  for (uint32_t i = 0; i < module->num_func_names; i++) size += strlen(module->func_names[i].name) + 1;
+  return size;
+}
+
+void free_wasm_module(wasm_module_t* module) {
+  free(module->table);
+  for (uint32_t i = 0; i < module->num_sigs; i++) {
+    free(module->sigs[i].params);
+    free(module->sigs[i].results);
+  }
+  free(module->sigs);
+  for (uint32_t i = 0; i < module->num_imports; i++) {
+    free((char*)module->imports[i].mod_name);
+    free((char*)module->imports[i].member_name);
+  }
+  free(module->imports);
+  for (uint32_t i = 0; i < module->num_exports; i++) free((char*)module->exports[i].name);
+  free(module->exports);
+  for (uint32_t i = 0; i < module->num_funcs; i++) {
+    free(module->funcs[i].local_types);
+    free(module->funcs[i].sidetable);
+  }
+  free(module->funcs);
+  free(module->globals);
+  free(module->data);
+  for (uint32_t i = 0; i < module->num_elems; i++) free(module->elems[i].func_indexes);
+  free(module->elems);
+  for (uint32_t i = 0; i < module->num_func_names; i++) free((char*)module->func_names[i].name);
+  free(module->func_names);
+  init_wasm_module(module);
+}
@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 
+#include "common.h"
+
 typedef uint8_t byte;
 
 typedef enum {
@@ -40,6 +42,12 @@ typedef struct {
   unsigned has_max : 1;
 } wasm_limits_t;
 
+typedef struct {
+  const char* name;
+  wasm_import_kind_t kind;
+  uint32_t index;
+} wasm_export_decl_t;
+
 typedef struct {
   const char* mod_name;
   const char* member_name;
@@ -47,11 +55,26 @@ typedef struct {
   uint32_t index;
 } wasm_import_decl_t;
 
+// An entry in the side table of a function, one per branch target, in code order.
+// Taking a branch pops {pop_count} values from below the top {val_count} values
+// and advances the side table pointer by {stp_delta} entries.
+typedef struct {
+  uint32_t val_count;
+  uint32_t pop_count;
+  int32_t stp_delta;
+} wasm_sidetable_entry_t;
+
 typedef struct {
   uint8_t intrinsic;
   uint32_t sig_index;
   uint32_t code_start;
   uint32_t code_end;
+  uint32_t instr_start; // offset of the first instruction, after local declarations
+  uint32_t num_locals; // not including parameters
+  wasm_type_t* local_types;
+  uint32_t max_stack; // maximum operand stack height, computed by validation
+  uint32_t sidetable_length;
+  wasm_sidetable_entry_t* sidetable;
 } wasm_func_decl_t;
 
 typedef struct {
@@ -77,6 +100,12 @@ typedef struct {
   uint32_t bytes_end;
 } wasm_data_decl_t;
 
+// A function name from the "name" custom section.
+typedef struct {
+  uint32_t index;
+  const char* name;
+} wasm_func_name_t;
+
 typedef struct {
   uint32_t table_offset;
   uint32_t length;
@@ -95,6 +124,9 @@ typedef struct {
 
   uint32_t num_imports;
   wasm_import_decl_t* imports;
+
+  uint32_t num_exports;
+  wasm_export_decl_t* exports;
   
   uint32_t num_funcs;
   wasm_func_decl_t* funcs;
@@ -110,8 +142,45 @@ typedef struct {
 
   int32_t start_func;
   int32_t main_func;
+
+  uint32_t num_caches; // call sites rewritten to use inline caches
+
+  uint32_t num_func_names;
+  wasm_func_name_t* func_names;
+
+  void* mapping; // the module cache file this module lives in, or NULL
+  size_t mapping_size;
 } wasm_module_t;
 
+// An activation of a wasm function in the interpreter.
+typedef struct {
+  uint32_t func_index;
+  wasm_value_t* fp; // start of parameters and locals
+  const byte* ip; // saved instruction pointer while calling another function
+  const wasm_sidetable_entry_t* stp; // saved side table pointer
+} wasm_frame_t;
+
+// A call suspended in a host function. The frames and operand stack stay where
+// they are in the instance.
+typedef struct {
+  int active;
+  uint32_t entry_func; // the function the suspended call started at
+  wasm_frame_t* frame; // the innermost frame, or NULL if the host function is the entry
+  wasm_value_t* args; // the arguments of the host call, which receive its results
+  const wasm_sig_decl_t* sig; // of the host function
+} wasm_suspension_t;
+
+struct obj_heap;
+struct obj_cache;
+struct host_func;
+struct instance_template;
+struct profile;
+struct opstats;
+
+// Requests that the interpreter polls for at loop back-edges and calls.
+#define POLL_INTERRUPT 1 // trap with TRAP_INTERRUPTED
+#define POLL_SAMPLE 2 // record a profile sample
+
 typedef struct {
   wasm_module_t* module;
   
@@ -122,8 +191,45 @@ typedef struct {
   uint32_t table_size;
 
   wasm_value_t* globals;
+
+  wasm_value_t* stack_start;
+  wasm_value_t* stack_end;
+  wasm_frame_t* frames_start;
+  wasm_frame_t* frames_end;
+
+  struct obj_heap* heap; // cells referenced by externrefs
+  struct obj_cache* caches; // one per cached call site in the module
+  const struct host_func** imports; // the host functions bound to imports, or NULL
+  struct instance_template* template; // the state to reset to, if pooled
+  wasm_suspension_t suspension;
+  int64_t fuel; // a taken loop back-edge or a call costs one unit
+  volatile int poll; // POLL_* requests from a timer or another thread
+  struct profile* profile; // where samples are recorded, or NULL
+  struct opstats* opstats; // where executed instructions are counted, or NULL
 } wasm_instance_t;
 
 void init_wasm_module(wasm_module_t* module);
 
+// Returns the name of the function at {func_index} from the "name" section, or NULL.
+const char* wasm_func_name(const wasm_module_t* module, uint32_t func_index);
+
+// Returns the name of the function at {func_index} from the "name" section, or
+// else the name it is exported as, or NULL if it has neither.
+const char* wasm_func_debug_name(const wasm_module_t* module, uint32_t func_index);
+
+// Returns the number of bytes allocated for the declarations of {module}, not
+// counting its bytes.
+uint64_t wasm_module_size(const wasm_module_t* module);
+
+// Frees the storage of a module parsed by {parse_wasm_module}, but not its bytes.
+void free_wasm_module(wasm_module_t* module);
+
+// Parses a module from {buf}, validating and rewriting its code in place.
+int parse_wasm_module(buffer_t* buf, wasm_module_t* module);
+
+// Validates the code of {func} in {start ... end}, rewriting "br*" to "jmp*"
+// in place and building the side table. Returns < 0 on failure.
+// If {module} is NULL, only rewrites branches, without validation.
+int load_code(wasm_module_t* module, wasm_func_decl_t* func, byte* start, byte* end);
+
 void rewrite_brs(byte* start, byte* end);
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "ir.h"
+#include "interp.h"
+#include "imports.h"
+#include "obj.h"
+#include "out.h"
+#include "pool.h"
+#include "modcache.h"
+#include "events.h"
+#include "libweerun.h"
+
+wasm_module_t* weerun_load_module(const uint8_t* bytes, size_t length) {
+  // code is rewritten in place, so the module owns a copy of the bytes
+  byte* copy = (byte*)malloc(length > 0 ? length : 1);
+  memcpy(copy, bytes, length);
+  buffer_t buf = { copy, copy, copy + length };
+  wasm_module_t* module = (wasm_module_t*)malloc(sizeof(wasm_module_t));
+  init_wasm_module(module);
+  if (parse_wasm_module(&buf, module) < 0) {
+    ERR("!failed to parse module\n");
+    free_wasm_module(module);
+    free(module);
+    free(copy);
+    return NULL;
+  }
+  return module;
+}
+
+wasm_module_t* weerun_load_module_cached(const char* dir, const uint8_t* bytes, size_t length) {
+  wasm_module_t* module = load_module_cache(dir, bytes, length);
+  if (module != NULL) return module;
+  module = weerun_load_module(bytes, length);
+  if (module != NULL) save_module_cache(dir, bytes, length, module);
+  return module;
+}
+
+void weerun_free_module(wasm_module_t* module) {
+  if (module == NULL) return;
+  if (module->mapping != NULL) {
+    unmap_module_cache(module);
+    return;
+  }
+  byte* bytes = (byte*)module->bytes_start;
+  free_wasm_module(module);
+  free(bytes);
+  free(module);
+}
+
+// Runs the start function of {instance}, if it has one.
+static wasm_trap_t run_start(wasm_instance_t* instance) {
+  wasm_module_t* module = instance->module;
+  if (module->start_func < 0) return TRAP_NONE;
+  if ((uint32_t)module->start_func >= module->num_funcs) return TRAP_NULL_FUNCTION;
+  log_event(EVENT_BEGIN, EVENT_START, module->start_func);
+  wasm_trap_t trap = invoke_wasm_function(instance, module->start_func, NULL, NULL);
+  log_event(EVENT_END, EVENT_START, module->start_func);
+  return trap;
+}
+
+static wasm_instance_t* instantiate(wasm_module_t* module, wasm_trap_t* trap, int pooled) {
+  wasm_instance_t* instance = (wasm_instance_t*)malloc(sizeof(wasm_instance_t));
+  wasm_trap_t t = instantiate_wasm_module(module, instance);
+  if (t == TRAP_NONE && pooled) save_instance_template(instance);
+  if (t == TRAP_NONE) t = run_start(instance);
+  if (trap != NULL) *trap = t;
+  if (t != TRAP_NONE) {
+    weerun_free_instance(instance);
+    return NULL;
+  }
+  return instance;
+}
+
+wasm_instance_t* weerun_instantiate(wasm_module_t* module, wasm_trap_t* trap) {
+  return instantiate(module, trap, 0);
+}
+
+wasm_instance_t* weerun_instantiate_pooled(wasm_module_t* module, wasm_trap_t* trap) {
+  return instantiate(module, trap, 1);
+}
+
+wasm_trap_t weerun_reset_instance(wasm_instance_t* instance) {
+  if (reset_wasm_instance(instance) < 0) return TRAP_MEM_OUT_OF_BOUNDS;
+  return instance->template->after_start ? TRAP_NONE : run_start(instance);
+}
+
+void weerun_free_instance(wasm_instance_t* instance) {
+  if (instance == NULL) return;
+  out_flush();
+  free_wasm_instance(instance);
+  free(instance);
+}
+
+int32_t weerun_find_export(wasm_module_t* module, const char* name) {
+  for (uint32_t i = 0; i < module->num_exports; i++) {
+    wasm_export_decl_t* export = &module->exports[i];
+    if (export->kind == FUNC && strcmp(export->name, name) == 0) return (int32_t)export->index;
+  }
+  return -1;
+}
+
+const wasm_sig_decl_t* weerun_func_sig(wasm_module_t* module, uint32_t func_index) {
+  if (func_index >= module->num_funcs) return NULL;
+  uint32_t sig_index = module->funcs[func_index].sig_index;
+  return sig_index < module->num_sigs ? &module->sigs[sig_index] : NULL;
+}
+
+wasm_trap_t weerun_call(wasm_instance_t* instance, uint32_t func_index,
+                        wasm_value_t* args, uint32_t num_args, wasm_value_t* results) {
+  const wasm_sig_decl_t* sig = weerun_func_sig(instance->module, func_index);
+  if (sig == NULL || sig->num_params != num_args) {
+    log_event(EVENT_INSTANT, EVENT_TRAP, TRAP_INVALID_ARGS);
+    return TRAP_INVALID_ARGS;
+  }
+  return invoke_wasm_function(instance, func_index, args, results);
+}
+
+wasm_trap_t weerun_resume(wasm_instance_t* instance, const wasm_value_t* host_results,
+                          wasm_value_t* results) {
+  return resume_wasm_function(instance, host_results, results);
+}
+
+void weerun_set_fuel(wasm_instance_t* instance, int64_t fuel) {
+  instance->fuel = fuel;
+}
+
+int64_t weerun_fuel(wasm_instance_t* instance) {
+  return instance->fuel < 0 ? 0 : instance->fuel;
+}
+
+void weerun_interrupt(wasm_instance_t* instance) {
+  __atomic_fetch_or(&instance->poll, POLL_INTERRUPT, __ATOMIC_RELAXED);
+}
+
+int weerun_is_suspended(wasm_instance_t* instance) {
+  return instance->suspension.active;
+}
+
+void weerun_box_args(const wasm_sig_decl_t* sig, wasm_value_t* args) {
+  for (uint32_t i = 0; i < sig->num_params; i++) {
+    if (sig->params[i] != EXTERNREF || args[i].tag == F64) continue;
+    int32_t val = args[i].tag == I32 ? (int32_t)args[i].val.i32 : 0;
+    args[i] = wasm_ref_value(obj_box_i32(val));
+  }
+}
+
+uint64_t weerun_hash_bytes(const uint8_t* bytes, size_t length) {
+  uint64_t h = 14695981039346656037ull; // FNV-1a, a word at a time
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    h = (h ^ word) * 1099511628211ull;
+  }
+  for (; i < length; i++) h = (h ^ bytes[i]) * 1099511628211ull;
+  return h ^ (h >> 29);
+}
+
+int weerun_register_host_func(const char* mod_name, const char* member_name, const char* sig,
+                              wasm_host_fn_t fn, void* data) {
+  return register_host_func(mod_name, member_name, sig, fn, data);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// The interface for embedding weerun in another program, built as libweerun.a
+// and libweerun.so. Modules are loaded and instantiated once and can then be
+// called any number of times in-process.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+#include "interp.h"
+#include "imports.h"
+
+// Parses and validates a module from a copy of {bytes}. Returns NULL if the
+// module is invalid.
+wasm_module_t* weerun_load_module(const uint8_t* bytes, size_t length);
+
+// Like {weerun_load_module}, but first looks for the parsed module in the cache
+// directory {dir}, keyed by the hash of {bytes}, and maps it from there if it is
+// present. Otherwise the module is parsed and added to the cache.
+wasm_module_t* weerun_load_module_cached(const char* dir, const uint8_t* bytes, size_t length);
+
+// Frees a module loaded by {weerun_load_module}, after all of its instances.
+void weerun_free_module(wasm_module_t* module);
+
+// Instantiates {module}, binding its imports to the registered host functions,
+// and runs its start function. Returns NULL and sets {trap}, if it is not NULL,
+// if either traps.
+wasm_instance_t* weerun_instantiate(wasm_module_t* module, wasm_trap_t* trap);
+
+// Like {weerun_instantiate}, but saves the state before the start function runs
+// so that {weerun_reset_instance} can reuse the instance for another run.
+wasm_instance_t* weerun_instantiate_pooled(wasm_module_t* module, wasm_trap_t* trap);
+
+// Resets an instance from {weerun_instantiate_pooled} to a fresh state: restores
+// memory, globals and the table, empties the object heap and runs the start
+// function again, unless the instance was restored from a snapshot. Returns
+// TRAP_MEM_OUT_OF_BOUNDS if the memory could not be restored.
+wasm_trap_t weerun_reset_instance(wasm_instance_t* instance);
+
+// Frees an instance created by {weerun_instantiate}.
+void weerun_free_instance(wasm_instance_t* instance);
+
+// Returns the index of the function exported as {name}, or -1.
+int32_t weerun_find_export(wasm_module_t* module, const char* name);
+
+// Returns the signature of the function at {func_index}, or NULL.
+const wasm_sig_decl_t* weerun_func_sig(wasm_module_t* module, uint32_t func_index);
+
+// Calls the function at {func_index} with {num_args} arguments, writing its
+// results into {results}, which must hold as many values as the signature has
+// results. Traps with TRAP_INVALID_ARGS if the arguments do not match. Returns
+// TRAP_PENDING, without writing results, if a host function suspended the call.
+wasm_trap_t weerun_call(wasm_instance_t* instance, uint32_t func_index,
+                        wasm_value_t* args, uint32_t num_args, wasm_value_t* results);
+
+// Continues a call that returned TRAP_PENDING, with {host_results} as the results
+// of the host function that suspended it. Writes the results of the call into
+// {results} and returns like {weerun_call}, including TRAP_PENDING if another host
+// function suspends it. No thread is blocked while an instance is suspended, so
+// one thread can interleave the calls of many instances.
+wasm_trap_t weerun_resume(wasm_instance_t* instance, const wasm_value_t* host_results,
+                          wasm_value_t* results);
+
+// Limits the calls of {instance} to {fuel} units, or none if it is FUEL_UNLIMITED,
+// the default. A unit is a taken loop back-edge or a call, and a call that runs
+// out traps with TRAP_OUT_OF_FUEL. Fuel is not refilled between calls.
+void weerun_set_fuel(wasm_instance_t* instance, int64_t fuel);
+
+// Returns the fuel left to {instance}.
+int64_t weerun_fuel(wasm_instance_t* instance);
+
+// Makes the call running in {instance} trap with TRAP_INTERRUPTED at its next
+// loop back-edge, as will every later call until the instance is reset. Can be
+// called from another thread or a signal handler.
+void weerun_interrupt(wasm_instance_t* instance);
+
+// Returns 1 if {instance} is suspended in a host function.
+int weerun_is_suspended(wasm_instance_t* instance);
+
+// Converts arguments parsed by {parse_wasm_value} for a function with {sig}:
+// externref arguments are passed as numbers and boxed like noderun.js does.
+void weerun_box_args(const wasm_sig_decl_t* sig, wasm_value_t* args);
+
+// Returns a hash of the bytes of a module, for caching it by content.
+uint64_t weerun_hash_bytes(const uint8_t* bytes, size_t length);
+
+// Registers {fn} as the import {mod_name}.{member_name}, see {register_host_func}.
+// Modules loaded afterwards can import it; instances bind it when created.
+int weerun_register_host_func(const char* mod_name, const char* member_name, const char* sig,
+                              wasm_host_fn_t fn, void* data);
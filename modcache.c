@@ -0,0 +1,237 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "ir.h"
+#include "libweerun.h"
+#include "modcache.h"
+
+#define CACHE_LAYOUT ((uint32_t)(sizeof(wasm_module_t) ^ sizeof(wasm_func_decl_t) << 8 ^ \
+                                 sizeof(wasm_sig_decl_t) << 16 ^ sizeof(wasm_value_t) << 24))
+
+// The image of a cache file as it is written.
+typedef struct {
+  byte* data;
+  size_t length;
+  size_t capacity;
+} image_t;
+
+// Appends {size} bytes at {p} to {image}, 8-byte aligned. Returns their offset as
+// a pointer, or NULL if {p} is NULL.
+static void* append(image_t* image, const void* p, size_t size) {
+  if (p == NULL) return NULL;
+  size_t offset = (image->length + 7) & ~(size_t)7;
+  if (offset + size > image->capacity) {
+    image->capacity = (offset + size) * 2;
+    image->data = (byte*)realloc(image->data, image->capacity);
+  }
+  memset(image->data + image->length, 0, offset - image->length);
+  memcpy(image->data + offset, p, size);
+  image->length = offset + size;
+  return (void*)(uintptr_t)offset;
+}
+
+static void* append_string(image_t* image, const char* str) {
+  return str == NULL ? NULL : append(image, str, strlen(str) + 1);
+}
+
+// Returns the path of the cache file for a module with the given {hash}.
+static char* cache_path(const char* dir, uint64_t hash) {
+  size_t size = strlen(dir) + 32;
+  char* path = (char*)malloc(size);
+  snprintf(path, size, "%s/%016llx.wee", dir, (unsigned long long)hash);
+  return path;
+}
+
+int save_module_cache(const char* dir, const uint8_t* bytes, size_t length, wasm_module_t* module) {
+  image_t image = { NULL, 0, 0 };
+  module_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  append(&image, &header, sizeof(header));
+  wasm_module_t m = *module;
+
+  m.bytes_start = (const byte*)append(&image, module->bytes_start, module->bytes_end - module->bytes_start);
+  m.bytes_end = m.bytes_start + (module->bytes_end - module->bytes_start);
+  m.table = (wasm_table_decl_t*)append(&image, module->table, sizeof(wasm_table_decl_t));
+  m.globals = (wasm_global_decl_t*)append(&image, module->globals, sizeof(wasm_global_decl_t) * m.num_globals);
+  m.data = (wasm_data_decl_t*)append(&image, module->data, sizeof(wasm_data_decl_t) * m.num_data);
+
+  // arrays of structures that hold pointers are copied and fixed up first
+  wasm_sig_decl_t* sigs = (wasm_sig_decl_t*)malloc(sizeof(wasm_sig_decl_t) * (m.num_sigs + 1));
+  for (uint32_t i = 0; i < m.num_sigs; i++) {
+    wasm_sig_decl_t* sig = &module->sigs[i];
+    sigs[i] = *sig;
+    sigs[i].params = (wasm_type_t*)append(&image, sig->params, sizeof(wasm_type_t) * sig->num_params);
+    sigs[i].results = (wasm_type_t*)append(&image, sig->results, sizeof(wasm_type_t) * sig->num_results);
+  }
+  m.sigs = (wasm_sig_decl_t*)append(&image, module->sigs ? sigs : NULL, sizeof(wasm_sig_decl_t) * m.num_sigs);
+  free(sigs);
+  wasm_import_decl_t* imports = (wasm_import_decl_t*)malloc(sizeof(wasm_import_decl_t) * (m.num_imports + 1));
+  for (uint32_t i = 0; i < m.num_imports; i++) {
+    imports[i] = module->imports[i];
+    imports[i].mod_name = (const char*)append_string(&image, imports[i].mod_name);
+    imports[i].member_name = (const char*)append_string(&image, imports[i].member_name);
+  }
+  m.imports = (wasm_import_decl_t*)append(&image, module->imports ? imports : NULL,
+                                          sizeof(wasm_import_decl_t) * m.num_imports);
+  free(imports);
+  wasm_export_decl_t* exports = (wasm_export_decl_t*)malloc(sizeof(wasm_export_decl_t) * (m.num_exports + 1));
+  for (uint32_t i = 0; i < m.num_exports; i++) {
+    exports[i] = module->exports[i];
+    exports[i].name = (const char*)append_string(&image, exports[i].name);
+  }
+  m.exports = (wasm_export_decl_t*)append(&image, module->exports ? exports : NULL,
+                                          sizeof(wasm_export_decl_t) * m.num_exports);
+  free(exports);
+  wasm_func_decl_t* funcs = (wasm_func_decl_t*)malloc(sizeof(wasm_func_decl_t) * (m.num_funcs + 1));
+  for (uint32_t i = 0; i < m.num_funcs; i++) {
+    wasm_func_decl_t* func = &module->funcs[i];
+    funcs[i] = *func;
+    funcs[i].local_types = (wasm_type_t*)append(&image, func->local_types, sizeof(wasm_type_t) * func->num_locals);
+    funcs[i].sidetable = (wasm_sidetable_entry_t*)append(&image, func->sidetable,
+                                                         sizeof(wasm_sidetable_entry_t) * func->sidetable_length);
+  }
+  m.funcs = (wasm_func_decl_t*)append(&image, module->funcs ? funcs : NULL, sizeof(wasm_func_decl_t) * m.num_funcs);
+  free(funcs);
+  wasm_elems_decl_t* elems = (wasm_elems_decl_t*)malloc(sizeof(wasm_elems_decl_t) * (m.num_elems + 1));
+  for (uint32_t i = 0; i < m.num_elems; i++) {
+    elems[i] = module->elems[i];
+    elems[i].func_indexes = (uint32_t*)append(&image, elems[i].func_indexes, sizeof(uint32_t) * elems[i].length);
+  }
+  m.elems = (wasm_elems_decl_t*)append(&image, module->elems ? elems : NULL, sizeof(wasm_elems_decl_t) * m.num_elems);
+  free(elems);
+  wasm_func_name_t* names = (wasm_func_name_t*)malloc(sizeof(wasm_func_name_t) * (m.num_func_names + 1));
+  for (uint32_t i = 0; i < m.num_func_names; i++) {
+    names[i] = module->func_names[i];
+    names[i].name = (const char*)append_string(&image, names[i].name);
+  }
+  m.func_names = (wasm_func_name_t*)append(&image, module->func_names ? names : NULL,
+                                           sizeof(wasm_func_name_t) * m.num_func_names);
+  free(names);
+  m.mapping = NULL;
+  m.mapping_size = 0;
+
+  memcpy(header.magic, MODULE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = MODULE_CACHE_VERSION;
+  header.layout = CACHE_LAYOUT;
+  header.hash = weerun_hash_bytes(bytes, length);
+  header.length = length;
+  header.orig_offset = (uint64_t)(uintptr_t)append(&image, bytes, length > 0 ? length : 1);
+  header.size = image.length;
+  header.module = m;
+  memcpy(image.data, &header, sizeof(header));
+
+  // written under a temporary name, so that a concurrent run never maps a
+  // partially written file
+  char* path = cache_path(dir, header.hash);
+  size_t tmp_size = strlen(path) + 16;
+  char* tmp = (char*)malloc(tmp_size);
+  snprintf(tmp, tmp_size, "%s.%d", path, (int)getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int r = -1;
+  if (fd >= 0) {
+    r = write(fd, image.data, image.length) == (ssize_t)image.length ? 0 : -1;
+    close(fd);
+    if (r == 0) r = rename(tmp, path);
+    if (r < 0) unlink(tmp);
+  }
+  if (r < 0) ERR("!failed to write module cache %s\n", path);
+  else TRACE("cache: wrote %s\n", path);
+  free(tmp);
+  free(path);
+  free(image.data);
+  return r;
+}
+
+// Relocates the offset in {*p} to an array of {length} bytes, which must be
+// within the {size} bytes at {base}. Returns < 0 if it is not.
+static int reloc(void* p, size_t length, byte* base, size_t size) {
+  uintptr_t offset;
+  memcpy(&offset, p, sizeof(offset));
+  if (offset == 0) return 0;
+  if (offset > size || length > size - offset) return -1;
+  void* ptr = base + offset;
+  memcpy(p, &ptr, sizeof(ptr));
+  return 0;
+}
+
+#define RELOC(field, count) reloc(&(field), sizeof(*(field)) * (size_t)(count), base, size)
+
+// Relocates all pointers in the mapped module {m}. Returns < 0 if any is invalid.
+static int relocate(wasm_module_t* m, byte* base, size_t size) {
+  size_t code_length = (size_t)(m->bytes_end - m->bytes_start);
+  int r = RELOC(m->bytes_start, code_length) | RELOC(m->bytes_end, 0) |
+          RELOC(m->table, 1) | RELOC(m->globals, m->num_globals) | RELOC(m->data, m->num_data) |
+          RELOC(m->sigs, m->num_sigs) | RELOC(m->imports, m->num_imports) |
+          RELOC(m->exports, m->num_exports) | RELOC(m->funcs, m->num_funcs) | RELOC(m->elems, m->num_elems) |
+          RELOC(m->func_names, m->num_func_names);
+  if (r < 0) return r;
+  for (uint32_t i = 0; i < m->num_sigs; i++) {
+    wasm_sig_decl_t* sig = &m->sigs[i];
+    r |= RELOC(sig->params, sig->num_params) | RELOC(sig->results, sig->num_results);
+  }
+  // names were written with their terminators
+  for (uint32_t i = 0; i < m->num_imports; i++) {
+    r |= RELOC(m->imports[i].mod_name, 1) | RELOC(m->imports[i].member_name, 1);
+  }
+  for (uint32_t i = 0; i < m->num_exports; i++) r |= RELOC(m->exports[i].name, 1);
+  for (uint32_t i = 0; i < m->num_func_names; i++) r |= RELOC(m->func_names[i].name, 1);
+  for (uint32_t i = 0; i < m->num_funcs; i++) {
+    wasm_func_decl_t* func = &m->funcs[i];
+    r |= RELOC(func->local_types, func->num_locals) | RELOC(func->sidetable, func->sidetable_length);
+  }
+  for (uint32_t i = 0; i < m->num_elems; i++) {
+    r |= RELOC(m->elems[i].func_indexes, m->elems[i].length);
+  }
+  return r;
+}
+
+wasm_module_t* load_module_cache(const char* dir, const uint8_t* bytes, size_t length) {
+  uint64_t hash = weerun_hash_bytes(bytes, length);
+  char* path = cache_path(dir, hash);
+  int fd = open(path, O_RDONLY);
+  struct stat statbuf;
+  if (fd < 0 || fstat(fd, &statbuf) < 0 || (size_t)statbuf.st_size < sizeof(module_cache_header_t)) {
+    TRACE("cache: miss %s\n", path);
+    if (fd >= 0) close(fd);
+    free(path);
+    return NULL;
+  }
+  size_t size = (size_t)statbuf.st_size;
+  // the pages that hold pointers are relocated privately; code, side tables and
+  // data stay shared with the page cache
+  byte* base = (byte*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == (byte*)MAP_FAILED) {
+    free(path);
+    return NULL;
+  }
+  module_cache_header_t* header = (module_cache_header_t*)base;
+  if (memcmp(header->magic, MODULE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != MODULE_CACHE_VERSION || header->layout != CACHE_LAYOUT ||
+      header->size != size || header->hash != hash || header->length != length ||
+      header->orig_offset + length > size || memcmp(base + header->orig_offset, bytes, length) != 0 ||
+      relocate(&header->module, base, size) < 0) {
+    ERR("!stale module cache %s\n", path);
+    munmap(base, size);
+    free(path);
+    return NULL;
+  }
+  TRACE("cache: hit %s\n", path);
+  free(path);
+  wasm_module_t* module = &header->module;
+  module->mapping = base;
+  module->mapping_size = size;
+  return module;
+}
+
+void unmap_module_cache(wasm_module_t* module) {
+  munmap(module->mapping, module->mapping_size);
+}
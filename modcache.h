@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+#define MODULE_CACHE_MAGIC "weecache"
+// Must change whenever parsing or rewriting changes what a module holds.
+#define MODULE_CACHE_VERSION 2
+
+// The start of a module cache file, which holds a parsed and rewritten module
+// and everything it points to. Pointers in the file are offsets from its start
+// and are relocated when it is mapped.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout; // the sizes of the module structures, to reject other builds
+  uint64_t hash; // of the original bytes
+  uint64_t length; // of the original bytes
+  uint64_t orig_offset; // where a copy of the original bytes is, to confirm the hash
+  uint64_t size; // of the whole file
+  wasm_module_t module;
+} module_cache_header_t;
+
+// Returns the module for the given bytes from the cache directory {dir},
+// mapping it with no parsing at all, or NULL if it is not cached there.
+wasm_module_t* load_module_cache(const char* dir, const uint8_t* bytes, size_t length);
+
+// Writes {module}, which was parsed from the given bytes, to the cache directory
+// {dir}. Returns < 0 on failure.
+int save_module_cache(const char* dir, const uint8_t* bytes, size_t length, wasm_module_t* module);
+
+// Unmaps a module returned by {load_module_cache}.
+void unmap_module_cache(wasm_module_t* module);
@@ -0,0 +1,836 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+#include "cpu.h"
+#include "obj.h"
+
+// Key namespaces in the property map.
+#define KEY_I32 1
+#define KEY_F64 2
+#define KEY_REF 3
+
+// A property key. Object keys compare by address but hash by the stable id of
+// the object, so that promoting an object does not move it within a map.
+typedef struct {
+  uint64_t bits;
+  uint32_t kind;
+  uint32_t hash;
+} prop_key_t;
+
+typedef struct {
+  prop_key_t key;
+  void* val;
+} prop_slot_t;
+
+// An open-addressing hash map in the style of a Swiss table. Slots are probed
+// in groups of 16, whose control bytes are compared all at once. A control byte
+// holds the low 7 bits of the hash of a full slot, or EMPTY or DELETED.
+typedef struct {
+  byte* ctrl;
+  prop_slot_t* slots;
+  uint32_t capacity; // 0 or a power of 2 that is at least {GROUP_SIZE}
+  uint32_t size; // full slots
+  uint32_t used; // full and deleted slots
+} prop_map_t;
+
+#define GROUP_SIZE 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+// A hidden class shared by objects whose properties were added with the same
+// keys in the same order. The value of key {keys[i]} is in slot {i} of the
+// object. Shapes form a tree whose edges are the transitions made by adding a key.
+typedef struct shape {
+  struct shape* next; // the next shape in the heap
+  uint32_t count;
+  uint32_t marked;
+  prop_key_t* keys;
+  prop_map_t transitions; // key -> child shape
+} shape_t;
+
+// Objects whose shape has this many keys put further keys into their {props} map.
+#define MAX_SHAPE_KEYS 32
+
+#define KIND_FREE 0
+#define KIND_OBJECT 1
+#define KIND_FORWARDED 2 // a nursery object that has been promoted
+
+typedef struct object {
+  byte kind;
+  byte marked;
+  byte remembered; // in the remembered set of the nursery
+  uint32_t id;
+  struct object* link; // forwarding address, or next free cell
+  // properties with small non-negative i32 keys, which are all < {elems_length}
+  // and less than any i32 key in the shape
+  uint32_t elems_length;
+  uint32_t elems_capacity;
+  void** elems;
+  // properties in the order of the shape
+  shape_t* shape;
+  uint32_t slots_capacity;
+  void** slots;
+  // properties beyond a full shape
+  uint32_t sparse_ints; // number of i32 keys in {props}
+  prop_map_t props;
+} object_t;
+
+// Objects are bump-allocated in the nursery, and the survivors of a minor
+// collection are copied into cells of the old space. The old space is marked
+// incrementally, in steps taken at allocations and loop back-edges, and then
+// swept. While marking, stores of references shade the stored value, objects
+// promoted from the nursery are allocated marked, and the roots are scanned
+// again at the end, since the operand stack has no write barrier.
+#define NURSERY_CELLS 4096
+#define OLD_CHUNK_CELLS 1024
+#define MIN_MAJOR_THRESHOLD (4 * NURSERY_CELLS)
+
+typedef struct old_chunk {
+  struct old_chunk* next;
+  object_t cells[OLD_CHUNK_CELLS];
+} old_chunk_t;
+
+// A growable stack of objects.
+typedef struct {
+  object_t** objs;
+  uint32_t count;
+  uint32_t capacity;
+} obj_stack_t;
+
+struct obj_heap {
+  obj_heap_state_t state; // must be first
+  object_t* nursery_start;
+  object_t* nursery_top;
+  object_t* nursery_end;
+
+  old_chunk_t* chunks;
+  object_t* free_list;
+  uint32_t old_count; // old cells in use
+  uint32_t major_threshold;
+
+  shape_t* shapes;
+  shape_t* root_shape;
+  uint32_t next_id;
+
+  obj_roots_t roots;
+  obj_stack_t remembered; // old objects that may reference the nursery
+  obj_stack_t promoted; // objects to scan during a minor collection
+  obj_stack_t work; // marked objects to scan
+  obj_gc_stats_t stats;
+};
+
+static shape_t* new_shape(obj_heap_t* heap, uint32_t count) {
+  shape_t* shape = (shape_t*)calloc(1, sizeof(shape_t));
+  shape->count = count;
+  shape->keys = (prop_key_t*)malloc(sizeof(prop_key_t) * (count > 0 ? count : 1));
+  shape->next = heap->shapes;
+  heap->shapes = shape;
+  return shape;
+}
+
+static void free_shape(shape_t* shape) {
+  free(shape->keys);
+  free(shape->transitions.ctrl);
+  free(shape->transitions.slots);
+  free(shape);
+}
+
+static void free_object_tables(object_t* obj) {
+  free(obj->elems);
+  free(obj->slots);
+  free(obj->props.ctrl);
+  free(obj->props.slots);
+}
+
+obj_heap_t* new_obj_heap() {
+  obj_heap_t* heap = (obj_heap_t*)calloc(1, sizeof(obj_heap_t));
+  heap->nursery_start = (object_t*)malloc(sizeof(object_t) * NURSERY_CELLS);
+  heap->nursery_top = heap->nursery_start;
+  heap->nursery_end = heap->nursery_start + NURSERY_CELLS;
+  heap->major_threshold = MIN_MAJOR_THRESHOLD;
+  heap->root_shape = new_shape(heap, 0);
+  return heap;
+}
+
+void free_obj_heap(obj_heap_t* heap) {
+  if (heap == NULL) return;
+  for (object_t* obj = heap->nursery_start; obj < heap->nursery_top; obj++) {
+    if (obj->kind == KIND_OBJECT) free_object_tables(obj);
+  }
+  old_chunk_t* chunk = heap->chunks;
+  while (chunk != NULL) {
+    old_chunk_t* next = chunk->next;
+    for (uint32_t i = 0; i < OLD_CHUNK_CELLS; i++) {
+      if (chunk->cells[i].kind == KIND_OBJECT) free_object_tables(&chunk->cells[i]);
+    }
+    free(chunk);
+    chunk = next;
+  }
+  shape_t* shape = heap->shapes;
+  while (shape != NULL) {
+    shape_t* next = shape->next;
+    free_shape(shape);
+    shape = next;
+  }
+  free(heap->nursery_start);
+  free(heap->remembered.objs);
+  free(heap->promoted.objs);
+  free(heap->work.objs);
+  free(heap);
+}
+
+void obj_set_roots(obj_heap_t* heap, const obj_roots_t* roots) {
+  heap->roots = *roots;
+}
+
+const obj_gc_stats_t* obj_gc_stats(obj_heap_t* heap) {
+  return &heap->stats;
+}
+
+static void push_obj(obj_stack_t* stack, object_t* obj) {
+  if (stack->count == stack->capacity) {
+    stack->capacity = stack->capacity == 0 ? 64 : stack->capacity * 2;
+    stack->objs = (object_t**)realloc(stack->objs, sizeof(object_t*) * stack->capacity);
+  }
+  stack->objs[stack->count++] = obj;
+}
+
+static inline int is_young(obj_heap_t* heap, const void* ref) {
+  return (uintptr_t)ref - (uintptr_t)heap->nursery_start <
+    (uintptr_t)heap->nursery_end - (uintptr_t)heap->nursery_start;
+}
+
+static void collect_minor(obj_heap_t* heap, wasm_value_t* stack_top);
+static void start_marking(obj_heap_t* heap, wasm_value_t* stack_top);
+
+void* obj_new(obj_heap_t* heap, wasm_value_t* stack_top) {
+  if (heap->state.marking) obj_gc_step(heap, stack_top, OBJ_MARK_BUDGET);
+  if (heap->nursery_top == heap->nursery_end) {
+    collect_minor(heap, stack_top);
+    if (!heap->state.marking && heap->old_count >= heap->major_threshold) start_marking(heap, stack_top);
+  }
+  object_t* obj = heap->nursery_top++;
+  memset(obj, 0, sizeof(object_t));
+  obj->kind = KIND_OBJECT;
+  obj->id = heap->next_id++;
+  obj->shape = heap->root_shape;
+  heap->stats.allocated++;
+  heap->stats.allocated_bytes += sizeof(object_t);
+  return obj;
+}
+
+//==== Property map =================================================
+
+static inline uint32_t hash_bits(uint64_t bits, uint32_t kind) {
+  uint64_t h = (bits ^ ((uint64_t)kind << 59)) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(h >> 32);
+}
+
+static inline prop_key_t i32_key(uint32_t index) {
+  prop_key_t key = {index, KEY_I32, hash_bits(index, KEY_I32)};
+  return key;
+}
+
+static inline int key_equals(const prop_key_t* a, const prop_key_t* b) {
+  return a->bits == b->bits && a->kind == b->kind;
+}
+
+// Returns a bitmask of the control bytes in the group at {ctrl} equal to {b}.
+static inline uint32_t group_match(const byte* ctrl, byte b) {
+#if defined(__SSE2__)
+  if (g_cpu_level >= CPU_SSE) {
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+  }
+#endif
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) mask |= (uint32_t)(ctrl[i] == b) << i;
+  return mask;
+}
+
+// Returns a bitmask of the empty or deleted slots in the group at {ctrl}.
+static inline uint32_t group_match_free(const byte* ctrl) {
+#if defined(__SSE2__)
+  if (g_cpu_level >= CPU_SSE) {
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)ctrl));
+  }
+#endif
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) mask |= (uint32_t)(ctrl[i] >> 7) << i;
+  return mask;
+}
+
+static prop_slot_t* map_find(prop_map_t* map, const prop_key_t* key) {
+  if (map->size == 0) return NULL;
+  byte h2 = key->hash & 0x7F;
+  uint32_t group_mask = (map->capacity / GROUP_SIZE) - 1;
+  uint32_t g = (key->hash >> 7) & group_mask;
+  for (uint32_t step = 1; ; step++) {
+    const byte* ctrl = map->ctrl + g * GROUP_SIZE;
+    for (uint32_t m = group_match(ctrl, h2); m != 0; m &= m - 1) {
+      prop_slot_t* slot = &map->slots[g * GROUP_SIZE + __builtin_ctz(m)];
+      if (key_equals(&slot->key, key)) return slot;
+    }
+    if (group_match(ctrl, CTRL_EMPTY) != 0) return NULL;
+    g = (g + step) & group_mask; // triangular probing visits every group
+  }
+}
+
+// Inserts a key that is known not to be in the map, which has room for it.
+static prop_slot_t* map_insert_new(prop_map_t* map, const prop_key_t* key) {
+  uint32_t group_mask = (map->capacity / GROUP_SIZE) - 1;
+  uint32_t g = (key->hash >> 7) & group_mask;
+  for (uint32_t step = 1; ; step++) {
+    byte* ctrl = map->ctrl + g * GROUP_SIZE;
+    uint32_t m = group_match_free(ctrl);
+    if (m != 0) {
+      uint32_t i = __builtin_ctz(m);
+      if (ctrl[i] == CTRL_EMPTY) map->used++;
+      ctrl[i] = key->hash & 0x7F;
+      map->size++;
+      prop_slot_t* slot = &map->slots[g * GROUP_SIZE + i];
+      slot->key = *key;
+      return slot;
+    }
+    g = (g + step) & group_mask;
+  }
+}
+
+// Rebuilds the map with the given capacity, dropping deleted slots.
+static void map_rehash(prop_map_t* map, uint32_t capacity) {
+  prop_map_t old = *map;
+  map->ctrl = (byte*)aligned_alloc(GROUP_SIZE, capacity);
+  memset(map->ctrl, CTRL_EMPTY, capacity);
+  map->slots = (prop_slot_t*)malloc(sizeof(prop_slot_t) * capacity);
+  map->capacity = capacity;
+  map->size = 0;
+  map->used = 0;
+  for (uint32_t i = 0; i < old.capacity; i++) {
+    if (old.ctrl[i] & 0x80) continue;
+    prop_slot_t* slot = map_insert_new(map, &old.slots[i].key);
+    slot->val = old.slots[i].val;
+  }
+  free(old.ctrl);
+  free(old.slots);
+}
+
+static void map_put(prop_map_t* map, const prop_key_t* key, void* val) {
+  prop_slot_t* slot = map_find(map, key);
+  if (slot == NULL) {
+    // keep the load, including deleted slots, at most 7/8
+    if ((map->used + 1) * 8 > map->capacity * 7) {
+      uint32_t capacity = map->capacity == 0 ? GROUP_SIZE : map->capacity;
+      while ((map->size + 1) * 2 > capacity) capacity *= 2;
+      map_rehash(map, capacity);
+    }
+    slot = map_insert_new(map, key);
+  }
+  slot->val = val;
+}
+
+static void map_remove_slot(prop_map_t* map, prop_slot_t* slot) {
+  map->ctrl[slot - map->slots] = CTRL_DELETED;
+  map->size--;
+}
+
+// Removes a key from the map, returning 1 and its value in {val} if it was present.
+static int map_take(prop_map_t* map, const prop_key_t* key, void** val) {
+  prop_slot_t* slot = map_find(map, key);
+  if (slot == NULL) return 0;
+  map_remove_slot(map, slot);
+  *val = slot->val;
+  return 1;
+}
+
+//==== Shapes =======================================================
+
+// Returns the slot of a key in a shape, or -1 if it is not present.
+static int32_t shape_find(shape_t* shape, const prop_key_t* key) {
+  for (uint32_t i = 0; i < shape->count; i++) {
+    if (key_equals(&shape->keys[i], key)) return (int32_t)i;
+  }
+  return -1;
+}
+
+// Returns the shape reached from {shape} by adding a key, creating it if necessary.
+static shape_t* shape_transition(obj_heap_t* heap, shape_t* shape, const prop_key_t* key) {
+  prop_slot_t* slot = map_find(&shape->transitions, key);
+  if (slot != NULL) return (shape_t*)slot->val;
+  shape_t* child = new_shape(heap, shape->count + 1);
+  memcpy(child->keys, shape->keys, sizeof(prop_key_t) * shape->count);
+  child->keys[shape->count] = *key;
+  map_put(&shape->transitions, key, child);
+  return child;
+}
+
+// Moves an object to a child of its shape and stores the value of the new key.
+static void add_slot(object_t* obj, shape_t* shape, void* val) {
+  if (shape->count > obj->slots_capacity) {
+    obj->slots_capacity = obj->slots_capacity == 0 ? 4 : obj->slots_capacity * 2;
+    obj->slots = (void**)realloc(obj->slots, sizeof(void*) * obj->slots_capacity);
+  }
+  obj->shape = shape;
+  obj->slots[shape->count - 1] = val;
+}
+
+//==== Objects ======================================================
+
+static void elems_append(object_t* obj, void* val) {
+  if (obj->elems_length == obj->elems_capacity) {
+    obj->elems_capacity = obj->elems_capacity == 0 ? 8 : obj->elems_capacity * 2;
+    obj->elems = (void**)realloc(obj->elems, sizeof(void*) * obj->elems_capacity);
+  }
+  obj->elems[obj->elems_length++] = val;
+}
+
+// Sets a property that is not in the elements or the shape.
+static void set_new_prop(obj_heap_t* heap, object_t* obj, const prop_key_t* key, void* val) {
+  if (obj->shape->count < MAX_SHAPE_KEYS) {
+    add_slot(obj, shape_transition(heap, obj->shape, key), val);
+    return;
+  }
+  uint32_t size = obj->props.size;
+  map_put(&obj->props, key, val);
+  if (key->kind == KEY_I32 && obj->props.size != size) obj->sparse_ints++;
+}
+
+static void set_i32_prop(obj_heap_t* heap, object_t* obj, const prop_key_t* key, void* val) {
+  uint32_t index = (uint32_t)key->bits;
+  if (index < obj->elems_length) {
+    obj->elems[index] = val;
+    return;
+  }
+  int32_t slot = shape_find(obj->shape, key);
+  if (slot >= 0) {
+    obj->slots[slot] = val;
+    return;
+  }
+  if (index == obj->elems_length && (int32_t)index >= 0) {
+    // append to the dense elements, moving any following keys out of the map
+    void* old;
+    if (obj->sparse_ints > 0 && map_take(&obj->props, key, &old)) obj->sparse_ints--;
+    elems_append(obj, val);
+    while (obj->sparse_ints > 0) {
+      prop_key_t next = i32_key(obj->elems_length);
+      if (!map_take(&obj->props, &next, &old)) break;
+      obj->sparse_ints--;
+      elems_append(obj, old);
+    }
+    return;
+  }
+  set_new_prop(heap, obj, key, val);
+}
+
+// Computes the namespace, bits, and hash of a key, or returns a trap.
+static inline wasm_trap_t prop_key(void* ref, prop_key_t* key) {
+  if (ref == NULL) return TRAP_NULL_REFERENCE;
+  if (ref_is_i32(ref)) {
+    *key = i32_key((uint32_t)ref_i32(ref));
+    return TRAP_NONE;
+  }
+  if (ref_is_f64(ref)) {
+    // -0 is the same key as 0, and boxing already made all NaNs the same
+    key->kind = KEY_F64;
+    key->bits = ref_f64(ref) == 0 ? ref_bits(obj_box_f64(0)) : ref_bits(ref);
+    key->hash = hash_bits(key->bits, KEY_F64);
+    return TRAP_NONE;
+  }
+  key->kind = KEY_REF;
+  key->bits = ref_bits(ref);
+  key->hash = hash_bits(((object_t*)ref)->id, KEY_REF);
+  return TRAP_NONE;
+}
+
+// Returns the object a reference points to, or a trap.
+static inline wasm_trap_t as_object(void* ref, object_t** obj) {
+  if (ref == NULL) return TRAP_NULL_REFERENCE;
+  if (!ref_is_cell(ref) || ((object_t*)ref)->kind != KIND_OBJECT) return TRAP_TYPE_MISMATCH;
+  *obj = (object_t*)ref;
+  return TRAP_NONE;
+}
+
+static void* mark(obj_heap_t* heap, void* ref);
+
+// Records an old object that is about to reference the nursery, and shades
+// the stored references while marking.
+static inline void write_barrier(obj_heap_t* heap, object_t* obj, void* key, void* val) {
+  if (heap->state.marking) {
+    mark(heap, key);
+    mark(heap, val);
+  }
+  if (obj->remembered || is_young(heap, obj)) return;
+  if (is_young(heap, key) || is_young(heap, val)) {
+    obj->remembered = 1;
+    push_obj(&heap->remembered, obj);
+  }
+}
+
+// Gets a property, returning the slot it was found in, or -1 if it is not in the shape.
+static int32_t get_prop(object_t* obj, const prop_key_t* key, void** result) {
+  if (key->kind == KEY_I32 && (uint32_t)key->bits < obj->elems_length) {
+    *result = obj->elems[key->bits];
+    return -1;
+  }
+  int32_t slot = shape_find(obj->shape, key);
+  if (slot >= 0) {
+    *result = obj->slots[slot];
+    return slot;
+  }
+  prop_slot_t* entry = map_find(&obj->props, key);
+  *result = entry == NULL ? NULL : entry->val;
+  return -1;
+}
+
+static void set_prop(obj_heap_t* heap, object_t* obj, const prop_key_t* key, void* val) {
+  if (key->kind == KEY_I32) {
+    set_i32_prop(heap, obj, key, val);
+    return;
+  }
+  int32_t slot = shape_find(obj->shape, key);
+  if (slot >= 0) obj->slots[slot] = val;
+  else set_new_prop(heap, obj, key, val);
+}
+
+wasm_trap_t obj_get(void* ref, void* key_ref, void** result) {
+  object_t* obj;
+  wasm_trap_t trap = as_object(ref, &obj);
+  if (trap != TRAP_NONE) return trap;
+  prop_key_t key;
+  trap = prop_key(key_ref, &key);
+  if (trap != TRAP_NONE) return trap;
+  get_prop(obj, &key, result);
+  return TRAP_NONE;
+}
+
+wasm_trap_t obj_set(obj_heap_t* heap, void* ref, void* key_ref, void* val) {
+  object_t* obj;
+  wasm_trap_t trap = as_object(ref, &obj);
+  if (trap != TRAP_NONE) return trap;
+  prop_key_t key;
+  trap = prop_key(key_ref, &key);
+  if (trap != TRAP_NONE) return trap;
+  write_barrier(heap, obj, key_ref, val);
+  set_prop(heap, obj, &key, val);
+  return TRAP_NONE;
+}
+
+//==== Inline caches ================================================
+
+static void cache_add(obj_cache_t* cache, shape_t* shape, const prop_key_t* key,
+                      uint32_t slot, shape_t* next_shape) {
+  if (cache->count == OBJ_CACHE_WAYS) return; // megamorphic
+  obj_cache_entry_t* entry = &cache->entries[cache->count++];
+  entry->shape = shape;
+  entry->next_shape = next_shape;
+  entry->bits = key->bits;
+  entry->kind = key->kind;
+  entry->slot = slot;
+}
+
+static inline int cache_entry_matches(obj_cache_entry_t* entry, object_t* obj, const prop_key_t* key) {
+  return entry->shape == obj->shape && entry->bits == key->bits && entry->kind == key->kind;
+}
+
+wasm_trap_t obj_get_cached(obj_cache_t* cache, void* ref, void* key_ref, void** result) {
+  object_t* obj;
+  wasm_trap_t trap = as_object(ref, &obj);
+  if (trap != TRAP_NONE) return trap;
+  prop_key_t key;
+  trap = prop_key(key_ref, &key);
+  if (trap != TRAP_NONE) return trap;
+  for (uint32_t i = 0; i < cache->count; i++) {
+    obj_cache_entry_t* entry = &cache->entries[i];
+    if (cache_entry_matches(entry, obj, &key)) {
+      *result = obj->slots[entry->slot];
+      return TRAP_NONE;
+    }
+  }
+  int32_t slot = get_prop(obj, &key, result);
+  if (slot >= 0) cache_add(cache, obj->shape, &key, (uint32_t)slot, NULL);
+  return TRAP_NONE;
+}
+
+wasm_trap_t obj_set_cached(obj_heap_t* heap, obj_cache_t* cache, void* ref, void* key_ref, void* val) {
+  object_t* obj;
+  wasm_trap_t trap = as_object(ref, &obj);
+  if (trap != TRAP_NONE) return trap;
+  prop_key_t key;
+  trap = prop_key(key_ref, &key);
+  if (trap != TRAP_NONE) return trap;
+  write_barrier(heap, obj, key_ref, val);
+  for (uint32_t i = 0; i < cache->count; i++) {
+    obj_cache_entry_t* entry = &cache->entries[i];
+    if (!cache_entry_matches(entry, obj, &key)) continue;
+    if (entry->next_shape == NULL) {
+      obj->slots[entry->slot] = val;
+      return TRAP_NONE;
+    }
+    // an i32 key only becomes a new slot if it is not appended to the elements
+    if (key.kind != KEY_I32 || (uint32_t)key.bits > obj->elems_length) {
+      add_slot(obj, (shape_t*)entry->next_shape, val);
+      return TRAP_NONE;
+    }
+  }
+  shape_t* shape = obj->shape;
+  set_prop(heap, obj, &key, val);
+  if (obj->shape != shape) {
+    cache_add(cache, shape, &key, obj->shape->count - 1, obj->shape);
+  } else {
+    int32_t slot = shape_find(shape, &key);
+    if (slot >= 0) cache_add(cache, shape, &key, (uint32_t)slot, NULL);
+  }
+  return TRAP_NONE;
+}
+
+//==== Garbage collection ===========================================
+
+static object_t* alloc_old(obj_heap_t* heap) {
+  if (heap->free_list == NULL) {
+    old_chunk_t* chunk = (old_chunk_t*)malloc(sizeof(old_chunk_t));
+    chunk->next = heap->chunks;
+    heap->chunks = chunk;
+    for (uint32_t i = OLD_CHUNK_CELLS; i > 0; i--) {
+      object_t* cell = &chunk->cells[i - 1];
+      cell->kind = KIND_FREE;
+      cell->link = heap->free_list;
+      heap->free_list = cell;
+    }
+  }
+  object_t* obj = heap->free_list;
+  heap->free_list = obj->link;
+  heap->old_count++;
+  return obj;
+}
+
+// Copies a live nursery object to the old space, returning its new address.
+static void* evacuate(obj_heap_t* heap, void* ref) {
+  if (!is_young(heap, ref)) return ref;
+  object_t* obj = (object_t*)ref;
+  if (obj->kind == KIND_FORWARDED) return obj->link;
+  object_t* copy = alloc_old(heap);
+  *copy = *obj;
+  copy->link = NULL;
+  copy->marked = heap->state.marking; // allocated black
+  obj->kind = KIND_FORWARDED;
+  obj->link = copy;
+  push_obj(&heap->promoted, copy);
+  heap->stats.promoted++;
+  return copy;
+}
+
+// Marks a live old object. Nursery objects are promoted marked while marking.
+static void* mark(obj_heap_t* heap, void* ref) {
+  if (ref == NULL || !ref_is_cell(ref) || is_young(heap, ref)) return ref;
+  object_t* obj = (object_t*)ref;
+  if (!obj->marked) {
+    obj->marked = 1;
+    push_obj(&heap->work, obj);
+  }
+  return ref;
+}
+
+typedef void* (*visit_fn)(obj_heap_t* heap, void* ref);
+
+// Visits every reference held by an object, updating it with the result.
+static void scan_object(obj_heap_t* heap, object_t* obj, visit_fn visit) {
+  for (uint32_t i = 0; i < obj->elems_length; i++) obj->elems[i] = visit(heap, obj->elems[i]);
+  shape_t* shape = obj->shape;
+  for (uint32_t i = 0; i < shape->count; i++) {
+    obj->slots[i] = visit(heap, obj->slots[i]);
+    // shapes are shared, so their keys are updated after the collection
+    if (shape->keys[i].kind == KEY_REF) visit(heap, (void*)(uintptr_t)shape->keys[i].bits);
+  }
+  prop_map_t* map = &obj->props;
+  for (uint32_t i = 0; i < map->capacity; i++) {
+    if (map->ctrl[i] & 0x80) continue;
+    prop_slot_t* slot = &map->slots[i];
+    slot->val = visit(heap, slot->val);
+    if (slot->key.kind == KEY_REF) {
+      slot->key.bits = (uintptr_t)visit(heap, (void*)(uintptr_t)slot->key.bits);
+    }
+  }
+}
+
+static void scan_roots(obj_heap_t* heap, wasm_value_t* stack_top, visit_fn visit) {
+  for (wasm_value_t* v = heap->roots.stack_start; v < stack_top; v++) {
+    if (v->tag == EXTERNREF) v->val.ref = visit(heap, v->val.ref);
+  }
+  for (uint32_t i = 0; i < heap->roots.num_globals; i++) {
+    wasm_value_t* v = &heap->roots.globals[i];
+    if (v->tag == EXTERNREF) v->val.ref = visit(heap, v->val.ref);
+  }
+}
+
+// Returns the address of an object that survived a collection, or NULL if it died.
+static object_t* survivor(obj_heap_t* heap, uint64_t bits, int major) {
+  object_t* obj = (object_t*)(uintptr_t)bits;
+  if (!is_young(heap, obj)) return !major || obj->marked ? obj : NULL;
+  if (major) return obj;
+  return obj->kind == KIND_FORWARDED ? obj->link : NULL;
+}
+
+static void mark_shapes(shape_t* shape) {
+  shape->marked = 1;
+  prop_map_t* map = &shape->transitions;
+  for (uint32_t i = 0; i < map->capacity; i++) {
+    if (!(map->ctrl[i] & 0x80)) mark_shapes((shape_t*)map->slots[i].val);
+  }
+}
+
+// Drops transitions on dead object keys and the shapes only they lead to, and
+// updates the object keys of the remaining shapes. Every key of a shape that
+// is still in use belongs to a live object, since the objects that use it
+// keep their keys alive.
+static void sweep_shapes(obj_heap_t* heap, int major) {
+  for (shape_t* shape = heap->shapes; shape != NULL; shape = shape->next) {
+    prop_map_t* map = &shape->transitions;
+    for (uint32_t i = 0; i < map->capacity; i++) {
+      if ((map->ctrl[i] & 0x80) || map->slots[i].key.kind != KEY_REF) continue;
+      object_t* key = survivor(heap, map->slots[i].key.bits, major);
+      if (key == NULL) map_remove_slot(map, &map->slots[i]);
+      else map->slots[i].key.bits = (uintptr_t)key;
+    }
+  }
+  mark_shapes(heap->root_shape);
+  shape_t** prev = &heap->shapes;
+  while (*prev != NULL) {
+    shape_t* shape = *prev;
+    if (!shape->marked) {
+      *prev = shape->next;
+      free_shape(shape);
+      continue;
+    }
+    shape->marked = 0;
+    for (uint32_t i = 0; i < shape->count; i++) {
+      if (shape->keys[i].kind != KEY_REF) continue;
+      shape->keys[i].bits = (uintptr_t)survivor(heap, shape->keys[i].bits, major);
+    }
+    prev = &shape->next;
+  }
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record_pause(obj_heap_t* heap, uint64_t start) {
+  uint64_t pause = now_ns() - start;
+  heap->stats.pauses++;
+  heap->stats.pause_ns_total += pause;
+  if (pause > heap->stats.pause_ns_max) heap->stats.pause_ns_max = pause;
+}
+
+static void flush_caches(obj_heap_t* heap) {
+  for (uint32_t i = 0; i < heap->roots.num_caches; i++) heap->roots.caches[i].count = 0;
+}
+
+// Promotes the live nursery objects and empties the nursery.
+static void collect_minor(obj_heap_t* heap, wasm_value_t* stack_top) {
+  uint64_t start = now_ns();
+  scan_roots(heap, stack_top, evacuate);
+  for (uint32_t i = 0; i < heap->remembered.count; i++) {
+    object_t* obj = heap->remembered.objs[i];
+    obj->remembered = 0;
+    scan_object(heap, obj, evacuate);
+  }
+  heap->remembered.count = 0;
+  while (heap->promoted.count > 0) scan_object(heap, heap->promoted.objs[--heap->promoted.count], evacuate);
+  sweep_shapes(heap, 0);
+  for (object_t* obj = heap->nursery_start; obj < heap->nursery_top; obj++) {
+    if (obj->kind != KIND_OBJECT) continue;
+    free_object_tables(obj);
+    heap->stats.freed++;
+  }
+  heap->nursery_top = heap->nursery_start;
+  heap->stats.minor_collections++;
+  heap->stats.live = heap->old_count;
+  flush_caches(heap);
+  record_pause(heap, start);
+}
+
+// Begins marking the old space from the roots. The nursery must be empty.
+static void start_marking(obj_heap_t* heap, wasm_value_t* stack_top) {
+  uint64_t start = now_ns();
+  heap->state.marking = 1;
+  scan_roots(heap, stack_top, mark);
+  record_pause(heap, start);
+}
+
+// Rescans the roots, finishes marking, and sweeps the old space.
+static void finish_marking(obj_heap_t* heap, wasm_value_t* stack_top) {
+  scan_roots(heap, stack_top, mark);
+  while (heap->work.count > 0) scan_object(heap, heap->work.objs[--heap->work.count], mark);
+  // forget remembered objects that are about to be freed
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < heap->remembered.count; i++) {
+    object_t* obj = heap->remembered.objs[i];
+    if (obj->marked) heap->remembered.objs[count++] = obj;
+  }
+  heap->remembered.count = count;
+  sweep_shapes(heap, 1);
+  for (old_chunk_t* chunk = heap->chunks; chunk != NULL; chunk = chunk->next) {
+    for (uint32_t i = 0; i < OLD_CHUNK_CELLS; i++) {
+      object_t* obj = &chunk->cells[i];
+      if (obj->kind != KIND_OBJECT) continue;
+      if (obj->marked) {
+        obj->marked = 0;
+        continue;
+      }
+      free_object_tables(obj);
+      obj->kind = KIND_FREE;
+      obj->link = heap->free_list;
+      heap->free_list = obj;
+      heap->old_count--;
+      heap->stats.freed++;
+    }
+  }
+  heap->state.marking = 0;
+  heap->major_threshold = heap->old_count * 2;
+  if (heap->major_threshold < MIN_MAJOR_THRESHOLD) heap->major_threshold = MIN_MAJOR_THRESHOLD;
+  heap->stats.major_collections++;
+  heap->stats.live = heap->old_count;
+  flush_caches(heap);
+}
+
+void obj_shade(obj_heap_t* heap, void* ref) {
+  mark(heap, ref);
+}
+
+void obj_gc_step(obj_heap_t* heap, wasm_value_t* stack_top, uint32_t budget) {
+  if (!heap->state.marking) return;
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < budget && heap->work.count > 0; i++) {
+    scan_object(heap, heap->work.objs[--heap->work.count], mark);
+  }
+  heap->stats.mark_steps++;
+  if (heap->work.count == 0) finish_marking(heap, stack_top);
+  record_pause(heap, start);
+}
+
+void obj_collect(obj_heap_t* heap, wasm_value_t* stack_top, int major) {
+  collect_minor(heap, stack_top);
+  if (!major) return;
+  if (!heap->state.marking) start_marking(heap, stack_top);
+  uint64_t start = now_ns();
+  finish_marking(heap, stack_top);
+  record_pause(heap, start);
+}
+
+void print_gc_stats(FILE* out, const obj_gc_stats_t* stats) {
+  fprintf(out, "gc: allocated=%" PRIu64 " promoted=%" PRIu64 " freed=%" PRIu64 " live=%u\n",
+          stats->allocated, stats->promoted, stats->freed, stats->live);
+  fprintf(out, "gc: minor=%" PRIu64 " major=%" PRIu64 " mark_steps=%" PRIu64 "\n",
+          stats->minor_collections, stats->major_collections, stats->mark_steps);
+  fprintf(out, "gc: pauses=%" PRIu64 " total=%.3fms max=%.3fms\n", stats->pauses,
+          stats->pause_ns_total / 1e6, stats->pause_ns_max / 1e6);
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "interp.h"
+
+// Native implementation of the weewasm object model behind the obj.* intrinsics.
+// References are NaN-boxed 64-bit words: NULL and pointers to objects have the
+// top 15 bits clear, boxed i32s carry {REF_I32_TAG} in the top bits, and boxed
+// f64s are their bits plus {REF_F64_OFFSET}, so boxing never allocates.
+// Objects share hidden classes (shapes) that map keys to slots, so that call
+// sites can cache lookups by shape. Keys are compared as noderun.js does:
+// objects by identity, boxed i32s by value, and boxed f64s by value in a separate
+// namespace, with -0 and 0 (and all NaNs) being the same key.
+
+_Static_assert(sizeof(void*) == 8, "NaN-boxed references need 64-bit pointers");
+
+#define REF_F64_OFFSET 0x0002000000000000ull
+#define REF_I32_TAG 0xFFFE000000000000ull
+#define REF_CANONICAL_NAN 0x7FF8000000000000ull
+
+static inline uint64_t ref_bits(void* ref) {
+  return (uint64_t)(uintptr_t)ref;
+}
+
+static inline int ref_is_cell(void* ref) {
+  return ref_bits(ref) < REF_F64_OFFSET;
+}
+
+static inline int ref_is_i32(void* ref) {
+  return (ref_bits(ref) & REF_I32_TAG) == REF_I32_TAG;
+}
+
+static inline int ref_is_f64(void* ref) {
+  return ref_bits(ref) >= REF_F64_OFFSET && ref_bits(ref) < REF_I32_TAG;
+}
+
+static inline void* obj_box_i32(int32_t val) {
+  return (void*)(uintptr_t)(REF_I32_TAG | (uint32_t)val);
+}
+
+// Boxes an f64, canonicalizing NaNs so their bits cannot collide with the i32 tag.
+static inline void* obj_box_f64(double val) {
+  uint64_t bits = REF_CANONICAL_NAN;
+  if (val == val) memcpy(&bits, &val, sizeof(double));
+  return (void*)(uintptr_t)(bits + REF_F64_OFFSET);
+}
+
+static inline int32_t ref_i32(void* ref) {
+  return (int32_t)(uint32_t)ref_bits(ref);
+}
+
+static inline double ref_f64(void* ref) {
+  uint64_t bits = ref_bits(ref) - REF_F64_OFFSET;
+  double val;
+  memcpy(&val, &bits, sizeof(double));
+  return val;
+}
+
+// Unboxes a reference created by {obj_box_i32} or {obj_box_f64}.
+static inline wasm_trap_t obj_unbox_i32(void* ref, int32_t* result) {
+  if (!ref_is_i32(ref)) return TRAP_TYPE_MISMATCH;
+  *result = ref_i32(ref);
+  return TRAP_NONE;
+}
+
+static inline wasm_trap_t obj_unbox_f64(void* ref, double* result) {
+  if (!ref_is_f64(ref)) return TRAP_TYPE_MISMATCH;
+  *result = ref_f64(ref);
+  return TRAP_NONE;
+}
+
+// Returns 1 if {a} and {b} are the same object or boxes of equal values.
+// Boxed f64s compare as numbers, so 0 equals -0 and NaN equals nothing.
+static inline int obj_eq(void* a, void* b) {
+  if (ref_is_f64(a) && ref_is_f64(b)) return ref_f64(a) == ref_f64(b);
+  return a == b;
+}
+
+// A heap of cells owned by one instance.
+typedef struct obj_heap obj_heap_t;
+
+// Creates an empty heap.
+obj_heap_t* new_obj_heap();
+
+// Frees a heap and every cell allocated in it.
+void free_obj_heap(obj_heap_t* heap);
+
+// Allocates a new object with no properties. Collects garbage first if the
+// nursery is full, treating the operand stack below {stack_top} as roots.
+void* obj_new(obj_heap_t* heap, wasm_value_t* stack_top);
+
+// Gets the property {key} of {obj}, or NULL if it is not present.
+wasm_trap_t obj_get(void* obj, void* key, void** result);
+
+// Sets the property {key} of {obj} to {val}.
+wasm_trap_t obj_set(obj_heap_t* heap, void* obj, void* key, void* val);
+
+// An inline cache for one obj.get or obj.set call site. Each entry maps the
+// shape of an object and a key to the slot holding the property; entries for
+// obj.set may also record the shape the object transitions to when the key is new.
+#define OBJ_CACHE_WAYS 4
+
+typedef struct {
+  const void* shape;
+  const void* next_shape; // NULL unless the entry adds a property
+  uint64_t bits;
+  uint32_t kind;
+  uint32_t slot;
+} obj_cache_entry_t;
+
+typedef struct obj_cache {
+  uint32_t count; // stops growing once the site is megamorphic
+  obj_cache_entry_t entries[OBJ_CACHE_WAYS];
+} obj_cache_t;
+
+// Like {obj_get} and {obj_set}, but check and update the given cache.
+wasm_trap_t obj_get_cached(obj_cache_t* cache, void* obj, void* key, void** result);
+wasm_trap_t obj_set_cached(obj_heap_t* heap, obj_cache_t* cache, void* obj, void* key, void* val);
+
+// The roots of a heap, besides the operand stack above {stack_start}.
+// Inline caches are flushed by every collection, since objects may move.
+typedef struct {
+  wasm_value_t* stack_start;
+  wasm_value_t* globals;
+  uint32_t num_globals;
+  obj_cache_t* caches;
+  uint32_t num_caches;
+} obj_roots_t;
+
+void obj_set_roots(obj_heap_t* heap, const obj_roots_t* roots);
+
+// Runs a minor collection, which promotes the live objects of the nursery to
+// the old space, followed by a major collection of the old space if {major}.
+void obj_collect(obj_heap_t* heap, wasm_value_t* stack_top, int major);
+
+// Marks some of the old space if incremental marking is in progress, scanning
+// at most {budget} objects, and sweeps it once marking is complete.
+void obj_gc_step(obj_heap_t* heap, wasm_value_t* stack_top, uint32_t budget);
+
+// The number of objects scanned by each marking step.
+#define OBJ_MARK_BUDGET 64
+
+// The part of a heap the interpreter checks at safepoints and stores.
+typedef struct {
+  uint32_t marking;
+} obj_heap_state_t;
+
+static inline int obj_is_marking(obj_heap_t* heap) {
+  return ((obj_heap_state_t*)heap)->marking;
+}
+
+// Marks a reference stored outside of an object, e.g. into a global, while marking.
+void obj_shade(obj_heap_t* heap, void* ref);
+
+typedef struct {
+  uint64_t allocated;
+  uint64_t allocated_bytes; // of cells, not including their slots and elements
+  uint64_t promoted;
+  uint64_t freed;
+  uint64_t minor_collections;
+  uint64_t major_collections;
+  uint64_t mark_steps;
+  uint64_t pauses;
+  uint64_t pause_ns_total;
+  uint64_t pause_ns_max;
+  uint32_t live; // objects in the old space after the last collection
+} obj_gc_stats_t;
+
+const obj_gc_stats_t* obj_gc_stats(obj_heap_t* heap);
+
+// Prints a summary of the statistics to {out}.
+void print_gc_stats(FILE* out, const obj_gc_stats_t* stats);
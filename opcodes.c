@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "weewasm.h"
+#include "illegal.h"
+#include "opcodes.h"
+
+#define LEGAL_ENTRY(name, code, mnemonic, imm) [code] = {mnemonic, IMM_##imm, 0, 0},
+#define ILLEGAL_ENTRY(name, code, mnemonic, imm) [code] = {mnemonic, IMM_##imm, 1, 0},
+#define INTERNAL_ENTRY(name, code, mnemonic, imm) [code] = {mnemonic, IMM_##imm, 0, 1},
+
+const opcode_imm_t opcode_imm_table[256] = {
+  FOREACH_OPCODE(LEGAL_ENTRY)
+  FOREACH_ILLEGAL_OPCODE(ILLEGAL_ENTRY)
+  FOREACH_INTERNAL_OPCODE(INTERNAL_ENTRY)
+};
+
+// The layout of an immediate: some fixed-size bytes followed by some LEBs.
+typedef struct {
+  byte fixed;
+  byte lebs;
+  byte fast; // 0 if the length depends on the values of the immediates
+} imm_shape_t;
+
+static const imm_shape_t imm_shapes[] = {
+  [IMM_NONE]		= {0, 0, 1},
+  [IMM_BLOCKT]		= {0, 1, 1},
+  [IMM_LABEL]		= {0, 1, 1},
+  [IMM_LABELS]		= {0, 0, 0},
+  [IMM_FUNC]		= {0, 1, 1},
+  [IMM_SIG_TABLE]	= {0, 2, 1},
+  [IMM_LOCAL]		= {0, 1, 1},
+  [IMM_GLOBAL]		= {0, 1, 1},
+  [IMM_TABLE]		= {0, 1, 1},
+  [IMM_MEMARG]		= {1, 1, 1},
+  [IMM_I32]		= {0, 1, 1},
+  [IMM_F64]		= {8, 0, 1},
+  [IMM_MEMORY]		= {0, 1, 1},
+  [IMM_TAG]		= {0, 1, 1},
+  [IMM_I64]		= {0, 0, 0},
+  [IMM_F32]		= {4, 0, 1},
+  [IMM_REFNULLT]	= {0, 1, 1},
+  [IMM_VALTS]		= {0, 1, 1},
+  [IMM_PCDELTA]		= {4, 0, 1},
+  [IMM_PCDELTAS]	= {0, 0, 0},
+  [IMM_CACHE]		= {0, 1, 1},
+  [IMM_SKIP]		= {0, 1, 1},
+};
+
+// Returns the length of the LEB at {ptr} by finding the first byte without the
+// continuation bit in an 8-byte window. Returns 8 if there is none.
+static inline uint32_t leb_length(const byte* ptr) {
+  uint64_t word;
+  memcpy(&word, ptr, 8);
+  uint64_t stops = ~word & 0x8080808080808080ull;
+  return (__builtin_ctzll(stops | (1ull << 63)) >> 3) + 1;
+}
+
+uint32_t bytecode_length_fast(const byte* ptr) {
+  const imm_shape_t* shape = &imm_shapes[opcode_imm_table[*ptr].immkind];
+  const byte* p = ptr + 1 + shape->fixed;
+  uint32_t l1 = leb_length(p);
+  uint32_t l2 = leb_length(p + l1);
+  uint32_t has1 = shape->lebs >= 1;
+  uint32_t has2 = shape->lebs >= 2;
+  uint32_t len = 1 + shape->fixed + (l1 & -has1) + (l2 & -has2);
+  // 5-byte LEBs may be out of range, which only the slow path diagnoses
+  uint32_t ok = shape->fast & (!has1 | (l1 <= 4)) & (!has2 | (l2 <= 4));
+  return len & -ok;
+}
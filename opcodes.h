@@ -0,0 +1,24 @@
+#pragma once
+
+#include "common.h"
+#include "weewasm.h"
+
+// Metadata for decoding and disassembling a bytecode, generated from the
+// opcode specification.
+typedef struct {
+  const char* mnemonic;
+  byte immkind;
+  byte illegal;  // not part of weewasm
+  byte internal; // only produced by the loader
+} opcode_imm_t;
+
+extern const opcode_imm_t opcode_imm_table[256];
+
+// The number of bytes that must be readable at an instruction for
+// {bytecode_length_fast} to be used.
+#define BYTECODE_FAST_SLACK 32
+
+// Computes the length of the instruction at {ptr} from the immediate-kind tables
+// and branch-free LEB length computation. Returns 0 if the instruction has a
+// variable-length immediate or a long LEB and must be decoded the slow way.
+uint32_t bytecode_length_fast(const byte* ptr);
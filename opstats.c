@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "ir.h"
+#include "disass.h"
+#include "opstats.h"
+
+// The number of the most frequent opcode pairs that are reported.
+#define OPSTATS_TOP_PAIRS 32
+
+opstats_t* new_opstats(wasm_module_t* module) {
+  opstats_t* stats = (opstats_t*)malloc(sizeof(opstats_t));
+  stats->bytes = module->bytes_start;
+  stats->length = (uint32_t)(module->bytes_end - module->bytes_start);
+  stats->counts = (uint64_t*)calloc(stats->length + 1, sizeof(uint64_t));
+  stats->pairs = (uint64_t(*)[256])calloc(256, sizeof(uint64_t[256]));
+  stats->prev = -1;
+  return stats;
+}
+
+void free_opstats(opstats_t* stats) {
+  if (stats == NULL) return;
+  free(stats->counts);
+  free(stats->pairs);
+  free(stats);
+}
+
+// A count and what it counts, for sorting.
+typedef struct {
+  uint64_t count;
+  uint32_t key;
+} tally_t;
+
+static int by_count(const void* a, const void* b) {
+  const tally_t* x = (const tally_t*)a;
+  const tally_t* y = (const tally_t*)b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Sorts the non-zero tallies of {counts} by decreasing count. Returns how many there are.
+static uint32_t sort_tallies(const uint64_t* counts, uint32_t length, tally_t* tallies) {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    if (counts[i] != 0) tallies[n++] = (tally_t){counts[i], i};
+  }
+  qsort(tallies, n, sizeof(tally_t), by_count);
+  return n;
+}
+
+// Returns the total count of the instructions of {func}.
+static uint64_t func_count(opstats_t* stats, wasm_func_decl_t* func) {
+  uint64_t total = 0;
+  for (uint32_t i = func->instr_start; i < func->code_end; i++) total += stats->counts[i];
+  return total;
+}
+
+static void print_func_name(FILE* out, wasm_module_t* module, uint32_t func_index) {
+  const char* name = wasm_func_debug_name(module, func_index);
+  fprintf(out, "func[%u]%s%s", func_index, name != NULL ? " " : "", name != NULL ? name : "");
+}
+
+static double percent(uint64_t count, uint64_t total) {
+  return total == 0 ? 0.0 : 100.0 * (double)count / (double)total;
+}
+
+void print_opstats(FILE* out, opstats_t* stats, wasm_module_t* module) {
+  uint64_t ops[256] = {0};
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < stats->length; i++) {
+    ops[stats->bytes[i]] += stats->counts[i];
+    total += stats->counts[i];
+  }
+  tally_t* tallies = (tally_t*)malloc(sizeof(tally_t) * (256 * 256 + module->num_funcs));
+  fprintf(out, "opstats: %llu instructions\n", (unsigned long long)total);
+
+  fprintf(out, "opcodes:\n");
+  uint32_t n = sort_tallies(ops, 256, tallies);
+  for (uint32_t i = 0; i < n; i++) {
+    fprintf(out, "  %14llu %6.2f%%  %s\n", (unsigned long long)tallies[i].count,
+            percent(tallies[i].count, total), bytecode_name((byte)tallies[i].key));
+  }
+
+  fprintf(out, "pairs:\n");
+  n = sort_tallies(&stats->pairs[0][0], 256 * 256, tallies);
+  for (uint32_t i = 0; i < n && i < OPSTATS_TOP_PAIRS; i++) {
+    fprintf(out, "  %14llu %6.2f%%  %s %s\n", (unsigned long long)tallies[i].count,
+            percent(tallies[i].count, total), bytecode_name((byte)(tallies[i].key >> 8)),
+            bytecode_name((byte)tallies[i].key));
+  }
+
+  fprintf(out, "functions:\n");
+  uint64_t* funcs = (uint64_t*)calloc(module->num_funcs + 1, sizeof(uint64_t));
+  for (uint32_t i = 0; i < module->num_funcs; i++) {
+    if (module->funcs[i].code_end != 0) funcs[i] = func_count(stats, &module->funcs[i]);
+  }
+  n = sort_tallies(funcs, module->num_funcs, tallies);
+  for (uint32_t i = 0; i < n; i++) {
+    fprintf(out, "  %14llu %6.2f%%  ", (unsigned long long)tallies[i].count, percent(tallies[i].count, total));
+    print_func_name(out, module, tallies[i].key);
+    fprintf(out, "\n");
+  }
+
+  // the code is listed as it was rewritten, which is what ran
+  for (uint32_t i = 0; i < module->num_funcs; i++) {
+    if (funcs[i] == 0) continue;
+    wasm_func_decl_t* func = &module->funcs[i];
+    fprintf(out, "\n");
+    print_func_name(out, module, i);
+    fprintf(out, ":\n");
+    buffer_t buf = {stats->bytes, stats->bytes + func->instr_start, stats->bytes + func->code_end};
+    while (buf.ptr < buf.end) {
+      uint32_t offset = (uint32_t)(buf.ptr - buf.start);
+      fprintf(out, "  %14llu  +%-6u ", (unsigned long long)stats->counts[offset], offset);
+      fprint_bytecode(out, &buf);
+    }
+  }
+  free(funcs);
+  free(tallies);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ir.h"
+
+// Execution counts of the instructions of a module, collected by the interpreter
+// when an instance has them: how often the instruction at each offset ran, and
+// how often each opcode was followed by each other opcode.
+typedef struct opstats {
+  const byte* bytes; // the module's bytes, which offsets are relative to
+  uint32_t length;
+  uint64_t* counts; // per offset in {bytes}
+  uint64_t (*pairs)[256]; // [previous opcode][opcode]
+  int prev; // the opcode executed last, or -1
+} opstats_t;
+
+opstats_t* new_opstats(wasm_module_t* module);
+void free_opstats(opstats_t* stats);
+
+// Counts the execution of the instruction at {ip}.
+static inline void opstats_count(opstats_t* stats, const byte* ip) {
+  byte op = *ip;
+  stats->counts[ip - stats->bytes]++;
+  if (stats->prev >= 0) stats->pairs[stats->prev][op]++;
+  stats->prev = op;
+}
+
+// Writes the counts per opcode, per opcode pair and per function, sorted by
+// count, and then the code of each function that ran with the count of each
+// instruction beside it.
+void print_opstats(FILE* out, opstats_t* stats, wasm_module_t* module);
@@ -0,0 +1,484 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "obj.h"
+#include "out.h"
+
+// Each thread buffers its own output.
+static _Thread_local struct {
+  uint32_t length;
+  byte data[OUT_BUFFER_SIZE];
+} out;
+
+static _Thread_local int out_fd = STDOUT_FILENO;
+
+// The output collected while capturing, if {active}.
+static _Thread_local struct {
+  int active;
+  size_t length;
+  size_t capacity;
+  byte* data;
+} captured;
+
+static int out_registered = 0; // captured output never needs the flush at exit
+
+// Writes all of {length} bytes to the output file, retrying short writes.
+static void write_stdout(const byte* data, size_t length) {
+  if (captured.active) {
+    if (captured.length + length > captured.capacity) {
+      captured.capacity = (captured.length + length) * 2;
+      captured.data = (byte*)realloc(captured.data, captured.capacity);
+    }
+    memcpy(captured.data + captured.length, data, length);
+    captured.length += length;
+    return;
+  }
+  while (length > 0) {
+    ssize_t r = write(out_fd, data, length);
+    if (r <= 0) return;
+    data += r;
+    length -= (size_t)r;
+  }
+}
+
+void out_flush() {
+  if (out.length == 0) return;
+  if (!captured.active) fflush(stdout); // anything printed through stdio comes first
+  write_stdout(out.data, out.length);
+  out.length = 0;
+}
+
+void out_set_fd(int fd) {
+  out_flush();
+  out_fd = fd;
+}
+
+void out_begin_capture() {
+  out_flush();
+  captured.active = 1;
+  captured.length = 0;
+  captured.capacity = 0;
+  captured.data = NULL;
+}
+
+byte* out_end_capture(size_t* length) {
+  out_flush();
+  captured.active = 0;
+  *length = captured.length;
+  return captured.data;
+}
+
+// Makes room for {length} bytes, which must be less than the buffer size.
+static inline byte* out_reserve(uint32_t length) {
+  if (out.length + length > OUT_BUFFER_SIZE) out_flush();
+  if (!out_registered && !captured.active) {
+    out_registered = 1;
+    atexit(out_flush);
+  }
+  return out.data + out.length;
+}
+
+void out_bytes(const byte* data, size_t length) {
+  if (length >= OUT_DIRECT_SIZE) {
+    out_flush();
+    if (!captured.active) fflush(stdout);
+    write_stdout(data, length);
+    return;
+  }
+  memcpy(out_reserve((uint32_t)length), data, length);
+  out.length += (uint32_t)length;
+}
+
+void out_str(const char* str) {
+  out_bytes((const byte*)str, strlen(str));
+}
+
+void out_i32(int32_t val) {
+  byte* p = out_reserve(11);
+  char digits[10];
+  uint32_t n = 0;
+  uint32_t u = val < 0 ? 0u - (uint32_t)val : (uint32_t)val;
+  do {
+    digits[n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  uint32_t i = 0;
+  if (val < 0) p[i++] = '-';
+  while (n > 0) p[i++] = digits[--n];
+  out.length += i;
+}
+
+// Unsigned integers big enough to hold a double scaled by a power of 10, so
+// that doubles can be formatted exactly without stdio.
+#define BIG_LIMBS 40
+
+typedef struct {
+  uint32_t n; // the number of limbs in use, the most significant one non-zero
+  uint32_t limbs[BIG_LIMBS]; // least significant first
+} big_t;
+
+static void big_set(big_t* b, uint64_t val) {
+  b->n = 0;
+  for (; val != 0; val >>= 32) b->limbs[b->n++] = (uint32_t)val;
+}
+
+static void big_trim(big_t* b) {
+  while (b->n > 0 && b->limbs[b->n - 1] == 0) b->n--;
+}
+
+static void big_mul_small(big_t* b, uint32_t m) {
+  uint64_t carry = 0;
+  for (uint32_t i = 0; i < b->n; i++) {
+    uint64_t p = (uint64_t)b->limbs[i] * m + carry;
+    b->limbs[i] = (uint32_t)p;
+    carry = p >> 32;
+  }
+  if (carry != 0) b->limbs[b->n++] = (uint32_t)carry;
+}
+
+static void big_mul_pow10(big_t* b, uint32_t k) {
+  static const uint32_t pow10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+  for (; k >= 9; k -= 9) big_mul_small(b, 1000000000);
+  if (k > 0) big_mul_small(b, pow10[k]);
+}
+
+// Multiplies {b} by 2^{bits}.
+static void big_shl(big_t* b, uint32_t bits) {
+  if (b->n == 0) return;
+  uint32_t words = bits / 32, shift = bits % 32;
+  uint32_t n = b->n + words + 1;
+  for (uint32_t i = n; i-- > words;) {
+    uint32_t j = i - words;
+    uint32_t hi = j < b->n ? b->limbs[j] << shift : 0;
+    uint32_t lo = shift != 0 && j > 0 && j - 1 < b->n ? b->limbs[j - 1] >> (32 - shift) : 0;
+    b->limbs[i] = hi | lo;
+  }
+  for (uint32_t i = 0; i < words; i++) b->limbs[i] = 0;
+  b->n = n;
+  big_trim(b);
+}
+
+// Divides {b} by 2^{bits}, rounding to the nearest, ties to even.
+static void big_shr_round(big_t* b, uint32_t bits) {
+  if (bits == 0) return;
+  uint32_t half = bits - 1; // the index of the most significant bit shifted out
+  int round = 0;
+  if (half / 32 < b->n && (b->limbs[half / 32] >> (half % 32)) & 1) {
+    int below = (b->limbs[half / 32] & ((1u << (half % 32)) - 1)) != 0;
+    for (uint32_t i = 0; i < half / 32 && i < b->n && !below; i++) below = b->limbs[i] != 0;
+    int odd = bits / 32 < b->n && (b->limbs[bits / 32] >> (bits % 32)) & 1;
+    round = below || odd;
+  }
+  uint32_t words = bits / 32, shift = bits % 32;
+  uint32_t n = b->n > words ? b->n - words : 0;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t lo = b->limbs[i + words] >> shift;
+    uint32_t hi = shift != 0 && i + words + 1 < b->n ? b->limbs[i + words + 1] << (32 - shift) : 0;
+    b->limbs[i] = lo | hi;
+  }
+  b->n = n;
+  big_trim(b);
+  for (uint32_t i = 0; round; i++) {
+    if (i == b->n) b->limbs[b->n++] = 0;
+    round = ++b->limbs[i] == 0;
+  }
+}
+
+// Divides {b} by {d}, returning the remainder.
+static uint32_t big_div_small(big_t* b, uint32_t d) {
+  uint64_t rem = 0;
+  for (uint32_t i = b->n; i-- > 0;) {
+    uint64_t cur = (rem << 32) | b->limbs[i];
+    b->limbs[i] = (uint32_t)(cur / d);
+    rem = cur % d;
+  }
+  big_trim(b);
+  return (uint32_t)rem;
+}
+
+static int big_cmp(const big_t* a, const big_t* b) {
+  if (a->n != b->n) return a->n < b->n ? -1 : 1;
+  for (uint32_t i = a->n; i-- > 0;) {
+    if (a->limbs[i] != b->limbs[i]) return a->limbs[i] < b->limbs[i] ? -1 : 1;
+  }
+  return 0;
+}
+
+// Computes {dst} = {a} + {b}.
+static void big_add(big_t* dst, const big_t* a, const big_t* b) {
+  uint32_t n = a->n > b->n ? a->n : b->n;
+  uint64_t carry = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t sum = carry + (i < a->n ? a->limbs[i] : 0) + (i < b->n ? b->limbs[i] : 0);
+    dst->limbs[i] = (uint32_t)sum;
+    carry = sum >> 32;
+  }
+  dst->n = n;
+  if (carry != 0) dst->limbs[dst->n++] = (uint32_t)carry;
+}
+
+// Computes {a} -= {b}, where {a} >= {b}.
+static void big_sub(big_t* a, const big_t* b) {
+  int64_t borrow = 0;
+  for (uint32_t i = 0; i < a->n; i++) {
+    int64_t diff = (int64_t)a->limbs[i] - (i < b->n ? b->limbs[i] : 0) - borrow;
+    borrow = diff < 0;
+    a->limbs[i] = (uint32_t)diff;
+  }
+  big_trim(a);
+}
+
+// Splits a finite, positive double into {val} = {f} * 2^{e}.
+static void split_double(double val, uint64_t* f, int* e) {
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  uint64_t frac = bits & ((1ull << 52) - 1);
+  int biased = (int)(bits >> 52) & 0x7FF;
+  *f = biased == 0 ? frac : frac | (1ull << 52);
+  *e = (biased == 0 ? 1 : biased) - 1075;
+}
+
+// Writes the sign and name of a NaN or infinity like printf does, or returns 0
+// if {val} is finite.
+static uint32_t format_special_double(char* buf, double val) {
+  if (isfinite(val)) return 0;
+  uint32_t i = 0;
+  if (signbit(val)) buf[i++] = '-';
+  memcpy(buf + i, isnan(val) ? "nan" : "inf", 3);
+  return i + 3;
+}
+
+// Writes the {n} significant digits of a number, the first of which has the
+// decimal exponent {exp}, like "%.{n}g".
+static uint32_t format_digits(char* buf, const char* digits, uint32_t n, int exp) {
+  uint32_t i = 0;
+  if (exp >= -4 && exp < (int)n) {
+    if (exp < 0) {
+      buf[i++] = '0';
+      buf[i++] = '.';
+      for (int z = -1; z > exp; z--) buf[i++] = '0';
+      for (uint32_t d = 0; d < n; d++) buf[i++] = digits[d];
+      return i;
+    }
+    for (uint32_t d = 0; d < n; d++) {
+      buf[i++] = digits[d];
+      if ((int)d == exp && d + 1 < n) buf[i++] = '.';
+    }
+    return i;
+  }
+  buf[i++] = digits[0];
+  if (n > 1) buf[i++] = '.';
+  for (uint32_t d = 1; d < n; d++) buf[i++] = digits[d];
+  buf[i++] = 'e';
+  buf[i++] = exp < 0 ? '-' : '+';
+  uint32_t u = (uint32_t)(exp < 0 ? -exp : exp);
+  if (u >= 100) buf[i++] = (char)('0' + u / 100);
+  buf[i++] = (char)('0' + u / 10 % 10);
+  buf[i++] = (char)('0' + u % 10);
+  return i;
+}
+
+// Formats an integral double with magnitude below 2^53, whose shortest digits
+// are its significant digits.
+static uint32_t format_integral_double(char* buf, double val) {
+  uint32_t i = 0;
+  if (signbit(val)) buf[i++] = '-';
+  uint64_t u = (uint64_t)fabs(val);
+  if (u == 0) {
+    buf[i++] = '0';
+    return i;
+  }
+  char digits[20];
+  uint32_t n = 0;
+  for (; u != 0; u /= 10) digits[n++] = (char)('0' + u % 10);
+  int exp = (int)n - 1;
+  uint32_t zeros = 0;
+  while (digits[zeros] == '0') zeros++;
+  for (uint32_t d = 0; d < n / 2; d++) {
+    char t = digits[d];
+    digits[d] = digits[n - 1 - d];
+    digits[n - 1 - d] = t;
+  }
+  return i + format_digits(buf + i, digits, n - zeros, exp);
+}
+
+// Generates the digits of the shortest "%.*g" form of a finite, positive
+// {val} that reads back as {val}, and the decimal exponent of the first. At
+// each precision, the value rounded to that many digits is the candidate, and
+// it reads back if it lies within half a unit in the last place of {val}.
+// This is exact, with {val} = r / s and half a unit below and above {val}
+// being mlo / s and mhi / s, scaled so that digits come out of r / s.
+static uint32_t shortest_digits(double val, char* digits, int* exp) {
+  uint64_t f;
+  int e;
+  split_double(val, &f, &e);
+  int even = (f & 1) == 0; // the midpoints round to {val} when reading back
+  int boundary = f == (1ull << 52) && e > -1074; // the gap below is half that above
+  big_t r, s, mlo, mhi, t;
+  big_set(&r, f << (boundary ? 2 : 1));
+  big_set(&s, boundary ? 4 : 2);
+  big_set(&mlo, 1);
+  big_set(&mhi, boundary ? 2 : 1);
+  if (e >= 0) {
+    big_shl(&r, (uint32_t)e);
+    big_shl(&mlo, (uint32_t)e);
+    big_shl(&mhi, (uint32_t)e);
+  } else {
+    big_shl(&s, (uint32_t)-e);
+  }
+  // estimate k = ceil(log10(val)) from the binary exponent, with log10(2) ~ 78913 / 2^18
+  int x = e + 63 - __builtin_clzll(f);
+  int k = x >= 0 ? ((x * 78913) >> 18) + 1 : -((-x * 78913) >> 18);
+  if (k >= 0) {
+    big_mul_pow10(&s, (uint32_t)k);
+  } else {
+    big_mul_pow10(&r, (uint32_t)-k);
+    big_mul_pow10(&mlo, (uint32_t)-k);
+    big_mul_pow10(&mhi, (uint32_t)-k);
+  }
+  // make 0.1 <= r / s < 1, correcting the estimate of k
+  while (big_cmp(&r, &s) >= 0) {
+    big_mul_small(&s, 10);
+    k++;
+  }
+  for (;;) {
+    t = r;
+    big_mul_small(&t, 10);
+    if (big_cmp(&t, &s) >= 0) break;
+    r = t;
+    big_mul_small(&mlo, 10);
+    big_mul_small(&mhi, 10);
+    k--;
+  }
+  *exp = k - 1;
+  uint32_t n = 0;
+  for (;;) {
+    big_mul_small(&r, 10);
+    big_mul_small(&mlo, 10);
+    big_mul_small(&mhi, 10);
+    int d = 0;
+    while (big_cmp(&r, &s) >= 0) {
+      big_sub(&r, &s);
+      d++;
+    }
+    digits[n++] = (char)('0' + d);
+    big_add(&t, &r, &r);
+    int c = big_cmp(&t, &s);
+    int up = c > 0 || (c == 0 && (d & 1));
+    int fits;
+    if (up) {
+      big_add(&t, &r, &mhi);
+      c = big_cmp(&t, &s);
+      fits = c > 0 || (c == 0 && even);
+    } else {
+      c = big_cmp(&r, &mlo);
+      fits = c < 0 || (c == 0 && even);
+    }
+    if (!fits) continue;
+    if (up) {
+      uint32_t i = n;
+      while (i > 0 && digits[i - 1] == '9') digits[--i] = '0';
+      if (i == 0) {
+        digits[0] = '1';
+        (*exp)++;
+      } else {
+        digits[i - 1]++;
+      }
+    }
+    while (n > 1 && digits[n - 1] == '0') n--;
+    return n;
+  }
+}
+
+uint32_t format_shortest_double(char* buf, double val) {
+  if (fabs(val) < 9007199254740992.0 && val == (double)(int64_t)val) {
+    return format_integral_double(buf, val);
+  }
+  uint32_t i = format_special_double(buf, val);
+  if (i > 0) return i;
+  if (signbit(val)) buf[i++] = '-';
+  char digits[17];
+  int exp;
+  uint32_t n = shortest_digits(fabs(val), digits, &exp);
+  return i + format_digits(buf + i, digits, n, exp);
+}
+
+void out_f64(double val) {
+  byte* p = out_reserve(32);
+  out.length += format_shortest_double((char*)p, val);
+}
+
+// Formats a double like "%lf", which holds up to 318 bytes.
+static uint32_t format_fixed_double(char* buf, double val) {
+  uint32_t i = format_special_double(buf, val);
+  if (i > 0) return i;
+  if (signbit(val)) buf[i++] = '-';
+  uint64_t f;
+  int e;
+  split_double(fabs(val), &f, &e);
+  // round {val} * 10^6 to an integer, and print it with six decimals
+  big_t b;
+  big_set(&b, f);
+  big_mul_pow10(&b, 6);
+  if (e >= 0) big_shl(&b, (uint32_t)e);
+  else big_shr_round(&b, (uint32_t)-e);
+  char digits[330]; // whole chunks of 9 digits
+  uint32_t n = 0;
+  while (b.n > 0) {
+    uint32_t chunk = big_div_small(&b, 1000000000);
+    for (int d = 0; d < 9; d++, chunk /= 10) digits[n++] = (char)('0' + chunk % 10);
+  }
+  while (n > 0 && digits[n - 1] == '0') n--;
+  while (n < 7) digits[n++] = '0';
+  while (n > 6) buf[i++] = digits[--n];
+  buf[i++] = '.';
+  while (n > 0) buf[i++] = digits[--n];
+  return i;
+}
+
+// Formats a pointer like "%p".
+static uint32_t format_pointer(char* buf, const void* ptr) {
+  uintptr_t u = (uintptr_t)ptr;
+  char digits[2 * sizeof(uintptr_t)];
+  uint32_t n = 0;
+  do {
+    digits[n++] = "0123456789abcdef"[u & 15];
+    u >>= 4;
+  } while (u != 0);
+  uint32_t i = 0;
+  buf[i++] = '0';
+  buf[i++] = 'x';
+  while (n > 0) buf[i++] = digits[--n];
+  return i;
+}
+
+void out_wasm_value(wasm_value_t val) {
+  char buf[320];
+  switch (val.tag) {
+  case I32:
+    out_i32((int32_t)val.val.i32);
+    break;
+  case F64:
+    out_bytes((const byte*)buf, format_fixed_double(buf, val.val.f64));
+    break;
+  case EXTERNREF:
+    if (val.val.ref == NULL) out_str("null");
+    else out_bytes((const byte*)buf, format_pointer(buf, val.val.ref));
+    break;
+  }
+}
+
+void out_results(const wasm_value_t* vals, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0) out_str(" ");
+    wasm_value_t val = vals[i];
+    if (val.tag == EXTERNREF && ref_is_i32(val.val.ref)) val = wasm_i32_value(ref_i32(val.val.ref));
+    out_wasm_value(val);
+  }
+  out_str("\n");
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "ir.h"
+
+// The output of a running module (puti, putd, puts, and the results of main) is
+// collected in a buffer and written to stdout when the buffer is full, on a trap,
+// and at exit. Each thread has its own buffer and output file.
+#define OUT_BUFFER_SIZE 65536
+
+// Strings at least this long are written straight to stdout rather than copied.
+#define OUT_DIRECT_SIZE 4096
+
+// Appends {length} bytes to the output.
+void out_bytes(const byte* data, size_t length);
+
+// Appends a string to the output.
+void out_str(const char* str);
+
+// Appends an i32 in decimal, like printf("%d").
+void out_i32(int32_t val);
+
+// Appends a double in the shortest "%.*g" form that reads back as the same value.
+void out_f64(double val);
+
+// Appends a value in the same format as {print_wasm_value}.
+void out_wasm_value(wasm_value_t val);
+
+// Appends the results of a call separated by spaces, with boxed i32s printed as
+// numbers like noderun.js does, and a newline.
+void out_results(const wasm_value_t* vals, uint32_t count);
+
+// Writes the buffered output to stdout, or the file set by {out_set_fd}.
+void out_flush();
+
+// Flushes the output and directs further output to {fd}.
+void out_set_fd(int fd);
+
+// Collects the further output of this thread in memory instead of writing it,
+// until {out_end_capture}.
+void out_begin_capture();
+
+// Ends capturing and returns the captured output, which the caller frees, and
+// its {length}. Returns NULL if nothing was output.
+byte* out_end_capture(size_t* length);
+
+// Formats a double like {out_f64} into {buf}, which must hold at least 32 bytes.
+// Returns the length.
+uint32_t format_shortest_double(char* buf, double val);
@@ -11,9 +11,14 @@
 #include "illegal.h"
 #include "ir.h"
 #include "disass.h"
+#include "imports.h"
+#include "events.h"
 
 #define CHECK(x) do { if(!(x)) return -2; } while(0)
 
+// Limit the number of locals in a function to something reasonable.
+#define MAX_LOCALS 50000
+
 // Read a string and print its length and UTF-8 chars.
 int read_and_copy_string(buffer_t* buf, const char** nameptr, const byte* sectend) {
   uint32_t namelen = read_u32leb(buf);
@@ -77,7 +82,36 @@ void read_limits(buffer_t* buf, wasm_limits_t* dest) {
   }
 }
 
-// Reads a section code, skipping custom sections.
+// Reads the function names in the "name" section in {buf}, skipping the other
+// subsections. Custom sections are not validated, so a malformed one only loses
+// names.
+static void read_name_section(buffer_t* buf, wasm_module_t* module) {
+  while (buf->ptr < buf->end) {
+    uint32_t id = read_u8(buf);
+    uint32_t size = read_u32leb(buf);
+    if (size > (uint32_t)(buf->end - buf->ptr)) return;
+    const byte* subend = buf->ptr + size;
+    if (id == 1 && module->func_names == NULL) {
+      uint32_t count = read_u32leb(buf);
+      if (count > size) return; // each name takes at least two bytes
+      module->func_names = (wasm_func_name_t*)calloc(count + 1, sizeof(wasm_func_name_t));
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = read_u32leb(buf);
+        uint32_t length = read_u32leb(buf);
+        if (buf->ptr > subend || length > (uint32_t)(subend - buf->ptr)) break;
+        wasm_func_name_t* name = &module->func_names[module->num_func_names++];
+        name->index = index;
+        name->name = strndup((const char*)buf->ptr, length);
+        DISASS("\n  func[%u] \"%s\"", index, name->name);
+        buf->ptr += length;
+      }
+    }
+    buf->ptr = subend;
+  }
+}
+
+// Reads a section code, skipping custom sections. Returns 0 at the end of the
+// module.
 int read_section_code(buffer_t* buf, wasm_module_t* module, uint32_t* sectlen) {
   while (buf->ptr < buf->end) {
     byte code = read_u8(buf);
@@ -94,12 +128,18 @@ int read_section_code(buffer_t* buf, wasm_module_t* module, uint32_t* sectlen) {
     DISASS("%u ", sectlen);
     CHECK((buf->end - buf->ptr) >= sectlen);
     const byte* sectend = buf->ptr + sectlen;
-    read_and_copy_string(buf, NULL, sectend);
+    const char* name = NULL;
+    read_and_copy_string(buf, &name, sectend);
+    if (name != NULL && strcmp(name, "name") == 0 && buf->ptr <= sectend) {
+      buffer_t names = { buf->start, buf->ptr, sectend };
+      read_name_section(&names, module);
+    }
+    free((char*)name);
     DISASS("\n");
     buf->ptr = sectend;
   }
-  // reached the end of the file, or there was a nested error
-  return -1;
+  // reached the end of the file after custom sections
+  return buf->ptr == buf->end ? 0 : -1;
 }
 
 void read_type_decl(buffer_t* buf, wasm_sig_decl_t* dest, const byte* sectend) {
@@ -126,13 +166,21 @@ void read_type_decl(buffer_t* buf, wasm_sig_decl_t* dest, const byte* sectend) {
   DISASS("\n");
 }
 
-uint8_t bind_import(wasm_module_t* module, wasm_import_decl_t* decl) {
-  if (strcmp(decl->mod_name, "weewasm") != 0) ERR("!unrecognized import module: %s", decl->mod_name);
-  if (strcmp(decl->member_name, "puti") == 0) return WEEWASM_INTRINSIC_PUTI; // TODO: check signature
-  if (strcmp(decl->member_name, "putd") == 0) return WEEWASM_INTRINSIC_PUTD;
-  if (strcmp(decl->member_name, "puts") == 0) return WEEWASM_INTRINSIC_PUTS;
-  ERR("!unrecognized weewasm import: %s", decl->member_name);
-  return 0;
+uint8_t bind_import(wasm_module_t* module, wasm_import_decl_t* decl, uint32_t sig_index) {
+  const host_func_t* import = lookup_import(decl->mod_name, decl->member_name);
+  if (import == NULL || import->intrinsic == WEEWASM_INTRINSIC_HOST) {
+    if (strcmp(decl->mod_name, "weewasm") == 0) {
+      ERR("!unrecognized weewasm import: %s", decl->member_name);
+      return 0;
+    }
+    // bound to a host function when instantiated
+    return WEEWASM_INTRINSIC_HOST;
+  }
+  if (sig_index >= module->num_sigs || !sig_matches(&module->sigs[sig_index], import->sig)) {
+    ERR("!signature mismatch for weewasm import: %s", decl->member_name);
+    return 0;
+  }
+  return import->intrinsic;
 }
 
 void read_import_decl(buffer_t* buf, wasm_module_t* module, uint32_t import_index, uint32_t func_index, const byte* sectend) {
@@ -151,7 +199,7 @@ void read_import_decl(buffer_t* buf, wasm_module_t* module, uint32_t import_inde
     dest->index = func_index;
     wasm_func_decl_t* func = &module->funcs[func_index];
     func->sig_index = sig;
-    func->intrinsic = bind_import(module, dest);
+    func->intrinsic = bind_import(module, dest, sig);
     break;
   }
   case WASM_IMPORT_TABLE: {
@@ -198,32 +246,32 @@ void read_global_decl(buffer_t* buf, wasm_global_decl_t* dest, const byte* secte
   dest->init = read_init_expr(buf);
 }
 
-void read_export_decl(buffer_t* buf, wasm_module_t* module, const byte* sectend) {
+void read_export_decl(buffer_t* buf, wasm_export_decl_t* dest, const byte* sectend) {
   DISASS(" ");
-  uint32_t namelen = 0;
-  const char* name = NULL;
-  read_and_copy_string(buf, &name, sectend);
-  if (strcmp(name, "main") != 0) ERR("!expected export name \"main\", got %s", name);
-  free((char*)name); // XXX: avoid copy?
+  read_and_copy_string(buf, &dest->name, sectend);
 
   uint32_t code = read_u8(buf);
   DISASS(" %s", import_kind_name(code));
   uint32_t index = read_u32leb(buf);
   DISASS(" %u \t\t\t; export index\n", index);
+  dest->index = index;
   switch (code) {
   case WASM_IMPORT_FUNC: {
-    module->main_func = (int32_t)index;
+    dest->kind = FUNC;
     break;
   }
   case WASM_IMPORT_TABLE: {
+    dest->kind = TABLE;
     ERR("!illegal table export");
     break;
   }
   case WASM_IMPORT_MEMORY: {
+    dest->kind = MEMORY;
     ERR("!illegal memory export");
     break;
   }
   case WASM_IMPORT_GLOBAL: {
+    dest->kind = GLOBAL;
     ERR("!illegal global export");
     break;
   }
@@ -267,27 +315,38 @@ void read_elems_decl(buffer_t* buf, wasm_elems_decl_t* dest, const byte* sectend
   DISASS("\n");
 }
 
-void read_code_decl(buffer_t* buf, wasm_func_decl_t* dest, const byte* sectend) {
+int read_code_decl(buffer_t* buf, wasm_module_t* module, wasm_func_decl_t* dest, const byte* sectend) {
   uint32_t len = read_u32leb(buf);
   dest->code_start = (uint32_t)(buf->ptr - buf->start);
   const byte* codeend = buf->ptr + len;
+  CHECK(codeend <= sectend);
   DISASS("body %u \t\t\t; length\n", len);
   uint32_t cnt = read_u32leb(buf);
   DISASS(" %u \t\t\t; locals count\n", cnt);
-  for (uint32_t i = 0; i < cnt; i++) {
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < cnt && buf->ptr < codeend; i++) {
     uint32_t cnt = read_u32leb(buf);
     DISASS("  %u", cnt);
-    int32_t type = read_i32leb(buf);
-    DISASS(" %s\n", type_name(type));
-  }
-  if (g_disassemble) {
-    // disassemble code
-    while (buf->ptr < codeend && buf->ptr < buf->end) {
-      print_bytecode(buf);
+    wasm_type_t type = read_value_type(buf);
+    DISASS("\n");
+    if (cnt > MAX_LOCALS - total) {
+      ERR("!expected locals count <= %d, got %u", MAX_LOCALS, total + cnt);
+      return -2;
     }
+    dest->local_types = (wasm_type_t*)realloc(dest->local_types, (total + cnt) * sizeof(wasm_type_t));
+    for (uint32_t j = 0; j < cnt; j++) dest->local_types[total++] = type;
   }
+  dest->num_locals = total;
+  dest->instr_start = (uint32_t)(buf->ptr - buf->start);
+  CHECK(buf->ptr <= codeend);
+  // validate and rewrite the code in a single pass
+  uint32_t func_index = (uint32_t)(dest - module->funcs);
+  log_event(EVENT_BEGIN, EVENT_REWRITE, func_index);
+  int r = load_code(module, dest, (byte*)buf->ptr, (byte*)codeend);
+  log_event(EVENT_END, EVENT_REWRITE, func_index);
   buf->ptr = codeend;
   dest->code_end = (uint32_t)(buf->ptr - buf->start);
+  return r;
 }
 
 void read_data_decl(buffer_t* buf, wasm_data_decl_t* dest, const byte* sectend) {
@@ -344,8 +403,10 @@ uint32_t read_count(buffer_t* buf, uint32_t max, byte sectcode) {
 
 
 // The main parsing routine.
-int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
+static int parse_module(buffer_t* buf, wasm_module_t* module) {
   ssize_t len = 0;
+  module->bytes_start = buf->start;
+  module->bytes_end = buf->end;
 
   //==== Check magic word =============================================
   uint32_t magic = decode_u32(buf->ptr, buf->end, &len);
@@ -370,6 +431,7 @@ int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
     uint32_t sectlen = 0;
     int sectcode = read_section_code(buf, module, &sectlen);
     if (sectcode < 0) return -3;
+    if (sectcode == 0) break; // only custom sections were left
     const byte* sectend = buf->ptr + sectlen;
 
     switch (sectcode) {
@@ -410,8 +472,11 @@ int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
       break;
     }
     case WASM_SECT_EXPORT: {
-      read_count(buf, 1, sectcode);
-      read_export_decl(buf, module, sectend);
+      READ_ENTRIES(num_exports, exports, wasm_export_decl_t, read_export_decl);
+      for (uint32_t i = 0; i < module->num_exports; i++) {
+        wasm_export_decl_t* export = &module->exports[i];
+        if (export->kind == FUNC && strcmp(export->name, "main") == 0) module->main_func = (int32_t)export->index;
+      }
       break;
     }
     case WASM_SECT_START: {
@@ -430,7 +495,7 @@ int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
       if (count != num_bodies) ERR("!expected %d function bodies, got %d", num_bodies, count);
       uint32_t func_index = module->num_imports;
       for (uint32_t i = 0; i < count; i++, func_index++) {
-        read_code_decl(buf, &module->funcs[func_index], sectend);
+        CHECK(read_code_decl(buf, module, &module->funcs[func_index], sectend) >= 0);
       }
       break;
     }
@@ -447,3 +512,10 @@ int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
   return 0;
 }
 
+int parse_wasm_module(buffer_t* buf, wasm_module_t* module) {
+  log_event(EVENT_BEGIN, EVENT_PARSE, 0);
+  int r = parse_module(buf, module);
+  log_event(EVENT_END, EVENT_PARSE, 0);
+  if (thread_stats() != NULL) count_bytes(BYTES_MODULE, wasm_module_size(module));
+  return r;
+}
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "ir.h"
+#include "interp.h"
+#include "obj.h"
+#include "pool.h"
+#include "stats.h"
+
+// Maps the memory image of {t} privately at {addr}, or anywhere if NULL.
+static byte* map_image(instance_template_t* t, byte* addr) {
+  int flags = MAP_PRIVATE | (addr != NULL ? MAP_FIXED : 0);
+  void* p = mmap(addr, t->mem_size, PROT_READ | PROT_WRITE, flags, t->mem_fd, t->mem_offset);
+  return p == MAP_FAILED ? NULL : (byte*)p;
+}
+
+// Frees {t} except for its memory.
+static void free_template(instance_template_t* t) {
+  free(t->mem_image);
+  free(t->globals);
+  free(t->table);
+  free(t);
+}
+
+int write_memory_pages(int fd, off_t offset, const byte* mem, size_t size) {
+  for (size_t i = 0; i < size; i += WASM_PAGE_SIZE) {
+    const byte* page = mem + i;
+    if (page[0] == 0 && memcmp(page, page + 1, WASM_PAGE_SIZE - 1) == 0) continue;
+    if (pwrite(fd, page, WASM_PAGE_SIZE, offset + (off_t)i) != WASM_PAGE_SIZE) return -1;
+  }
+  return ftruncate(fd, offset + (off_t)size);
+}
+
+// Replaces the memory of {instance} with a private mapping of the template's.
+static int map_memory(instance_template_t* t, wasm_instance_t* instance) {
+  byte* mem = map_image(t, NULL);
+  if (mem == NULL) return -1;
+  free(instance->mem_start);
+  instance->mem_start = mem;
+  instance->mem_end = mem + t->mem_size;
+  return 0;
+}
+
+// Allocates a template for {instance} and copies its globals and table.
+static instance_template_t* new_template(wasm_instance_t* instance) {
+  wasm_module_t* module = instance->module;
+  instance_template_t* t = (instance_template_t*)calloc(1, sizeof(instance_template_t));
+  t->mem_fd = -1;
+  t->mem_size = (size_t)(instance->mem_end - instance->mem_start);
+  t->globals = (wasm_value_t*)malloc(sizeof(wasm_value_t) * (module->num_globals + 1));
+  memcpy(t->globals, instance->globals, sizeof(wasm_value_t) * module->num_globals);
+  t->table = (uint32_t*)malloc(sizeof(uint32_t) * (instance->table_size + 1));
+  if (instance->table_size > 0) memcpy(t->table, instance->table, sizeof(uint32_t) * instance->table_size);
+  return t;
+}
+
+int map_instance_template(wasm_instance_t* instance, int fd, off_t offset) {
+  instance_template_t* t = new_template(instance);
+  t->mem_fd = fd;
+  t->mem_offset = offset;
+  if (t->mem_size > 0 && map_memory(t, instance) < 0) {
+    t->mem_fd = -1;
+    free_template(t);
+    return -1;
+  }
+  instance->template = t;
+  return 0;
+}
+
+void save_instance_template(wasm_instance_t* instance) {
+  instance_template_t* t = new_template(instance);
+  if (t->mem_size > 0) {
+#ifdef MFD_CLOEXEC
+    t->mem_fd = memfd_create("weerun-memory", MFD_CLOEXEC);
+#endif
+    if (t->mem_fd < 0 || write_memory_pages(t->mem_fd, 0, instance->mem_start, t->mem_size) < 0 ||
+        map_memory(t, instance) < 0) {
+      // memfds are not available, so memory is restored by copying
+      if (t->mem_fd >= 0) close(t->mem_fd);
+      t->mem_fd = -1;
+      t->mem_image = (byte*)malloc(t->mem_size);
+      memcpy(t->mem_image, instance->mem_start, t->mem_size);
+    }
+  }
+  instance->template = t;
+}
+
+// Reads the memory image of {t} into {mem}, returning -1 unless all of it was read.
+static int read_image(instance_template_t* t, byte* mem) {
+  for (size_t done = 0; done < t->mem_size;) {
+    ssize_t r = pread(t->mem_fd, mem + done, t->mem_size - done, t->mem_offset + (off_t)done);
+    if (r <= 0) return -1;
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+int reset_wasm_instance(wasm_instance_t* instance) {
+  wasm_module_t* module = instance->module;
+  instance_template_t* t = instance->template;
+  if (t->mem_fd >= 0 && t->mem_size > 0) {
+    // replacing the mapping drops every page the last run wrote to
+    if (map_image(t, instance->mem_start) == NULL) {
+      ERR("!failed to remap memory, copying instead\n");
+      if (read_image(t, instance->mem_start) < 0) {
+        ERR("!failed to restore memory\n");
+        return -1;
+      }
+    }
+  } else if (t->mem_size > 0) {
+    memcpy(instance->mem_start, t->mem_image, t->mem_size);
+  }
+  memcpy(instance->globals, t->globals, sizeof(wasm_value_t) * module->num_globals);
+  if (instance->table_size > 0) memcpy(instance->table, t->table, sizeof(uint32_t) * instance->table_size);
+
+  memset(&instance->suspension, 0, sizeof(instance->suspension));
+  instance->poll = 0;
+  count_bytes(BYTES_OBJECTS, obj_gc_stats(instance->heap)->allocated_bytes);
+  free_obj_heap(instance->heap);
+  instance->heap = new_obj_heap();
+  memset(instance->caches, 0, sizeof(obj_cache_t) * module->num_caches);
+  obj_roots_t roots = {instance->stack_start, instance->globals, module->num_globals,
+                       instance->caches, module->num_caches};
+  obj_set_roots(instance->heap, &roots);
+  return 0;
+}
+
+void free_instance_template(wasm_instance_t* instance) {
+  instance_template_t* t = instance->template;
+  if (t->mem_fd >= 0) {
+    munmap(instance->mem_start, t->mem_size);
+    close(t->mem_fd);
+  } else {
+    free(instance->mem_start);
+  }
+  instance->mem_start = instance->mem_end = NULL;
+  free_template(t);
+  instance->template = NULL;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include "ir.h"
+#include "interp.h"
+
+// The state of an instance right after instantiation, from which it can be
+// reset for another run without instantiating the module again. Linear memory
+// is kept in a memfd and mapped privately, so a reset only remaps it and the
+// pages that a run did not write are never copied.
+typedef struct instance_template {
+  int mem_fd; // -1 if memory is restored by copying {mem_image}
+  off_t mem_offset; // where memory starts in {mem_fd}
+  byte* mem_image;
+  size_t mem_size;
+  int after_start; // 1 if the start function already ran in this state
+  wasm_value_t* globals;
+  uint32_t* table;
+} instance_template_t;
+
+// Writes the {size} bytes of memory at {mem} to {fd} at {offset}, leaving pages
+// that are all zero as holes. Returns < 0 on failure.
+int write_memory_pages(int fd, off_t offset, const byte* mem, size_t size);
+
+// Makes the template of {instance} the memory in {fd} at {offset}, which must be
+// page aligned, and its current globals and table. Returns < 0 if the memory
+// cannot be mapped.
+int map_instance_template(wasm_instance_t* instance, int fd, off_t offset);
+
+// Saves the current state of {instance} as its template, moving its memory into
+// a mapping of the template if memfds are available.
+void save_instance_template(wasm_instance_t* instance);
+
+// Restores memory, globals and the table of {instance} from its template, and
+// replaces its object heap with an empty one. Returns -1 if the memory could not
+// be restored, in which case the instance must not be run.
+int reset_wasm_instance(wasm_instance_t* instance);
+
+// Frees the template of {instance} and unmaps its memory.
+void free_instance_template(wasm_instance_t* instance);
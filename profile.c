@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "ir.h"
+#include "profile.h"
+
+// The number of distinct stacks a profile starts with room for.
+#define PROFILE_INITIAL_CAPACITY 256
+
+typedef struct {
+  uint64_t hash;
+  uint64_t count;
+  uint32_t offset;
+  uint32_t depth;
+  uint32_t* funcs; // outermost first
+} stack_entry_t;
+
+struct profile {
+  uint32_t count;
+  uint32_t capacity; // a power of 2
+  stack_entry_t* entries;
+  uint64_t samples;
+};
+
+profile_t* new_profile() {
+  profile_t* profile = (profile_t*)calloc(1, sizeof(profile_t));
+  profile->capacity = PROFILE_INITIAL_CAPACITY;
+  profile->entries = (stack_entry_t*)calloc(profile->capacity, sizeof(stack_entry_t));
+  return profile;
+}
+
+void free_profile(profile_t* profile) {
+  if (profile == NULL) return;
+  for (uint32_t i = 0; i < profile->capacity; i++) free(profile->entries[i].funcs);
+  free(profile->entries);
+  free(profile);
+}
+
+uint64_t profile_count(profile_t* profile) {
+  return profile->samples;
+}
+
+// Returns the slot for the stack with {hash}, which is empty if it is new.
+static stack_entry_t* find_slot(profile_t* profile, uint64_t hash, const wasm_frame_t* frames,
+                                uint32_t depth, uint32_t offset) {
+  uint32_t mask = profile->capacity - 1;
+  for (uint32_t i = (uint32_t)hash & mask;; i = (i + 1) & mask) {
+    stack_entry_t* e = &profile->entries[i];
+    if (e->funcs == NULL) return e;
+    if (e->hash != hash || e->depth != depth || e->offset != offset) continue;
+    uint32_t j = 0;
+    while (j < depth && e->funcs[j] == frames[j].func_index) j++;
+    if (j == depth) return e;
+  }
+}
+
+static void grow(profile_t* profile) {
+  stack_entry_t* old = profile->entries;
+  uint32_t old_capacity = profile->capacity;
+  profile->capacity *= 2;
+  profile->entries = (stack_entry_t*)calloc(profile->capacity, sizeof(stack_entry_t));
+  uint32_t mask = profile->capacity - 1;
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old[i].funcs == NULL) continue;
+    uint32_t j = (uint32_t)old[i].hash & mask;
+    while (profile->entries[j].funcs != NULL) j = (j + 1) & mask;
+    profile->entries[j] = old[i];
+  }
+  free(old);
+}
+
+void profile_sample(profile_t* profile, wasm_instance_t* instance, wasm_frame_t* frame, uint32_t offset) {
+  const wasm_frame_t* frames = instance->frames_start;
+  uint32_t depth = (uint32_t)(frame - frames) + 1;
+  uint64_t hash = 14695981039346656037ull ^ offset; // FNV-1a
+  for (uint32_t i = 0; i < depth; i++) hash = (hash ^ frames[i].func_index) * 1099511628211ull;
+  stack_entry_t* e = find_slot(profile, hash, frames, depth, offset);
+  if (e->funcs == NULL) {
+    e->hash = hash;
+    e->offset = offset;
+    e->depth = depth;
+    e->funcs = (uint32_t*)malloc(sizeof(uint32_t) * depth);
+    for (uint32_t i = 0; i < depth; i++) e->funcs[i] = frames[i].func_index;
+    profile->count++;
+  }
+  e->count++;
+  profile->samples++;
+  if (profile->count * 4 > profile->capacity * 3) grow(profile);
+}
+
+static wasm_instance_t* volatile profiled = NULL;
+
+// Asks the interpreter for a sample, which it takes at its next poll.
+static void on_sample(int sig) {
+  (void)sig;
+  wasm_instance_t* instance = profiled;
+  if (instance != NULL) __atomic_fetch_or(&instance->poll, POLL_SAMPLE, __ATOMIC_RELAXED);
+}
+
+void start_profiling(wasm_instance_t* instance, profile_t* profile, long interval_us) {
+  instance->profile = profile;
+  profiled = instance;
+  signal(SIGPROF, on_sample);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = interval_us / 1000000;
+  timer.it_interval.tv_usec = interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void stop_profiling() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  wasm_instance_t* instance = profiled;
+  profiled = NULL;
+  if (instance != NULL) instance->profile = NULL;
+}
+
+// Writes the name of {func_index}, with the characters that separate frames and
+// counts in folded stacks replaced.
+static void write_func_name(FILE* file, wasm_module_t* module, uint32_t func_index) {
+  const char* name = wasm_func_debug_name(module, func_index);
+  if (name == NULL) {
+    fprintf(file, "func[%u]", func_index);
+    return;
+  }
+  for (const char* p = name; *p; p++) fputc(*p == ';' || *p == ' ' ? '_' : *p, file);
+}
+
+int write_profile(profile_t* profile, wasm_module_t* module, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    ERR("!failed to write profile %s\n", path);
+    return -1;
+  }
+  for (uint32_t i = 0; i < profile->capacity; i++) {
+    stack_entry_t* e = &profile->entries[i];
+    if (e->funcs == NULL) continue;
+    for (uint32_t j = 0; j < e->depth; j++) {
+      write_func_name(file, module, e->funcs[j]);
+      fputc(';', file);
+    }
+    fprintf(file, "@+%u %llu\n", e->offset, (unsigned long long)e->count);
+  }
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "ir.h"
+
+// A sampled profile of the wasm call stacks of an instance, which counts how
+// often each stack was seen. Samples are requested by a SIGPROF timer and taken
+// by the interpreter at its next loop back-edge or call, where its frame state
+// is consistent.
+typedef struct profile profile_t;
+
+profile_t* new_profile();
+void free_profile(profile_t* profile);
+
+// Records the stack of {instance}, whose innermost frame {frame} is executing
+// at {offset} in the module's bytes.
+void profile_sample(profile_t* profile, wasm_instance_t* instance, wasm_frame_t* frame, uint32_t offset);
+
+// Samples {instance} into {profile} every {interval_us} microseconds of CPU time,
+// until {stop_profiling}. Only one instance is profiled at a time.
+void start_profiling(wasm_instance_t* instance, profile_t* profile, long interval_us);
+void stop_profiling();
+
+// Returns the number of samples recorded in {profile}.
+uint64_t profile_count(profile_t* profile);
+
+// Writes {profile} to {path} as folded stacks for flame graph tools: one line
+// per stack, with function names from the "name" section, then exports, and
+// the bytecode offset of the innermost frame as a last frame, like
+// "main;fib;fib;@+42 17". Returns < 0 on failure.
+int write_profile(profile_t* profile, wasm_module_t* module, const char* path);
@@ -11,131 +11,675 @@
 #include "illegal.h"
 #include "ir.h"
 #include "disass.h"
+#include "stats.h"
+
+// The type of an operand on the abstract stack during validation.
+// Uses the {wasm_type_t} constants, plus one for unreachable code.
+typedef uint8_t vtype_t;
+#define T_ANY 0xFF
+
+// A location of a branch that must be patched when its label is bound.
+typedef struct {
+  byte* pcdelta;
+  uint32_t stp;
+} branch_ref_t;
 
 typedef struct {
   unsigned is_loop: 1;
+  unsigned unreachable: 1;
   uint32_t start_pc;
+  uint32_t start_stp; // side table index at the start of the block
+  uint32_t height; // operand stack height at the start of the block
+  uint32_t arity; // number of values carried by a branch to this label
   uint32_t num_refs;
   uint32_t capacity;
-  int32_t** refs;
+  branch_ref_t* refs;
 } control_entry_t;
 
-void ref_entry(control_entry_t* entry, byte* pcdelta) {
+// State of the single pass over a function body, which validates, resolves
+// branches, and builds the side table at the same time.
+typedef struct {
+  wasm_module_t* module; // NULL when only rewriting branches
+  wasm_func_decl_t* func;
+  wasm_sig_decl_t* sig;
+  buffer_t* buf;
+
+  uint32_t vsp;
+  uint32_t vcapacity;
+  vtype_t* vals;
+
+  uint32_t csp;
+  uint32_t ccapacity;
+  control_entry_t* ctl;
+
+  uint32_t stp;
+  uint32_t scapacity;
+  wasm_sidetable_entry_t* sidetable;
+
+  byte* prev_call; // the previous instruction, if it was a call to an intrinsic
+  uint8_t prev_intrinsic;
+  byte* prev_get; // the previous instruction, if it was a local.get of a forwarded local
+  uint8_t* forwarded; // per declared local: the box intrinsic it carries unboxed, or 0
+} code_loader_t;
+
+void ref_entry(control_entry_t* entry, byte* pcdelta, uint32_t stp) {
   if (entry->num_refs >= entry->capacity) {
     uint32_t ncapacity = 4 + entry->capacity * 2;
     TRACE("ncapacity = %u\n", ncapacity);
-    entry->refs = (int32_t**)realloc(entry->refs, sizeof(int32_t*) * ncapacity);
+    entry->refs = (branch_ref_t*)realloc(entry->refs, sizeof(branch_ref_t) * ncapacity);
     entry->capacity = ncapacity;
   }
-  entry->refs[entry->num_refs++] = (int32_t*)pcdelta;
+  branch_ref_t* ref = &entry->refs[entry->num_refs++];
+  ref->pcdelta = pcdelta;
+  ref->stp = stp;
 }
 
-// Reads what should be a 4-byte LEB indicating a depth.
-uint32_t read_label(buffer_t* buf) {
-  const byte* before = buf->ptr;
-  uint32_t result = read_u32leb(buf);
-  uint32_t size = (uint32_t)(buf->ptr - before);
-  if (size != 4) ERR("invalid weewasm @+%d: expected 4 byte label, got %u bytes", (int)(before - buf->start), size);
-  return result;
+#define LOAD_ERR(...) do { ERR("!invalid code @+%d: ", (int)(L->buf->ptr - L->buf->start)); ERR(__VA_ARGS__); ERR("\n"); return -1; } while(0)
+#define LCHECK(x) do { if ((x) < 0) return -1; } while(0)
+
+// Reads what should be a 4-byte LEB indicating a depth into {depth}, without
+// rewriting anything. Returns < 0 if the label is unpadded or truncated.
+static int read_label(code_loader_t* L, uint32_t* depth) {
+  const byte* before = L->buf->ptr;
+  *depth = read_u32leb(L->buf);
+  uint32_t size = (uint32_t)(L->buf->ptr - before);
+  if (L->buf->ptr > L->buf->end) LOAD_ERR("truncated branch label");
+  if (size != 4) LOAD_ERR("expected 4 byte label, got %u bytes", size);
+  return 0;
 }
 
-// Rewrites "br*" to "jmp*"
-void rewrite_brs(byte* start, byte* end) {
-  buffer_t onstack_buf = { start, start, end };
-  buffer_t* buf = &onstack_buf;
-
-  uint32_t control_sp = 0;
-  uint32_t capacity = 16;
-  control_entry_t* control_stack = calloc(sizeof(control_entry_t), 16);
-
-  {
-    // push the initial control entry
-    control_entry_t* entry = &control_stack[control_sp++];
-    entry->start_pc = (uint32_t)(buf->ptr - buf->start);
-    entry->num_refs = 0;
-  }
-
-  // process all bytecodes, ignoring all but control flow
-  while (buf->ptr < buf->end) {
-    int pc = (int)(buf->ptr - buf->start);
-    byte b = *buf->ptr;
-    switch (b) {
-    case WASM_OP_BLOCK: // fall through
-    case WASM_OP_LOOP: {
-      TRACE("-> +%3d rewrite: control_block, depth=%d\n", pc, control_sp);
-      if (control_sp >= capacity) {
-        uint32_t ncapacity = capacity * 2;
-        control_stack = (control_entry_t*)realloc(control_stack, sizeof(control_entry_t) * ncapacity);
-        memset(&control_stack[control_sp], 0, sizeof(control_entry_t) * (ncapacity - control_sp));
-      }
-      control_entry_t* entry = &control_stack[control_sp++];
-      entry->is_loop = b == WASM_OP_LOOP;
-      entry->start_pc = (uint32_t)(buf->ptr - buf->start);
-      entry->num_refs = 0;
-      buf->ptr++;
-      read_i32leb(buf); // skip block type
-      break;
+static void push_type(code_loader_t* L, vtype_t t) {
+  if (L->vsp >= L->vcapacity) {
+    L->vcapacity = 16 + L->vcapacity * 2;
+    L->vals = (vtype_t*)realloc(L->vals, L->vcapacity);
+  }
+  L->vals[L->vsp++] = t;
+  if (L->vsp > L->func->max_stack) L->func->max_stack = L->vsp;
+}
+
+// Pops a value of the {expected} type, returning its actual type, or < 0 on error.
+static int pop_type(code_loader_t* L, vtype_t expected) {
+  control_entry_t* c = &L->ctl[L->csp - 1];
+  if (L->vsp == c->height) {
+    if (c->unreachable || L->module == NULL) return expected;
+    LOAD_ERR("operand stack underflow");
+  }
+  vtype_t t = L->vals[--L->vsp];
+  if (expected != T_ANY && t != T_ANY && t != expected) {
+    LOAD_ERR("type mismatch, expected %d, got %d", expected, t);
+  }
+  return t == T_ANY ? expected : t;
+}
+
+// Marks the rest of the current block as unreachable.
+static void set_unreachable(code_loader_t* L) {
+  control_entry_t* c = &L->ctl[L->csp - 1];
+  L->vsp = c->height;
+  c->unreachable = 1;
+}
+
+// Pops the params and pushes the results of a signature.
+static int apply_sig(code_loader_t* L, uint32_t sig_index) {
+  if (sig_index >= L->module->num_sigs) LOAD_ERR("invalid signature index %u", sig_index);
+  wasm_sig_decl_t* sig = &L->module->sigs[sig_index];
+  for (uint32_t i = sig->num_params; i > 0; i--) LCHECK(pop_type(L, sig->params[i - 1]));
+  for (uint32_t i = 0; i < sig->num_results; i++) push_type(L, sig->results[i]);
+  return 0;
+}
+
+static void push_control(code_loader_t* L, int is_loop, uint32_t pc, uint32_t arity) {
+  if (L->csp >= L->ccapacity) {
+    uint32_t ncapacity = 16 + L->ccapacity * 2;
+    L->ctl = (control_entry_t*)realloc(L->ctl, sizeof(control_entry_t) * ncapacity);
+    memset(&L->ctl[L->ccapacity], 0, sizeof(control_entry_t) * (ncapacity - L->ccapacity));
+    L->ccapacity = ncapacity;
+  }
+  control_entry_t* entry = &L->ctl[L->csp++];
+  entry->is_loop = is_loop;
+  entry->unreachable = 0;
+  entry->start_pc = pc;
+  entry->start_stp = L->stp;
+  entry->height = L->vsp;
+  entry->arity = arity;
+  entry->num_refs = 0;
+}
+
+// Checks the values expected by the label {target} are on top of the stack.
+static int check_label_values(code_loader_t* L, control_entry_t* target) {
+  if (target->arity == 0) return 0;
+  // only the function's label carries values
+  for (uint32_t i = target->arity; i > 0; i--) LCHECK(pop_type(L, L->sig->results[i - 1]));
+  for (uint32_t i = 0; i < target->arity; i++) push_type(L, L->sig->results[i]);
+  return 0;
+}
+
+// Records a branch at {pcdelta} to the label at {depth}, adding a side table entry.
+static int add_branch(code_loader_t* L, uint32_t depth, byte* pcdelta) {
+  if (depth >= L->csp) LOAD_ERR("invalid branch depth %u", depth);
+  control_entry_t* target = &L->ctl[L->csp - depth - 1];
+  LCHECK(check_label_values(L, target));
+  if (L->stp >= L->scapacity) {
+    L->scapacity = 16 + L->scapacity * 2;
+    L->sidetable = (wasm_sidetable_entry_t*)realloc(L->sidetable, sizeof(wasm_sidetable_entry_t) * L->scapacity);
+  }
+  wasm_sidetable_entry_t* entry = &L->sidetable[L->stp];
+  uint32_t above = L->vsp > target->height ? L->vsp - target->height : 0;
+  entry->val_count = target->arity;
+  entry->pop_count = above > target->arity ? above - target->arity : 0;
+  entry->stp_delta = 0;
+  if (target->is_loop) {
+    // backward branches can be patched immediately
+    int32_t ref_pc = (int32_t)(pcdelta - L->buf->start);
+    *(int32_t*)pcdelta = (int32_t)target->start_pc - ref_pc;
+    entry->stp_delta = (int32_t)target->start_stp - (int32_t)L->stp;
+  } else {
+    ref_entry(target, pcdelta, L->stp);
+  }
+  L->stp++;
+  return 0;
+}
+
+// Binds the label of the innermost block to the current position, patching forward branches.
+static void bind_label(code_loader_t* L, control_entry_t* entry, int32_t target_pc) {
+  for (uint32_t i = 0; i < entry->num_refs; i++) {
+    branch_ref_t* ref = &entry->refs[i];
+    int32_t ref_pc = (int32_t)(ref->pcdelta - L->buf->start);
+    TRACE("-> +%-3d rewrite: patch => %d\n", ref_pc, (target_pc - ref_pc));
+    *(int32_t*)ref->pcdelta = target_pc - ref_pc;
+    L->sidetable[ref->stp].stp_delta = (int32_t)L->stp - (int32_t)ref->stp;
+  }
+}
+
+// Reads a 4-byte label, rewriting its opcode to {jmp_op} and recording the branch.
+static int rewrite_label(code_loader_t* L, byte* opcode, byte jmp_op) {
+  byte* pcdelta = (byte*)L->buf->ptr;
+  uint32_t depth;
+  LCHECK(read_label(L, &depth));
+  TRACE("-> +%-3d rewrite: %s %u\n", (int)(pcdelta - L->buf->start), bytecode_name(jmp_op), depth);
+  LCHECK(add_branch(L, depth, pcdelta));
+  *opcode = jmp_op;
+  return 0;
+}
+
+// Returns the type of the local at {index}, or < 0 if out of range.
+static int local_type(code_loader_t* L, uint32_t index) {
+  uint32_t num_params = L->sig->num_params;
+  if (index < num_params) return L->sig->params[index];
+  if (index - num_params < L->func->num_locals) return L->func->local_types[index - num_params];
+  LOAD_ERR("invalid local index %u", index);
+}
+
+// Returns the declaration of the global at {index}, or NULL if out of range.
+static wasm_global_decl_t* global_decl(code_loader_t* L, uint32_t index) {
+  if (index < L->module->num_globals) return &L->module->globals[index];
+  ERR("!invalid code @+%d: invalid global index %u\n", (int)(L->buf->ptr - L->buf->start), index);
+  return NULL;
+}
+
+// Applies the typing rules of simple operators.
+#define UNOP(in, out) do { LCHECK(pop_type(L, in)); push_type(L, out); } while (0)
+#define BINOP(in, out) do { LCHECK(pop_type(L, in)); LCHECK(pop_type(L, in)); push_type(L, out); } while (0)
+#define LOAD(out) do { read_u8(buf); read_u32leb(buf); LCHECK(pop_type(L, I32)); push_type(L, out); } while (0)
+#define STORE(in) do { read_u8(buf); read_u32leb(buf); LCHECK(pop_type(L, in)); LCHECK(pop_type(L, I32)); } while (0)
+
+// Returns 1 if {b} is a bytecode that affects branch resolution.
+static int is_control_bytecode(byte b) {
+  switch (b) {
+  case WASM_OP_UNREACHABLE: // fall through
+  case WASM_OP_BLOCK: // fall through
+  case WASM_OP_LOOP: // fall through
+  case WASM_OP_END: // fall through
+  case WASM_OP_BR: // fall through
+  case WASM_OP_BR_IF: // fall through
+  case WASM_OP_BR_TABLE: return 1;
+  default: return 0;
+  }
+}
+
+// Rewrites a call to the obj.get or obj.set intrinsic into an opcode with its own
+// inline cache, if the cache index fits into the bytes of the function index.
+static void rewrite_cached_call(code_loader_t* L, byte* opcode, byte* imm, uint32_t func_index, byte op) {
+  uint32_t len = (uint32_t)(L->buf->ptr - imm);
+  uint32_t cache = L->module->num_caches;
+  if (len < 5 && (cache >> (7 * len)) != 0) return;
+  TRACE("-> +%-3d rewrite: call func[%u] -> cache[%u]\n", (int)(opcode - L->buf->start), func_index, cache);
+  for (uint32_t i = 0; i < len; i++) {
+    imm[i] = (byte)((cache >> (7 * i)) & 0x7F) | (i + 1 < len ? 0x80 : 0);
+  }
+  *opcode = op;
+  L->module->num_caches++;
+}
+
+// Rewrites a call to an intrinsic into the internal opcode that implements it
+// on the operand stack. The function index stays as the immediate.
+static void rewrite_intrinsic_call(code_loader_t* L, byte* opcode, byte* imm, uint32_t func_index) {
+  byte op;
+  switch (L->module->funcs[func_index].intrinsic) {
+  case WEEWASM_INTRINSIC_PUTI: op = WASM_OP_PUTI; break;
+  case WEEWASM_INTRINSIC_PUTD: op = WASM_OP_PUTD; break;
+  case WEEWASM_INTRINSIC_PUTS: op = WASM_OP_PUTS; break;
+  case WEEWASM_INTRINSIC_OBJ_NEW: op = WASM_OP_OBJ_NEW; break;
+  case WEEWASM_INTRINSIC_OBJ_GET: rewrite_cached_call(L, opcode, imm, func_index, WASM_OP_OBJ_GET_CACHED); return;
+  case WEEWASM_INTRINSIC_OBJ_SET: rewrite_cached_call(L, opcode, imm, func_index, WASM_OP_OBJ_SET_CACHED); return;
+  case WEEWASM_INTRINSIC_OBJ_BOX_I32: op = WASM_OP_OBJ_BOX_I32; break;
+  case WEEWASM_INTRINSIC_OBJ_BOX_F64: op = WASM_OP_OBJ_BOX_F64; break;
+  case WEEWASM_INTRINSIC_I32_UNBOX: op = WASM_OP_I32_UNBOX; break;
+  case WEEWASM_INTRINSIC_F64_UNBOX: op = WASM_OP_F64_UNBOX; break;
+  case WEEWASM_INTRINSIC_OBJ_EQ: op = WASM_OP_OBJ_EQ; break;
+  default: return;
+  }
+  TRACE("-> +%-3d rewrite: call func[%u] -> %s\n", (int)(opcode - L->buf->start), func_index, bytecode_name(op));
+  *opcode = op;
+}
+
+// Rewrites the call to an intrinsic at {opcode} into a "skip" over the rest of
+// the call and the following {count} bytes, if the count fits into the bytes
+// of the function index.
+static int rewrite_skip(code_loader_t* L, byte* opcode, uint32_t count) {
+  byte* imm = opcode + 1;
+  uint32_t len = 0;
+  while (imm[len] & 0x80) len++;
+  len++;
+  if (len < 5 && (count >> (7 * len)) != 0) return 0;
+  TRACE("-> +%-3d rewrite: %s -> skip %u\n", (int)(opcode - L->buf->start), bytecode_name(*opcode), count);
+  for (uint32_t i = 0; i < len; i++) {
+    imm[i] = (byte)((count >> (7 * i)) & 0x7F) | (i + 1 < len ? 0x80 : 0);
+  }
+  *opcode = WASM_OP_SKIP;
+  return 1;
+}
+
+// Cancels a call to {intrinsic} at {opcode} against the call to an intrinsic at
+// {prev} just before it: a box followed by the matching unbox does nothing.
+// Boxes carried through a local are handled by {find_forwarded_locals}. An
+// allocation that dies without a drop, or whose fields are used, is left alone.
+static int cancel_calls(code_loader_t* L, byte* prev, byte* opcode, uint8_t intrinsic) {
+  if (prev == NULL) return 0;
+  switch (L->prev_intrinsic) {
+  case WEEWASM_INTRINSIC_OBJ_BOX_I32: if (intrinsic != WEEWASM_INTRINSIC_I32_UNBOX) return 0; break;
+  case WEEWASM_INTRINSIC_OBJ_BOX_F64: if (intrinsic != WEEWASM_INTRINSIC_F64_UNBOX) return 0; break;
+  default: return 0;
+  }
+  return rewrite_skip(L, prev, (uint32_t)(L->buf->ptr - opcode));
+}
+
+// Removes the call to an intrinsic at {prev} just before a "drop" if it only
+// allocates: "obj.new; drop" does nothing and "box; drop" is a "drop".
+static void cancel_drop(code_loader_t* L, byte* prev) {
+  if (prev == NULL) return;
+  switch (L->prev_intrinsic) {
+  case WEEWASM_INTRINSIC_OBJ_NEW: rewrite_skip(L, prev, 1); break;
+  case WEEWASM_INTRINSIC_OBJ_BOX_I32: // fall through
+  case WEEWASM_INTRINSIC_OBJ_BOX_F64: rewrite_skip(L, prev, 0); break;
+  default: break;
+  }
+}
+
+// Returns the unbox intrinsic that undoes the box intrinsic {box}, or 0.
+static uint8_t unbox_intrinsic(uint8_t box) {
+  switch (box) {
+  case WEEWASM_INTRINSIC_OBJ_BOX_I32: return WEEWASM_INTRINSIC_I32_UNBOX;
+  case WEEWASM_INTRINSIC_OBJ_BOX_F64: return WEEWASM_INTRINSIC_F64_UNBOX;
+  default: return 0;
+  }
+}
+
+// Finds the declared locals whose boxes never escape: every "local.set" of the
+// local directly follows a box, and every "local.get" directly precedes the
+// matching unbox, after a "local.set" in the same straight-line code. Both calls
+// can be skipped for such a local, which then holds the unboxed value in its
+// frame slot. Scans the body before it is loaded, since the single pass cannot
+// know the later uses of a local.
+static void find_forwarded_locals(code_loader_t* L) {
+  uint32_t num_params = L->sig->num_params;
+  uint32_t num_locals = L->func->num_locals;
+  if (num_locals == 0) return;
+  uint8_t* box = (uint8_t*)calloc(num_locals, 1); // the box a local carries, or T_ANY if it escapes
+  uint8_t* set = (uint8_t*)calloc(num_locals, 1); // whether a local was set since the last label
+  uint8_t prev_box = 0; // the previous instruction, if it was a call to a box
+  uint32_t get = UINT32_MAX; // the previous instruction, if it was a local.get of a candidate
+  buffer_t b = *L->buf;
+  while (b.ptr < b.end) {
+    byte code = *b.ptr;
+    uint8_t intrinsic = 0;
+    uint32_t local = UINT32_MAX;
+    if (code == WASM_OP_CALL) {
+      b.ptr++;
+      uint32_t index = read_u32leb(&b);
+      if (index < L->module->num_funcs) intrinsic = L->module->funcs[index].intrinsic;
+    } else if (code == WASM_OP_LOCAL_GET || code == WASM_OP_LOCAL_SET || code == WASM_OP_LOCAL_TEE) {
+      b.ptr++;
+      uint32_t index = read_u32leb(&b);
+      if (index >= num_params && index - num_params < num_locals) local = index - num_params;
+    } else {
+      skip_bytecode(&b);
+      if (is_control_bytecode(code)) memset(set, 0, num_locals);
     }
-    case WASM_OP_END: {
-      TRACE("-> +%-3d rewrite: end, depth=%d\n", pc, control_sp);
-      control_entry_t* entry = &control_stack[control_sp - 1];
-      int32_t target_pc = entry->is_loop ? (int32_t)entry->start_pc : (int32_t)(buf->ptr - buf->start);
-      for (uint32_t i = 0; i < entry->num_refs; i++) {
-        int32_t ref_pc = (int32_t)((const byte*)entry->refs[i] - buf->start);
-        TRACE("-> +%-3d rewrite: patch => %d\n", ref_pc, (target_pc - ref_pc));
-        *(entry->refs[i]) = target_pc - ref_pc;
+    // a local.get of a candidate must be followed by its unbox
+    if (get != UINT32_MAX && intrinsic != unbox_intrinsic(box[get])) box[get] = T_ANY;
+    get = UINT32_MAX;
+    if (local != UINT32_MAX && box[local] != T_ANY) {
+      if (code == WASM_OP_LOCAL_SET && prev_box != 0 && (box[local] == 0 || box[local] == prev_box)) {
+        box[local] = prev_box;
+        set[local] = 1;
+      } else if (code == WASM_OP_LOCAL_GET && set[local]) {
+        get = local;
+      } else {
+        box[local] = T_ANY;
       }
-      buf->ptr++;
-      control_sp--;
-      break;
     }
-    case WASM_OP_BR: {
-      *(byte*)buf->ptr = WASM_OP_JMP;
-      buf->ptr++;
-      byte* pcdelta = (byte*)buf->ptr;
-      uint32_t depth = read_label(buf);
-      TRACE("-> +%-3d rewrite: br %u\n", (int)(pcdelta - buf->start), depth);
-      if ((buf->ptr - pcdelta) < 4) ERR("!unpadded br");
-      control_entry_t* entry = &control_stack[control_sp - depth - 1];
-      ref_entry(entry, pcdelta);
-      break;
+    prev_box = unbox_intrinsic(intrinsic) != 0 ? intrinsic : 0;
+  }
+  if (get != UINT32_MAX) box[get] = T_ANY;
+  for (uint32_t i = 0; i < num_locals; i++) {
+    if (box[i] == 0 || box[i] == T_ANY) continue;
+    TRACE("-> rewrite: forward local[%u]\n", num_params + i);
+    if (L->forwarded == NULL) L->forwarded = (uint8_t*)calloc(num_locals, 1);
+    L->forwarded[i] = box[i];
+  }
+  free(set);
+  free(box);
+}
+
+// Returns 1 if the local at {index} holds unboxed values, per {find_forwarded_locals}.
+static int is_forwarded(code_loader_t* L, uint32_t index) {
+  uint32_t num_params = L->sig->num_params;
+  return L->forwarded != NULL && index >= num_params && L->forwarded[index - num_params] != 0;
+}
+
+// Validates and rewrites a single instruction.
+static int load_bytecode(code_loader_t* L) {
+  buffer_t* buf = L->buf;
+  byte* opcode = (byte*)buf->ptr;
+  uint32_t pc = (uint32_t)(buf->ptr - buf->start);
+  if (g_disassemble) {
+    // print the original instruction before it is rewritten
+    buffer_t copy = *buf;
+    print_bytecode(&copy);
+  }
+  byte b = read_u8(buf);
+  byte* prev_call = L->prev_call;
+  byte* prev_get = L->prev_get;
+  L->prev_call = NULL;
+  L->prev_get = NULL;
+  if (L->module == NULL && !is_control_bytecode(b)) {
+    // not validating; only control flow matters
+    buf->ptr = opcode;
+    skip_bytecode(buf);
+    return 0;
+  }
+  switch (b) {
+  case WASM_OP_UNREACHABLE: set_unreachable(L); break;
+  case WASM_OP_NOP: break;
+  case WASM_OP_BLOCK: // fall through
+  case WASM_OP_LOOP: {
+    TRACE("-> +%3d rewrite: control_block, depth=%d\n", pc, L->csp);
+    int32_t bt = read_i32leb(buf);
+    if (bt != -64 && L->module != NULL) LOAD_ERR("illegal blocktype %d", bt);
+    push_control(L, b == WASM_OP_LOOP, pc, 0);
+    break;
+  }
+  case WASM_OP_END: {
+    TRACE("-> +%-3d rewrite: end, depth=%d\n", pc, L->csp);
+    control_entry_t* entry = &L->ctl[L->csp - 1];
+    if (L->csp == 1) {
+      for (uint32_t i = L->sig->num_results; i > 0; i--) LCHECK(pop_type(L, L->sig->results[i - 1]));
+    }
+    if (L->vsp != entry->height) LOAD_ERR("expected %u values at end of block, got %u", entry->height, L->vsp);
+    if (!entry->is_loop) bind_label(L, entry, (int32_t)pc);
+    L->csp--;
+    if (L->csp == 0 && buf->ptr != buf->end) LOAD_ERR("code after end of function");
+    break;
+  }
+  case WASM_OP_BR: {
+    LCHECK(rewrite_label(L, opcode, WASM_OP_JMP));
+    set_unreachable(L);
+    break;
+  }
+  case WASM_OP_BR_IF: {
+    LCHECK(pop_type(L, I32));
+    LCHECK(rewrite_label(L, opcode, WASM_OP_JMP_IF));
+    break;
+  }
+  case WASM_OP_BR_TABLE: {
+    LCHECK(pop_type(L, I32));
+    uint32_t count = read_u32leb(buf);
+    // every label is checked before any is rewritten
+    const byte* labels = buf->ptr;
+    int32_t arity = -1;
+    for (uint32_t i = 0; i < count + 1; i++) {
+      uint32_t depth;
+      LCHECK(read_label(L, &depth));
+      if (depth >= L->csp) LOAD_ERR("invalid branch depth %u", depth);
+      uint32_t a = L->ctl[L->csp - depth - 1].arity;
+      if (arity >= 0 && a != (uint32_t)arity) LOAD_ERR("inconsistent br_table arity");
+      arity = (int32_t)a;
+      LCHECK(check_label_values(L, &L->ctl[L->csp - depth - 1]));
     }
-    case WASM_OP_BR_IF: {
-      *(byte*)buf->ptr = WASM_OP_JMP_IF;
-      buf->ptr++;
+    buf->ptr = labels;
+    for (uint32_t i = 0; i < count + 1; i++) {
       byte* pcdelta = (byte*)buf->ptr;
-      uint32_t depth = read_label(buf);
-      TRACE("-> +%-3d rewrite: br_if %u\n", (int)(pcdelta - buf->start), depth);
-      if ((buf->ptr - pcdelta) < 4) ERR("!unpadded br_if");
-      control_entry_t* entry = &control_stack[control_sp - depth - 1];
-      ref_entry(entry, pcdelta);
-      break;
+      uint32_t depth = read_u32leb(buf);
+      TRACE("-> +%-3d rewrite: br_table[%u] %u\n", (int)(pcdelta - buf->start), i, depth);
+      LCHECK(add_branch(L, depth, pcdelta));
     }
-    case WASM_OP_BR_TABLE: {
-      *(byte*)buf->ptr = WASM_OP_JMP_TABLE;
-      buf->ptr++;
-      uint32_t count = read_u32leb(buf);
-      for (uint32_t i = 0; i < count + 1; i++) {
-        byte* pcdelta = (byte*)buf->ptr;
-        uint32_t depth = read_label(buf);
-        TRACE("-> +%-3d rewrite: br_table[%u] %u\n", (int)(pcdelta - buf->start), i, depth);
-        if ((buf->ptr - pcdelta) < 4) ERR("!unpadded br_table");
-        control_entry_t* entry = &control_stack[control_sp - depth - 1];
-        ref_entry(entry, pcdelta);
-      }
+    *opcode = WASM_OP_JMP_TABLE;
+    set_unreachable(L);
+    break;
+  }
+  case WASM_OP_RETURN: {
+    for (uint32_t i = L->sig->num_results; i > 0; i--) LCHECK(pop_type(L, L->sig->results[i - 1]));
+    set_unreachable(L);
+    break;
+  }
+  case WASM_OP_CALL: {
+    byte* imm = (byte*)buf->ptr;
+    uint32_t index = read_u32leb(buf);
+    if (index >= L->module->num_funcs) LOAD_ERR("invalid function index %u", index);
+    LCHECK(apply_sig(L, L->module->funcs[index].sig_index));
+    uint8_t intrinsic = L->module->funcs[index].intrinsic;
+    if (intrinsic == 0 || cancel_calls(L, prev_call, opcode, intrinsic)) break;
+    if (prev_get != NULL) {
+      // the unbox of a forwarded local, which already holds the value
+      rewrite_skip(L, opcode, 0);
       break;
     }
-    default: {
-      TRACE("-> +%-3d rewrite: ...\n", pc);
-      skip_bytecode(buf);
+    rewrite_intrinsic_call(L, opcode, imm, index);
+    L->prev_call = opcode;
+    L->prev_intrinsic = intrinsic;
+    break;
+  }
+  case WASM_OP_CALL_INDIRECT: {
+    uint32_t sig_index = read_u32leb(buf);
+    uint32_t table_index = read_u32leb(buf);
+    if (table_index != 0 || L->module->table == NULL) LOAD_ERR("invalid table index %u", table_index);
+    LCHECK(pop_type(L, I32));
+    LCHECK(apply_sig(L, sig_index));
+    break;
+  }
+  case WASM_OP_DROP: {
+    LCHECK(pop_type(L, T_ANY));
+    cancel_drop(L, prev_call);
+    break;
+  }
+  case WASM_OP_SELECT: {
+    LCHECK(pop_type(L, I32));
+    int t = pop_type(L, T_ANY);
+    LCHECK(t);
+    LCHECK(pop_type(L, (vtype_t)t));
+    push_type(L, (vtype_t)t);
+    break;
+  }
+  case WASM_OP_LOCAL_GET: {
+    uint32_t index = read_u32leb(buf);
+    int t = local_type(L, index);
+    LCHECK(t);
+    push_type(L, (vtype_t)t);
+    if (is_forwarded(L, index)) L->prev_get = opcode;
+    break;
+  }
+  case WASM_OP_LOCAL_SET: {
+    uint32_t index = read_u32leb(buf);
+    int t = local_type(L, index);
+    LCHECK(t);
+    LCHECK(pop_type(L, (vtype_t)t));
+    // the box of a forwarded local, which holds the value unboxed
+    if (is_forwarded(L, index) && prev_call != NULL) rewrite_skip(L, prev_call, 0);
+    break;
+  }
+  case WASM_OP_LOCAL_TEE: {
+    int t = local_type(L, read_u32leb(buf));
+    LCHECK(t);
+    LCHECK(pop_type(L, (vtype_t)t));
+    push_type(L, (vtype_t)t);
+    break;
+  }
+  case WASM_OP_GLOBAL_GET: {
+    wasm_global_decl_t* g = global_decl(L, read_u32leb(buf));
+    if (g == NULL) return -1;
+    push_type(L, g->type);
+    break;
+  }
+  case WASM_OP_GLOBAL_SET: {
+    wasm_global_decl_t* g = global_decl(L, read_u32leb(buf));
+    if (g == NULL) return -1;
+    if (!g->mutable) LOAD_ERR("global.set of immutable global");
+    LCHECK(pop_type(L, g->type));
+    break;
+  }
+  case WASM_OP_I32_LOAD: // fall through
+  case WASM_OP_I32_LOAD8_S: // fall through
+  case WASM_OP_I32_LOAD8_U: // fall through
+  case WASM_OP_I32_LOAD16_S: // fall through
+  case WASM_OP_I32_LOAD16_U: LOAD(I32); break;
+  case WASM_OP_F64_LOAD: LOAD(F64); break;
+  case WASM_OP_I32_STORE: // fall through
+  case WASM_OP_I32_STORE8: // fall through
+  case WASM_OP_I32_STORE16: STORE(I32); break;
+  case WASM_OP_F64_STORE: STORE(F64); break;
+  case WASM_OP_I32_CONST: {
+    read_i32leb(buf);
+    push_type(L, I32);
+    break;
+  }
+  case WASM_OP_F64_CONST: {
+    if (buf->end - buf->ptr < 8) LOAD_ERR("truncated f64.const");
+    buf->ptr += 8;
+    push_type(L, F64);
+    break;
+  }
+  case WASM_OP_I32_EQZ: UNOP(I32, I32); break;
+  case WASM_OP_I32_EQ: // fall through
+  case WASM_OP_I32_NE: // fall through
+  case WASM_OP_I32_LT_S: // fall through
+  case WASM_OP_I32_LT_U: // fall through
+  case WASM_OP_I32_GT_S: // fall through
+  case WASM_OP_I32_GT_U: // fall through
+  case WASM_OP_I32_LE_S: // fall through
+  case WASM_OP_I32_LE_U: // fall through
+  case WASM_OP_I32_GE_S: // fall through
+  case WASM_OP_I32_GE_U: BINOP(I32, I32); break;
+  case WASM_OP_F64_EQ: // fall through
+  case WASM_OP_F64_NE: // fall through
+  case WASM_OP_F64_LT: // fall through
+  case WASM_OP_F64_GT: // fall through
+  case WASM_OP_F64_LE: // fall through
+  case WASM_OP_F64_GE: BINOP(F64, I32); break;
+  case WASM_OP_I32_CLZ: // fall through
+  case WASM_OP_I32_CTZ: // fall through
+  case WASM_OP_I32_POPCNT: // fall through
+  case WASM_OP_I32_EXTEND8_S: // fall through
+  case WASM_OP_I32_EXTEND16_S: UNOP(I32, I32); break;
+  case WASM_OP_I32_ADD: // fall through
+  case WASM_OP_I32_SUB: // fall through
+  case WASM_OP_I32_MUL: // fall through
+  case WASM_OP_I32_DIV_S: // fall through
+  case WASM_OP_I32_DIV_U: // fall through
+  case WASM_OP_I32_REM_S: // fall through
+  case WASM_OP_I32_REM_U: // fall through
+  case WASM_OP_I32_AND: // fall through
+  case WASM_OP_I32_OR: // fall through
+  case WASM_OP_I32_XOR: // fall through
+  case WASM_OP_I32_SHL: // fall through
+  case WASM_OP_I32_SHR_S: // fall through
+  case WASM_OP_I32_SHR_U: // fall through
+  case WASM_OP_I32_ROTL: // fall through
+  case WASM_OP_I32_ROTR: BINOP(I32, I32); break;
+  case WASM_OP_F64_ADD: // fall through
+  case WASM_OP_F64_SUB: // fall through
+  case WASM_OP_F64_MUL: // fall through
+  case WASM_OP_F64_DIV: BINOP(F64, F64); break;
+  case WASM_OP_I32_TRUNC_F64_S: // fall through
+  case WASM_OP_I32_TRUNC_F64_U: UNOP(F64, I32); break;
+  case WASM_OP_F64_CONVERT_I32_S: // fall through
+  case WASM_OP_F64_CONVERT_I32_U: UNOP(I32, F64); break;
+  default:
+    LOAD_ERR("illegal bytecode 0x%02X (%s)", b, bytecode_name(b));
+  }
+  if (buf->ptr > buf->end) LOAD_ERR("truncated instruction");
+  return 0;
+}
+
+static void free_loader(code_loader_t* L) {
+  uint64_t bytes = sizeof(control_entry_t) * L->ccapacity + L->vcapacity;
+  for (uint32_t i = 0; i < L->ccapacity; i++) {
+    bytes += sizeof(branch_ref_t) * L->ctl[i].capacity;
+    free(L->ctl[i].refs);
+  }
+  if (L->forwarded != NULL) bytes += L->func->num_locals;
+  count_bytes(BYTES_PARSER, bytes);
+  free(L->ctl);
+  free(L->vals);
+  free(L->forwarded);
+}
+
+// Decodes each instruction of a function body exactly once, validating it,
+// rewriting "br*" to "jmp*" and building the side table for branches.
+int load_code(wasm_module_t* module, wasm_func_decl_t* func, byte* start, byte* end) {
+  static wasm_sig_decl_t empty_sig = { 0, NULL, 0, NULL };
+  buffer_t onstack_buf = { start, start, end };
+  code_loader_t onstack_loader;
+  code_loader_t* L = &onstack_loader;
+  memset(L, 0, sizeof(code_loader_t));
+  L->module = module;
+  L->func = func;
+  L->buf = &onstack_buf;
+  if (module == NULL) {
+    L->sig = &empty_sig;
+  } else if (func->sig_index < module->num_sigs) {
+    L->sig = &module->sigs[func->sig_index];
+  } else {
+    ERR("!invalid signature index %u\n", func->sig_index);
+    return -1;
+  }
+  func->max_stack = 0;
+
+  if (module != NULL) find_forwarded_locals(L);
+  // push the control entry for the function body
+  push_control(L, 0, 0, L->sig->num_results);
+
+  int result = 0;
+  while (L->buf->ptr < L->buf->end) {
+    if (L->csp == 0 || load_bytecode(L) < 0) {
+      result = -1;
       break;
     }
-    }
   }
-
-  // free control stack memory
-  for (uint32_t i = 0; i < capacity; i++) {
-    free(control_stack[i].refs);
+  if (result == 0 && L->csp != 0) {
+    ERR("!invalid code: missing end of function\n");
+    result = -1;
   }
-  free(control_stack);
+
+  func->sidetable_length = L->stp;
+  func->sidetable = L->sidetable;
+  free_loader(L);
+  return result;
+}
+
+// Rewrites "br*" to "jmp*" in a function body with no params or results, without validation.
+void rewrite_brs(byte* start, byte* end) {
+  wasm_func_decl_t func;
+  memset(&func, 0, sizeof(func));
+  load_code(NULL, &func, start, end);
+  free(func.sidetable);
 }
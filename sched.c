@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "sched.h"
+
+// The indexes a worker has yet to run: it takes them from the bottom, and
+// thieves take them from the top.
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t next;
+  uint32_t end;
+} share_t;
+
+typedef struct {
+  uint32_t num_workers;
+  share_t* shares;
+  job_fn_t fn;
+  void* data;
+} pool_t;
+
+typedef struct {
+  pool_t* pool;
+  uint32_t worker;
+} worker_t;
+
+// Takes the next index of {share}. Returns 0 if it is empty.
+static int take(share_t* share, uint32_t* index) {
+  pthread_mutex_lock(&share->lock);
+  int found = share->next < share->end;
+  if (found) *index = share->next++;
+  pthread_mutex_unlock(&share->lock);
+  return found;
+}
+
+// Moves the upper half of the largest remaining share into {share}. Returns 0
+// if every share is empty, since no jobs are added once the pool is running.
+static int steal(pool_t* pool, uint32_t worker) {
+  share_t* own = &pool->shares[worker];
+  for (uint32_t i = 1; i < pool->num_workers; i++) {
+    share_t* victim = &pool->shares[(worker + i) % pool->num_workers];
+    pthread_mutex_lock(&victim->lock);
+    uint32_t remaining = victim->end - victim->next;
+    uint32_t start = victim->end - (remaining + 1) / 2;
+    uint32_t end = victim->end;
+    victim->end = start;
+    pthread_mutex_unlock(&victim->lock);
+    if (remaining == 0) continue;
+    TRACE("sched: worker %u stole %u jobs from %u\n", worker, end - start,
+          (worker + i) % pool->num_workers);
+    pthread_mutex_lock(&own->lock);
+    own->next = start;
+    own->end = end;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+  return 0;
+}
+
+static void* run_worker(void* arg) {
+  worker_t* w = (worker_t*)arg;
+  pool_t* pool = w->pool;
+  uint32_t index;
+  do {
+    while (take(&pool->shares[w->worker], &index)) pool->fn(w->worker, index, pool->data);
+  } while (steal(pool, w->worker));
+  return NULL;
+}
+
+void run_parallel(uint32_t num_workers, uint32_t count, job_fn_t fn, void* data) {
+  if (num_workers > count) num_workers = count;
+  if (num_workers <= 1) {
+    for (uint32_t i = 0; i < count; i++) fn(0, i, data);
+    return;
+  }
+  pool_t pool = { num_workers, (share_t*)malloc(sizeof(share_t) * num_workers), fn, data };
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&pool.shares[i].lock, NULL);
+    pool.shares[i].next = (uint32_t)((uint64_t)count * i / num_workers);
+    pool.shares[i].end = (uint32_t)((uint64_t)count * (i + 1) / num_workers);
+  }
+  pthread_t threads[num_workers];
+  worker_t workers[num_workers];
+  for (uint32_t i = 0; i < num_workers; i++) {
+    workers[i].pool = &pool;
+    workers[i].worker = i;
+    // the calling thread is worker 0
+    if (i > 0 && pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0) {
+      ERR("!failed to start worker %u\n", i);
+      workers[i].pool = NULL;
+    }
+  }
+  run_worker(&workers[0]);
+  for (uint32_t i = 1; i < num_workers; i++) {
+    if (workers[i].pool != NULL) pthread_join(threads[i], NULL);
+  }
+  for (uint32_t i = 0; i < num_workers; i++) pthread_mutex_destroy(&pool.shares[i].lock);
+  free(pool.shares);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// A job run by {run_parallel} for item {index} on the worker thread {worker}.
+typedef void (*job_fn_t)(uint32_t worker, uint32_t index, void* data);
+
+// Runs {fn} for every index in [0, count) on {num_workers} threads and returns
+// when all are done. Each worker starts with a contiguous share of the indexes
+// and, when it runs out, steals the upper half of another worker's remaining
+// share. With one worker the jobs run in order on the calling thread.
+void run_parallel(uint32_t num_workers, uint32_t count, job_fn_t fn, void* data);
@@ -0,0 +1,262 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "ir.h"
+#include "interp.h"
+#include "out.h"
+#include "libweerun.h"
+#include "sched.h"
+#include "events.h"
+#include "serve.h"
+
+// The most arguments a request can pass to "main".
+#define SERVE_MAX_ARGS 64
+
+// A parsed module and a copy of the bytes it was parsed from, which its hash
+// is checked against.
+typedef struct {
+  uint64_t hash;
+  size_t length;
+  byte* bytes;
+  wasm_module_t* module;
+} cache_entry_t;
+
+static cache_entry_t cache[SERVE_CACHE_SIZE];
+static uint32_t cache_next = 0; // the entry to evict next
+
+wasm_module_t* cached_module(const uint8_t* bytes, size_t length) {
+  uint64_t hash = weerun_hash_bytes(bytes, length);
+  for (uint32_t i = 0; i < SERVE_CACHE_SIZE; i++) {
+    cache_entry_t* entry = &cache[i];
+    if (entry->module != NULL && entry->hash == hash && entry->length == length &&
+        memcmp(entry->bytes, bytes, length) == 0) {
+      TRACE("serve: cache hit %016llx\n", (unsigned long long)hash);
+      return entry->module;
+    }
+  }
+  wasm_module_t* module = weerun_load_module(bytes, length);
+  if (module == NULL) return NULL;
+  cache_entry_t* entry = &cache[cache_next];
+  cache_next = (cache_next + 1) % SERVE_CACHE_SIZE;
+  weerun_free_module(entry->module);
+  free(entry->bytes);
+  entry->hash = hash;
+  entry->length = length;
+  entry->bytes = (byte*)malloc(length > 0 ? length : 1);
+  memcpy(entry->bytes, bytes, length);
+  entry->module = module;
+  return module;
+}
+
+// Parses the remaining tokens of {save} into {args}. Returns the number of
+// arguments, or < 0 if there are too many.
+static int parse_args(char** save, wasm_value_t* args) {
+  int num_args = 0;
+  for (char* arg; (arg = strtok_r(NULL, " \t\r\n", save)) != NULL;) {
+    if (num_args == SERVE_MAX_ARGS) {
+      out_str("!error: too many arguments\n");
+      return -1;
+    }
+    args[num_args++] = parse_wasm_value(arg);
+  }
+  return num_args;
+}
+
+// Calls "main" of {instance} with {args} and writes its results, or "!trap".
+static wasm_trap_t run_main(wasm_instance_t* instance, wasm_value_t* args, uint32_t num_args) {
+  wasm_module_t* module = instance->module;
+  const wasm_sig_decl_t* sig = weerun_func_sig(module, module->main_func);
+  wasm_value_t results[sig->num_results + 1];
+  if (num_args == sig->num_params) weerun_box_args(sig, args);
+  log_event(EVENT_BEGIN, EVENT_MAIN, module->main_func);
+  wasm_trap_t trap = weerun_call(instance, module->main_func, args, num_args, results);
+  log_event(EVENT_END, EVENT_MAIN, module->main_func);
+  if (trap == TRAP_NONE) out_results(results, sig->num_results);
+  return trap;
+}
+
+// Returns 1 if {module} has a "main" that can be called.
+static int has_main(wasm_module_t* module) {
+  return module != NULL && module->main_func >= 0 && (uint32_t)module->main_func < module->num_funcs;
+}
+
+void serve_request(char* line) {
+  char* save = NULL;
+  char* path = strtok_r(line, " \t\r\n", &save);
+  if (path == NULL) return; // an empty line
+  wasm_value_t args[SERVE_MAX_ARGS];
+  int num_args = parse_args(&save, args);
+  if (num_args < 0) return;
+
+  byte* start = NULL;
+  byte* end = NULL;
+  if (load_file(path, &start, &end) < 0) {
+    out_str("!error: failed to load ");
+    out_str(path);
+    out_str("\n");
+    return;
+  }
+  wasm_module_t* module = cached_module(start, (size_t)(end - start));
+  unload_file(&start, &end);
+  if (!has_main(module)) {
+    out_str("!error: invalid module ");
+    out_str(path);
+    out_str("\n");
+    return;
+  }
+
+  wasm_trap_t trap = TRAP_NONE;
+  wasm_instance_t* instance = weerun_instantiate(module, &trap);
+  if (instance != NULL) {
+    trap = run_main(instance, args, (uint32_t)num_args);
+    weerun_free_instance(instance);
+  }
+  if (trap != TRAP_NONE) {
+    TRACE("trap: %s\n", trap_name(trap));
+    out_str("!trap\n");
+  }
+}
+
+// Answers the requests read from {in}, writing responses to {out_fd}.
+static void serve_stream(FILE* in, int out_fd) {
+  out_set_fd(out_fd);
+  char* line = NULL;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, in) >= 0) {
+    serve_request(line);
+    out_flush();
+  }
+  free(line);
+  out_set_fd(STDOUT_FILENO);
+}
+
+int serve(const char* path) {
+  if (strcmp(path, "-") == 0) {
+    serve_stream(stdin, STDOUT_FILENO);
+    return 0;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERR("!socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+    ERR("!failed to listen on %s\n", path);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN); // a client that hangs up only ends its connection
+  TRACE("serve: listening on %s\n", path);
+  while (1) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) continue;
+    FILE* in = fdopen(conn, "r");
+    serve_stream(in, conn);
+    fclose(in);
+  }
+  return 0;
+}
+
+// The runs of a batch and their outputs.
+typedef struct {
+  wasm_module_t* module;
+  uint32_t num_lines;
+  char** lines;
+  int parallel; // whether each output is captured to be written in order later
+  byte** outputs;
+  size_t* output_lengths;
+  wasm_instance_t** instances; // one per worker, created by its first run
+} batch_t;
+
+// Runs line {index} of a batch on the instance of {worker}.
+static void run_batch_line(uint32_t worker, uint32_t index, void* data) {
+  batch_t* batch = (batch_t*)data;
+  char* save = NULL;
+  wasm_value_t args[SERVE_MAX_ARGS + 1];
+  int num_args = 0;
+  // a line with no arguments, such as "= 0", calls a main without parameters
+  char* first = strtok_r(batch->lines[index], " \t\r\n", &save);
+  if (first != NULL) args[num_args++] = parse_wasm_value(first);
+  if (batch->parallel) out_begin_capture();
+  int rest = parse_args(&save, args + 1);
+  if (rest >= 0) {
+    num_args += rest;
+    wasm_trap_t trap = TRAP_NONE;
+    wasm_instance_t** instance = &batch->instances[worker];
+    if (*instance == NULL) *instance = weerun_instantiate_pooled(batch->module, &trap);
+    else trap = weerun_reset_instance(*instance);
+    if (trap == TRAP_NONE && *instance != NULL) trap = run_main(*instance, args, (uint32_t)num_args);
+    if (trap != TRAP_NONE) {
+      TRACE("trap: %s\n", trap_name(trap));
+      out_str("!trap\n");
+    }
+  }
+  if (batch->parallel) batch->outputs[index] = out_end_capture(&batch->output_lengths[index]);
+}
+
+int run_batch(const byte* start, const byte* end, const char* args_path, uint32_t num_workers) {
+  FILE* in = fopen(args_path, "r");
+  if (in == NULL) {
+    ERR("!failed to open %s\n", args_path);
+    return 1;
+  }
+  batch_t batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.module = weerun_load_module(start, (size_t)(end - start));
+  if (!has_main(batch.module)) {
+    ERR("!invalid module\n");
+    weerun_free_module(batch.module);
+    fclose(in);
+    return 1;
+  }
+  uint32_t capacity = 0;
+  char* line = NULL;
+  size_t length = 0;
+  while (getline(&line, &length, in) >= 0) {
+    char* eq = strchr(line, '=');
+    if (eq == NULL && line[strspn(line, " \t\r\n")] == 0) continue; // a blank line
+    if (eq != NULL) *eq = 0; // the expected results are ignored
+    if (batch.num_lines == capacity) {
+      capacity = capacity * 2 + 16;
+      batch.lines = (char**)realloc(batch.lines, sizeof(char*) * capacity);
+    }
+    batch.lines[batch.num_lines++] = line;
+    line = NULL;
+    length = 0;
+  }
+  free(line);
+  fclose(in);
+
+  if (num_workers < 1) num_workers = 1;
+  batch.parallel = num_workers > 1;
+  batch.outputs = (byte**)calloc(batch.num_lines + 1, sizeof(byte*));
+  batch.output_lengths = (size_t*)calloc(batch.num_lines + 1, sizeof(size_t));
+  batch.instances = (wasm_instance_t**)calloc(num_workers, sizeof(wasm_instance_t*));
+  run_parallel(num_workers, batch.num_lines, run_batch_line, &batch);
+
+  for (uint32_t i = 0; i < batch.num_lines; i++) {
+    if (batch.outputs[i] != NULL) out_bytes(batch.outputs[i], batch.output_lengths[i]);
+    free(batch.outputs[i]);
+    free(batch.lines[i]);
+  }
+  for (uint32_t i = 0; i < num_workers; i++) weerun_free_instance(batch.instances[i]);
+  out_flush();
+  finish_events(batch.module);
+  weerun_free_module(batch.module);
+  free(batch.instances);
+  free(batch.output_lengths);
+  free(batch.outputs);
+  free(batch.lines);
+  return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+// The number of parsed modules a server keeps, evicting the oldest.
+#define SERVE_CACHE_SIZE 64
+
+// Answers requests until the input ends. Each request is a line naming a module
+// file and the arguments to its "main", like the weerun command line, and is
+// answered with the output of the run and a line of results, or "!trap".
+// Requests come from connections to a Unix domain socket at {path}, or from
+// stdin if {path} is "-". Returns non-zero if the server could not start.
+int serve(const char* path);
+
+// Returns the parsed module for the given bytes from the cache, parsing and
+// adding it if it is not there. Returns NULL if the module is invalid.
+wasm_module_t* cached_module(const uint8_t* bytes, size_t length);
+
+// Runs one request line, writing its response to the output.
+void serve_request(char* line);
+
+// Runs "main" of the module in [start, end) once for each line of the file at
+// {args_path}, resetting a pooled instance between runs. Lines are in the format
+// of .runs files, "args = expected", and only the arguments are used, so a line
+// like "= 0" calls a "main" without parameters. Blank lines are skipped. Writes a
+// line of results, or "!trap", per run, in the order of the lines. The runs are
+// spread over {num_workers} threads, each with its own instance of the module.
+int run_batch(const byte* start, const byte* end, const char* args_path, uint32_t num_workers);
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "ir.h"
+#include "interp.h"
+#include "obj.h"
+#include "pool.h"
+#include "libweerun.h"
+#include "snapshot.h"
+
+// Writes all of the {size} bytes at {p} to {fd} at {offset}.
+static int write_all(int fd, off_t offset, const void* p, size_t size) {
+  return pwrite(fd, p, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+// Reads all of the {size} bytes at {offset} in {fd} into {p}.
+static int read_all(int fd, off_t offset, void* p, size_t size) {
+  return pread(fd, p, size, offset) == (ssize_t)size ? 0 : -1;
+}
+
+int save_snapshot(const char* path, const byte* bytes, size_t length, wasm_instance_t* instance) {
+  wasm_module_t* module = instance->module;
+  uint32_t num_globals = module->num_globals;
+  // objects live in the heap, which is not saved
+  wasm_value_t* globals = (wasm_value_t*)calloc(num_globals + 1, sizeof(wasm_value_t));
+  for (uint32_t i = 0; i < num_globals; i++) {
+    wasm_value_t val = instance->globals[i];
+    if (val.tag == EXTERNREF && val.val.ref != NULL && ref_is_cell(val.val.ref)) {
+      ERR("!cannot snapshot global %u, which references an object\n", i);
+      free(globals);
+      return -1;
+    }
+    globals[i].tag = val.tag;
+    globals[i].val = val.val;
+  }
+
+  snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.num_globals = num_globals;
+  header.table_size = instance->table_size;
+  header.module_length = length;
+  header.mem_size = (uint64_t)(instance->mem_end - instance->mem_start);
+  size_t globals_offset = sizeof(header) + length;
+  size_t table_offset = globals_offset + sizeof(wasm_value_t) * num_globals;
+  size_t state_end = table_offset + sizeof(uint32_t) * instance->table_size;
+  header.mem_offset = (state_end + WASM_PAGE_SIZE - 1) & ~(uint64_t)(WASM_PAGE_SIZE - 1);
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int r = fd < 0 ? -1 : 0;
+  if (r == 0) r = write_all(fd, 0, &header, sizeof(header));
+  if (r == 0) r = write_all(fd, sizeof(header), bytes, length);
+  if (r == 0) r = write_all(fd, globals_offset, globals, sizeof(wasm_value_t) * num_globals);
+  if (r == 0) r = write_all(fd, table_offset, instance->table, sizeof(uint32_t) * instance->table_size);
+  if (r == 0) r = write_memory_pages(fd, header.mem_offset, instance->mem_start, header.mem_size);
+  if (fd >= 0) close(fd);
+  free(globals);
+  if (r < 0) ERR("!failed to write snapshot %s\n", path);
+  return r;
+}
+
+wasm_instance_t* restore_snapshot(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ERR("!failed to open snapshot %s\n", path);
+    return NULL;
+  }
+  snapshot_header_t header;
+  struct stat statbuf;
+  if (read_all(fd, 0, &header, sizeof(header)) < 0 || fstat(fd, &statbuf) < 0 ||
+      memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION || header.module_length > MAX_FILE_SIZE ||
+      header.mem_offset + header.mem_size > (uint64_t)statbuf.st_size) {
+    ERR("!invalid snapshot %s\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  byte* bytes = (byte*)malloc(header.module_length + 1);
+  wasm_module_t* module = NULL;
+  if (read_all(fd, sizeof(header), bytes, header.module_length) == 0) {
+    module = weerun_load_module(bytes, header.module_length);
+  }
+  free(bytes);
+  if (module == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  // instantiating binds imports and allocates the stacks and the heap; the
+  // start function is not run, since its effects are in the snapshot
+  wasm_instance_t* instance = (wasm_instance_t*)malloc(sizeof(wasm_instance_t));
+  wasm_trap_t trap = instantiate_wasm_module(module, instance);
+  size_t globals_offset = sizeof(header) + header.module_length;
+  size_t table_offset = globals_offset + sizeof(wasm_value_t) * header.num_globals;
+  int r = trap == TRAP_NONE && header.num_globals == module->num_globals &&
+          header.table_size == instance->table_size &&
+          header.mem_size == (uint64_t)(instance->mem_end - instance->mem_start) ? 0 : -1;
+  if (r == 0) r = read_all(fd, globals_offset, instance->globals, sizeof(wasm_value_t) * header.num_globals);
+  if (r == 0) r = read_all(fd, table_offset, instance->table, sizeof(uint32_t) * header.table_size);
+  if (r == 0) r = map_instance_template(instance, fd, (off_t)header.mem_offset);
+  if (r < 0) {
+    ERR("!failed to restore snapshot %s\n", path);
+    close(fd);
+    weerun_free_instance(instance);
+    weerun_free_module(module);
+    return NULL;
+  }
+  instance->template->after_start = 1;
+  return instance;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+#define SNAPSHOT_MAGIC "weesnap"
+#define SNAPSHOT_VERSION 1
+
+// The start of a snapshot file. It is followed by the module's bytes, then the
+// globals and the table, and then, at {mem_offset}, the linear memory, which is
+// page aligned so that it can be mapped straight from the file.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_globals;
+  uint32_t table_size;
+  uint32_t reserved;
+  uint64_t module_length;
+  uint64_t mem_offset;
+  uint64_t mem_size;
+} snapshot_header_t;
+
+// Writes the state of {instance}, which must have been instantiated from the
+// module in [bytes, bytes + length) and have run its start function, to the
+// file at {path}. Fails if a global references an object. Returns < 0 on failure.
+int save_snapshot(const char* path, const byte* bytes, size_t length, wasm_instance_t* instance);
+
+// Loads the module saved in the snapshot at {path} and instantiates it with the
+// saved state, without running its start function. Memory is mapped privately
+// from the file. Returns NULL on failure. The caller frees the instance and then
+// its module.
+wasm_instance_t* restore_snapshot(const char* path);
@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "events.h"
+#include "stats.h"
+
+_Static_assert(EVENT_CALL == STATS_NUM_PHASES, "phases are the event types before calls");
+
+int g_stats = 0;
+_Thread_local run_stats_t* t_stats = NULL;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static run_stats_t* all_stats = NULL;
+
+run_stats_t* new_thread_stats() {
+  run_stats_t* stats = (run_stats_t*)calloc(1, sizeof(run_stats_t));
+  pthread_mutex_lock(&stats_lock);
+  stats->link = all_stats;
+  all_stats = stats;
+  pthread_mutex_unlock(&stats_lock);
+  t_stats = stats;
+  return stats;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void count_event(run_stats_t* stats, uint8_t phase, uint8_t type) {
+  if (type < STATS_NUM_PHASES) {
+    phase_stats_t* p = &stats->phases[type];
+    if (phase == EVENT_BEGIN) {
+      p->wall_begin = clock_ns(CLOCK_MONOTONIC);
+      p->cpu_begin = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    } else {
+      p->count++;
+      p->wall_ns += clock_ns(CLOCK_MONOTONIC) - p->wall_begin;
+      p->cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - p->cpu_begin;
+    }
+    return;
+  }
+  if (phase == EVENT_END) return;
+  switch (type) {
+  case EVENT_CALL: stats->calls++; break;
+  case EVENT_HOST_CALL: stats->host_calls++; break;
+  case EVENT_TRAP: stats->traps++; break;
+  default: break;
+  }
+}
+
+void print_stats(FILE* out) {
+  static const char* bytes_names[STATS_NUM_BYTES] = {
+    "file", "parser", "module", "memory", "instance", "objects"
+  };
+  run_stats_t total = {0};
+  pthread_mutex_lock(&stats_lock);
+  for (run_stats_t* s = all_stats; s != NULL; s = s->link) {
+    for (int i = 0; i < STATS_NUM_PHASES; i++) {
+      total.phases[i].count += s->phases[i].count;
+      total.phases[i].wall_ns += s->phases[i].wall_ns;
+      total.phases[i].cpu_ns += s->phases[i].cpu_ns;
+    }
+    for (int i = 0; i < STATS_NUM_BYTES; i++) total.bytes[i] += s->bytes[i];
+    total.calls += s->calls;
+    total.host_calls += s->host_calls;
+    total.traps += s->traps;
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "{\n  \"phases\": {");
+  for (int i = 0; i < STATS_NUM_PHASES; i++) {
+    phase_stats_t* p = &total.phases[i];
+    fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"wall_ns\": %llu, \"cpu_ns\": %llu}", i > 0 ? "," : "",
+            event_type_name(i), (unsigned long long)p->count, (unsigned long long)p->wall_ns,
+            (unsigned long long)p->cpu_ns);
+  }
+  fprintf(out, "\n  },\n  \"bytes\": {");
+  for (int i = 0; i < STATS_NUM_BYTES; i++) {
+    fprintf(out, "%s\n    \"%s\": %llu", i > 0 ? "," : "", bytes_names[i], (unsigned long long)total.bytes[i]);
+  }
+  fprintf(out, "\n  },\n");
+  fprintf(out, "  \"peak_rss_bytes\": %llu,\n", (unsigned long long)usage.ru_maxrss * 1024);
+  fprintf(out, "  \"calls\": %llu,\n", (unsigned long long)total.calls);
+  fprintf(out, "  \"host_calls\": %llu,\n", (unsigned long long)total.host_calls);
+  fprintf(out, "  \"traps\": %llu\n}\n", (unsigned long long)total.traps);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Totals of a process for -stats: the time spent in each load and run phase,
+// the bytes allocated by each subsystem, and counts of calls and traps. They
+// are collected per thread from the same events as the event log, so that
+// counting them costs nothing unless they are enabled, except for the calls of
+// intrinsics the loader lowered into opcodes, which the interpreter counts
+// itself.
+
+#define STATS_NUM_PHASES 6 // the event types before EVENT_CALL
+
+// What bytes are allocated for.
+typedef enum {
+  BYTES_FILE = 0, // module files read
+  BYTES_PARSER, // the temporary stacks of validation
+  BYTES_MODULE, // parsed declarations, side tables and names
+  BYTES_MEMORY, // linear memory
+  BYTES_INSTANCE, // tables, globals, stacks and caches of instances
+  BYTES_OBJECTS, // object cells
+  STATS_NUM_BYTES,
+} stats_bytes_t;
+
+typedef struct {
+  uint64_t count;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+  uint64_t wall_begin; // of the phase in progress
+  uint64_t cpu_begin;
+} phase_stats_t;
+
+typedef struct run_stats {
+  phase_stats_t phases[STATS_NUM_PHASES]; // indexed by event type
+  uint64_t bytes[STATS_NUM_BYTES];
+  uint64_t calls;
+  uint64_t host_calls;
+  uint64_t traps;
+  struct run_stats* link; // the stats of another thread
+} run_stats_t;
+
+// Whether stats are collected.
+extern int g_stats;
+extern _Thread_local run_stats_t* t_stats;
+
+run_stats_t* new_thread_stats();
+
+// Returns the stats of the calling thread, or NULL if stats are not collected.
+static inline run_stats_t* thread_stats() {
+  if (!g_stats) return NULL;
+  return t_stats != NULL ? t_stats : new_thread_stats();
+}
+
+// Counts an event of the event log, given its phase and type, in {stats}.
+void count_event(run_stats_t* stats, uint8_t phase, uint8_t type);
+
+// Counts {count} bytes allocated for {what}, if stats are collected.
+static inline void count_bytes(stats_bytes_t what, uint64_t count) {
+  run_stats_t* stats = thread_stats();
+  if (stats != NULL) stats->bytes[what] += count;
+}
+
+// Counts {count} calls of intrinsics lowered into opcodes as host calls, if
+// stats are collected.
+static inline void count_intrinsic_calls(uint64_t count) {
+  run_stats_t* stats = count != 0 ? thread_stats() : NULL;
+  if (stats != NULL) stats->host_calls += count;
+}
+
+// Writes the totals of every thread to {out} as a JSON object, with the peak
+// resident set size of the process.
+void print_stats(FILE* out);
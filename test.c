@@ -2,11 +2,28 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "test.h"
 #include "ir.h"
 #include "weewasm.h"
+#include "opcodes.h"
+#include "cpu.h"
+#include "obj.h"
+#include "out.h"
+#include "libweerun.h"
+#include "serve.h"
+#include "snapshot.h"
+#include "modcache.h"
+#include "sched.h"
+#include "profile.h"
+#include "opstats.h"
+#include "events.h"
+#include "stats.h"
+#include "disass.h"
 
 typedef struct {
   const char* name;
@@ -25,6 +42,13 @@ typedef struct {
 
 // Test macros
 #define BYTES(...) const uint8_t bytes[] = { __VA_ARGS__ }
+// Copies the test bytes into a larger buffer so the decoders can take their
+// windowed fast path, padding with {fill}.
+#define PADDED(fill)							\
+  uint8_t padded[sizeof(bytes) + 32];					\
+  memset(padded, fill, sizeof(padded));					\
+  memcpy(padded, bytes, sizeof(bytes))
+
 // Polymorphic macro to check for 
 #define OK_poly(type, fmt, decode, len, x) do {				\
     ssize_t gotlen = 0;							\
@@ -38,6 +62,13 @@ typedef struct {
       printf("expected " fmt ", but got " fmt " @ %s:%d\n", val, gotval, __FILE__, __LINE__); \
       return 0;								\
     }									\
+    PADDED(0);								\
+    ssize_t fastlen = 0;						\
+    type fastval = decode(padded, padded + sizeof(padded), &fastlen);	\
+    if (fastlen != gotlen || fastval != gotval) {			\
+      printf("padded: expected " fmt " (len %zd), but got " fmt " (len %zd) @ %s:%d\n", gotval, gotlen, fastval, fastlen, __FILE__, __LINE__); \
+      return 0;								\
+    }									\
   } while(0) 
 
 #define OK_i32(len, val) OK_poly(int32_t, "%d", decode_i32leb, len, val);
@@ -52,6 +83,12 @@ typedef struct {
       printf("expected fail, but got val=" fmt ", len=%zd @ %s:%d\n", gotval, gotlen, __FILE__, __LINE__); \
       return 0;								\
     }									\
+    PADDED(0x80);							\
+    gotval = decode(padded, padded + sizeof(padded), &gotlen);		\
+    if (gotlen > 0) {							\
+      printf("padded: expected fail, but got val=" fmt ", len=%zd @ %s:%d\n", gotval, gotlen, __FILE__, __LINE__); \
+      return 0;								\
+    }									\
   } while(0)
 
 #define ERR_i32 ERR_poly(int32_t, "%d", decode_i32leb);
@@ -390,6 +427,891 @@ int test_rewrite_loop1() {
   return 1;
 }
 
+// Loads {code} as the body of a function [i32] -> [i32] with an externref local
+// in a module that imports obj.box_i32, i32.unbox and obj.new as functions 0, 1 and 2.
+static int load_box_code(byte* code, uint32_t length) {
+  static wasm_type_t i32s[] = {I32}, refs[] = {EXTERNREF};
+  wasm_sig_decl_t sigs[] = {{1, i32s, 1, refs}, {1, refs, 1, i32s}, {0, NULL, 1, refs}, {1, i32s, 1, i32s}};
+  wasm_func_decl_t funcs[4];
+  memset(funcs, 0, sizeof(funcs));
+  uint8_t intrinsics[] = {WEEWASM_INTRINSIC_OBJ_BOX_I32, WEEWASM_INTRINSIC_I32_UNBOX, WEEWASM_INTRINSIC_OBJ_NEW, 0};
+  for (uint32_t i = 0; i < 4; i++) {
+    funcs[i].intrinsic = intrinsics[i];
+    funcs[i].sig_index = i;
+  }
+  funcs[3].num_locals = 1;
+  funcs[3].local_types = refs;
+  wasm_module_t module;
+  init_wasm_module(&module);
+  module.num_sigs = 4;
+  module.sigs = sigs;
+  module.num_funcs = 4;
+  module.funcs = funcs;
+  int result = load_code(&module, &funcs[3], code, code + length);
+  free(funcs[3].sidetable);
+  return result;
+}
+
+int test_rewrite_box() {
+  byte code1[] = {WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_CALL, 1, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code1, sizeof(code1)));
+  CHECK_EQ(WASM_OP_SKIP, code1[2]);
+  CHECK_EQ(2, code1[3]);
+  byte code2[] = {WASM_OP_CALL, 2, WASM_OP_DROP, WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_DROP,
+                  WASM_OP_LOCAL_GET, 0, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code2, sizeof(code2)));
+  CHECK_EQ(WASM_OP_SKIP, code2[0]);
+  CHECK_EQ(1, code2[1]);
+  CHECK_EQ(WASM_OP_SKIP, code2[5]);
+  CHECK_EQ(0, code2[6]);
+  // an unbox after a non-adjacent box is kept, but lowered to an internal opcode
+  byte code3[] = {WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_NOP, WASM_OP_CALL, 1, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code3, sizeof(code3)));
+  CHECK_EQ(WASM_OP_OBJ_BOX_I32, code3[2]);
+  CHECK_EQ(0, code3[3]);
+  CHECK_EQ(WASM_OP_I32_UNBOX, code3[5]);
+  CHECK_EQ(1, code3[6]);
+  // a box carried through a local that is only unboxed is never made
+  byte code4[] = {WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_LOCAL_SET, 1,
+                  WASM_OP_LOCAL_GET, 1, WASM_OP_CALL, 1, WASM_OP_LOCAL_GET, 1, WASM_OP_CALL, 1,
+                  WASM_OP_I32_ADD, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code4, sizeof(code4)));
+  CHECK_EQ(WASM_OP_SKIP, code4[2]);
+  CHECK_EQ(0, code4[3]);
+  CHECK_EQ(WASM_OP_SKIP, code4[8]);
+  CHECK_EQ(WASM_OP_SKIP, code4[12]);
+  // but not if the box escapes, or may be read before it is set
+  byte code5[] = {WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_LOCAL_SET, 1,
+                  WASM_OP_LOCAL_GET, 1, WASM_OP_CALL, 1, WASM_OP_LOCAL_GET, 1, WASM_OP_DROP, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code5, sizeof(code5)));
+  CHECK_EQ(WASM_OP_OBJ_BOX_I32, code5[2]);
+  CHECK_EQ(WASM_OP_I32_UNBOX, code5[8]);
+  byte code6[] = {WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_LOCAL_SET, 1, WASM_OP_BLOCK, 0x40,
+                  WASM_OP_LOCAL_GET, 1, WASM_OP_CALL, 1, WASM_OP_DROP, WASM_OP_END,
+                  WASM_OP_LOCAL_GET, 0, WASM_OP_END};
+  CHECK_EQ(0, load_box_code(code6, sizeof(code6)));
+  CHECK_EQ(WASM_OP_OBJ_BOX_I32, code6[2]);
+  CHECK_EQ(WASM_OP_I32_UNBOX, code6[10]);
+  return 1;
+}
+
+// Checks the fast length of the instruction at the start of the given bytes,
+// which are padded so the fast path can read past the end.
+#define CHECK_FAST_LENGTH(len, ...) do {                                \
+    byte code[BYTECODE_FAST_SLACK + 16] = { __VA_ARGS__ };              \
+    CHECK_EQ(len, bytecode_length_fast(code));                          \
+  } while(0)
+
+int test_bytecode_length() {
+  CHECK_FAST_LENGTH(1, WASM_OP_NOP);
+  CHECK_FAST_LENGTH(2, WASM_OP_BLOCK, 0x40);
+  CHECK_FAST_LENGTH(2, WASM_OP_LOCAL_GET, 0x05);
+  CHECK_FAST_LENGTH(3, WASM_OP_CALL, 0x81, 0x01);
+  CHECK_FAST_LENGTH(5, WASM_OP_BR, U32_LEB4(3));
+  CHECK_FAST_LENGTH(4, WASM_OP_CALL_INDIRECT, 0x80, 0x01, 0x00);
+  CHECK_FAST_LENGTH(4, WASM_OP_I32_LOAD, 0x02, 0x80, 0x01);
+  CHECK_FAST_LENGTH(9, WASM_OP_F64_CONST, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF);
+  CHECK_FAST_LENGTH(5, WASM_OP_JMP, 0x80, 0x80, 0x80, 0x80);
+  // variable-length immediates and 5-byte LEBs take the slow path
+  CHECK_FAST_LENGTH(0, WASM_OP_BR_TABLE, 0x00, 0x00);
+  CHECK_FAST_LENGTH(0, WASM_OP_I32_CONST, 0x80, 0x80, 0x80, 0x80, 0x01);
+  CHECK_FAST_LENGTH(0, WASM_OP_CALL_INDIRECT, 0x00, 0x80, 0x80, 0x80, 0x80, 0x00);
+  return 1;
+}
+
+// Checks that boxing round-trips values and keeps the kinds of references apart.
+int test_obj_boxing() {
+  int32_t ints[] = {0, 1, -1, 457, INT32_MIN, INT32_MAX};
+  for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+    void* ref = obj_box_i32(ints[i]);
+    int32_t val = 0;
+    CHECK_EQ(1, ref_is_i32(ref) && !ref_is_f64(ref) && !ref_is_cell(ref));
+    CHECK_EQ(TRAP_NONE, obj_unbox_i32(ref, &val));
+    CHECK_EQ(ints[i], val);
+    CHECK_EQ(TRAP_TYPE_MISMATCH, obj_unbox_f64(ref, NULL));
+    CHECK_EQ(1, obj_eq(ref, obj_box_i32(ints[i])));
+  }
+  uint64_t nan_bits = 0xFFFFFFFFFFFFFFFFull;
+  double weird_nan;
+  memcpy(&weird_nan, &nan_bits, sizeof(double));
+  double doubles[] = {0.0, -0.0, 1.5, -44.25, 5e-324, -1.7976931348623157e308, INFINITY, -INFINITY, NAN, weird_nan};
+  for (size_t i = 0; i < sizeof(doubles) / sizeof(doubles[0]); i++) {
+    void* ref = obj_box_f64(doubles[i]);
+    double val = 0;
+    CHECK_EQ(1, ref_is_f64(ref) && !ref_is_i32(ref) && !ref_is_cell(ref));
+    CHECK_EQ(TRAP_NONE, obj_unbox_f64(ref, &val));
+    CHECK_EQ(1, isnan(doubles[i]) ? isnan(val) : memcmp(&val, &doubles[i], sizeof(double)) == 0);
+    CHECK_EQ(TRAP_TYPE_MISMATCH, obj_unbox_i32(ref, NULL));
+    CHECK_EQ(!isnan(doubles[i]), obj_eq(ref, obj_box_f64(doubles[i])));
+  }
+  CHECK_EQ(1, obj_eq(obj_box_f64(0.0), obj_box_f64(-0.0)));
+  CHECK_EQ(0, obj_eq(obj_box_f64(1.0), obj_box_i32(1)));
+  obj_heap_t* heap = new_obj_heap();
+  void* obj = obj_new(heap, NULL);
+  CHECK_EQ(1, ref_is_cell(obj) && ref_is_cell(NULL));
+  CHECK_EQ(1, obj_eq(obj, obj) && obj_eq(NULL, NULL) && !obj_eq(obj, NULL));
+  CHECK_EQ(TRAP_TYPE_MISMATCH, obj_unbox_i32(NULL, NULL));
+  free_obj_heap(heap);
+  return 1;
+}
+
+// Looks up the value stored under a boxed i32 key.
+static void* get_i32_key(obj_heap_t* heap, void* obj, int32_t key) {
+  void* result = NULL;
+  if (obj_get(obj, obj_box_i32(key), &result) != TRAP_NONE) return heap;
+  return result;
+}
+
+static int check_obj_props() {
+  obj_heap_t* heap = new_obj_heap();
+  void* obj = obj_new(heap, NULL);
+  void* vals[300];
+  for (int i = 0; i < 300; i++) vals[i] = obj_box_i32(i);
+  // sparse keys first, then filling the gap moves them to the dense elements
+  for (int i = 299; i >= 100; i--) obj_set(heap, obj, obj_box_i32(i), vals[i]);
+  for (int i = 0; i < 100; i++) obj_set(heap, obj, obj_box_i32(i), vals[i]);
+  obj_set(heap, obj, obj_box_i32(-1), vals[1]);
+  for (int i = 0; i < 300; i++) CHECK_EQ(1, get_i32_key(heap, obj, i) == vals[i]);
+  CHECK_EQ(1, get_i32_key(heap, obj, -1) == vals[1]);
+  CHECK_EQ(1, get_i32_key(heap, obj, 300) == NULL);
+
+  // f64 keys are a separate namespace, with -0 == 0 and all NaNs the same
+  void* result = NULL;
+  obj_set(heap, obj, obj_box_f64(-0.0), vals[7]);
+  obj_set(heap, obj, obj_box_f64(NAN), vals[8]);
+  CHECK_EQ(TRAP_NONE, obj_get(obj, obj_box_f64(0.0), &result));
+  CHECK_EQ(1, result == vals[7]);
+  CHECK_EQ(TRAP_NONE, obj_get(obj, obj_box_f64(-NAN), &result));
+  CHECK_EQ(1, result == vals[8]);
+  CHECK_EQ(TRAP_NONE, obj_get(obj, obj_box_f64(1.0), &result));
+  CHECK_EQ(1, result == NULL);
+  CHECK_EQ(1, get_i32_key(heap, obj, 0) == vals[0]);
+
+  // objects are keys by identity
+  void* key = obj_new(heap, NULL);
+  obj_set(heap, obj, key, vals[9]);
+  CHECK_EQ(TRAP_NONE, obj_get(obj, key, &result));
+  CHECK_EQ(1, result == vals[9]);
+  CHECK_EQ(TRAP_NONE, obj_get(obj, obj_new(heap, NULL), &result));
+  CHECK_EQ(1, result == NULL);
+
+  CHECK_EQ(TRAP_NULL_REFERENCE, obj_get(NULL, key, &result));
+  CHECK_EQ(TRAP_NULL_REFERENCE, obj_set(heap, obj, NULL, key));
+  CHECK_EQ(TRAP_TYPE_MISMATCH, obj_get(vals[0], key, &result));
+  free_obj_heap(heap);
+  return 1;
+}
+
+// Checks the property map with both the SIMD and the scalar group probes.
+int test_obj_props() {
+  int level = g_cpu_level;
+  int ok = check_obj_props();
+  g_cpu_level = CPU_SCALAR;
+  ok = ok && check_obj_props();
+  g_cpu_level = level;
+  return ok;
+}
+
+// Checks that cached accesses agree with the property map as shapes change.
+int test_obj_caches() {
+  obj_heap_t* heap = new_obj_heap();
+  obj_cache_t get_cache = {0}, set_cache = {0};
+  void* keys[3] = {obj_new(heap, NULL), obj_box_f64(1.5), obj_box_i32(2)};
+  void* vals[3] = {obj_new(heap, NULL), obj_new(heap, NULL), obj_new(heap, NULL)};
+  void* objs[6];
+  for (int i = 0; i < 6; i++) {
+    objs[i] = obj_new(heap, NULL);
+    // every third object has dense elements that key 2 belongs to
+    if (i % 3 == 2) {
+      for (int j = 0; j < 2; j++) obj_set(heap, objs[i], obj_box_i32(j), vals[0]);
+    }
+    for (int k = 0; k < 3; k++) {
+      CHECK_EQ(TRAP_NONE, obj_set_cached(heap, &set_cache, objs[i], keys[k], vals[k]));
+    }
+  }
+  void* result = NULL;
+  for (int i = 0; i < 6; i++) {
+    for (int k = 0; k < 3; k++) {
+      CHECK_EQ(TRAP_NONE, obj_get_cached(&get_cache, objs[i], keys[k], &result));
+      CHECK_EQ(1, result == vals[k]);
+      CHECK_EQ(TRAP_NONE, obj_get(objs[i], keys[k], &result));
+      CHECK_EQ(1, result == vals[k]);
+    }
+  }
+  CHECK_EQ(1, set_cache.count <= OBJ_CACHE_WAYS);
+  CHECK_EQ(TRAP_NULL_REFERENCE, obj_get_cached(&get_cache, NULL, keys[0], &result));
+  CHECK_EQ(TRAP_TYPE_MISMATCH, obj_set_cached(heap, &set_cache, keys[1], keys[0], NULL));
+  free_obj_heap(heap);
+  return 1;
+}
+
+#define GC_LIST_LENGTH 20000
+
+// Builds a linked list rooted on a fake operand stack while allocating garbage,
+// so that objects are promoted and swept, and then walks the list.
+int test_obj_gc() {
+  obj_heap_t* heap = new_obj_heap();
+  wasm_value_t stack[3];
+  obj_roots_t roots = {stack, NULL, 0, NULL, 0};
+  obj_set_roots(heap, &roots);
+  stack[0] = wasm_ref_value(obj_new(heap, stack)); // head
+  stack[1] = wasm_ref_value(obj_new(heap, stack + 1)); // a key object
+  stack[2] = stack[0]; // tail
+  void* next_key = obj_box_f64(0.5);
+  for (int i = 1; i <= GC_LIST_LENGTH; i++) {
+    // garbage keyed by itself, which makes shapes that die with it
+    void* garbage = obj_new(heap, stack + 3);
+    obj_set(heap, garbage, garbage, next_key);
+    void* node = obj_new(heap, stack + 3);
+    obj_set(heap, node, obj_box_i32(0), obj_box_i32(i));
+    obj_set(heap, node, stack[1].val.ref, obj_box_i32(-i));
+    obj_set(heap, stack[2].val.ref, next_key, node);
+    stack[2].val.ref = node;
+  }
+  obj_collect(heap, stack + 3, 1);
+  const obj_gc_stats_t* stats = obj_gc_stats(heap);
+  CHECK_EQ(1, stats->minor_collections > 0 && stats->major_collections > 0);
+  CHECK_EQ(1, stats->freed >= GC_LIST_LENGTH);
+  CHECK_EQ(GC_LIST_LENGTH + 2, stats->live);
+
+  obj_cache_t cache = {0};
+  void* node = stack[0].val.ref;
+  for (int i = 1; i <= GC_LIST_LENGTH; i++) {
+    CHECK_EQ(TRAP_NONE, obj_get_cached(&cache, node, next_key, &node));
+    void* val = NULL;
+    CHECK_EQ(TRAP_NONE, obj_get(node, obj_box_i32(0), &val));
+    CHECK_EQ(i, ref_i32(val));
+    CHECK_EQ(TRAP_NONE, obj_get(node, stack[1].val.ref, &val));
+    CHECK_EQ(-i, ref_i32(val));
+  }
+  CHECK_EQ(1, stack[2].val.ref == node);
+  free_obj_heap(heap);
+  return 1;
+}
+
+// Moves a list out of the roots while it is being marked, which only the write
+// barrier can see.
+int test_obj_gc_incremental() {
+  obj_heap_t* heap = new_obj_heap();
+  wasm_value_t stack[2];
+  obj_roots_t roots = {stack, NULL, 0, NULL, 0};
+  obj_set_roots(heap, &roots);
+  void* next_key = obj_box_f64(0.5);
+  stack[0] = wasm_ref_value(obj_new(heap, stack)); // head
+  stack[1] = stack[0]; // tail
+  int length = 0;
+  while (!obj_is_marking(heap)) {
+    void* node = obj_new(heap, stack + 2);
+    obj_set(heap, node, obj_box_i32(0), obj_box_i32(++length));
+    obj_set(heap, stack[1].val.ref, next_key, node);
+    stack[1].val.ref = node;
+  }
+  stack[1] = wasm_ref_value(obj_new(heap, stack + 2)); // holder
+  obj_set(heap, stack[1].val.ref, next_key, stack[0].val.ref);
+  stack[0] = wasm_ref_value(NULL);
+  while (obj_is_marking(heap)) obj_gc_step(heap, stack + 2, 8);
+  const obj_gc_stats_t* stats = obj_gc_stats(heap);
+  CHECK_EQ(1, stats->major_collections);
+  CHECK_EQ(1, stats->mark_steps > 1);
+  CHECK_EQ(1, stats->pause_ns_max <= stats->pause_ns_total);
+
+  obj_collect(heap, stack + 2, 0);
+  void* node = stack[1].val.ref;
+  CHECK_EQ(TRAP_NONE, obj_get(node, next_key, &node));
+  for (int i = 1; i <= length; i++) {
+    CHECK_EQ(TRAP_NONE, obj_get(node, next_key, &node));
+    void* val = NULL;
+    CHECK_EQ(TRAP_NONE, obj_get(node, obj_box_i32(0), &val));
+    CHECK_EQ(i, ref_i32(val));
+  }
+  free_obj_heap(heap);
+  return 1;
+}
+
+// The original formatting of putd, which tries each precision in turn.
+static void format_double_slow(char* buf, double val) {
+  for (int prec = 1; prec <= 17; prec++) {
+    snprintf(buf, 32, "%.*g", prec, val);
+    if (strtod(buf, NULL) == val) break;
+  }
+}
+
+int test_format_double() {
+  double vals[] = {0.0, -0.0, 1, -7, 10, 1000, 1200, 12345, 100000, 1e15, 1.5e15, 9007199254740991.0,
+                   9007199254740992.0, 1e300, 0.1, -0.5, 3.14159, 1.0 / 3, 1e-7, 123456.789,
+                   INFINITY, -INFINITY, NAN};
+  char expected[352], got[32];
+  uint32_t seed = 17;
+  uint64_t bits = 88172645463325252ull;
+  for (uint32_t i = 0; i < 3000; i++) {
+    double val;
+    if (i < sizeof(vals) / sizeof(vals[0])) {
+      val = vals[i];
+    } else if (i < 1000) {
+      // a mix of integers and fractions of various magnitudes
+      seed = seed * 1103515245 + 12345;
+      val = (double)(int32_t)seed / (double)(1u << (seed % 24)) * (i % 3 == 0 ? 1e9 : 1);
+    } else {
+      // any bits, including subnormals and powers of 2
+      bits ^= bits << 13;
+      bits ^= bits >> 7;
+      bits ^= bits << 17;
+      uint64_t b = i % 4 == 1 ? bits & 0x800FFFFFFFFFFFFFull : i % 4 == 2 ? bits & 0xFFF0000000000000ull : bits;
+      memcpy(&val, &b, sizeof(val));
+      if (isnan(val)) continue;
+    }
+    format_double_slow(expected, val);
+    uint32_t length = format_shortest_double(got, val);
+    got[length] = 0;
+    if (strcmp(expected, got) != 0) {
+      printf("format %.17g: expected %s, got %s\n", val, expected, got);
+      return 0;
+    }
+    // values are printed like "%lf"
+    snprintf(expected, sizeof(expected), "%lf", val);
+    out_begin_capture();
+    out_wasm_value(wasm_f64_value(val));
+    size_t size;
+    char* printed = (char*)out_end_capture(&size);
+    CHECK_EQ((int)strlen(expected), (int)size);
+    CHECK_EQ(0, memcmp(expected, printed, size));
+    free(printed);
+  }
+  return 1;
+}
+
+// A module that imports "test.add" : [i32] -> [i32] and exports "main", which calls it.
+static const byte host_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 6, 1, 0x60, 1, 0x7F, 1, 0x7F, // (func (param i32) (result i32))
+  WASM_SECT_IMPORT, 12, 1, 4, 't', 'e', 's', 't', 3, 'a', 'd', 'd', WASM_IMPORT_FUNC, 0,
+  WASM_SECT_FUNCTION, 2, 1, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 1,
+  WASM_SECT_CODE, 8, 1, 6, 0, WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_END,
+};
+
+// A module that imports "test.pend" : [i32] -> [i32] and exports "main", which
+// returns 100 more than it.
+static const byte pend_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 6, 1, 0x60, 1, 0x7F, 1, 0x7F, // (func (param i32) (result i32))
+  WASM_SECT_IMPORT, 13, 1, 4, 't', 'e', 's', 't', 4, 'p', 'e', 'n', 'd', WASM_IMPORT_FUNC, 0,
+  WASM_SECT_FUNCTION, 2, 1, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 1,
+  WASM_SECT_CODE, 12, 1, 10, 0, WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0,
+  WASM_OP_I32_CONST, 0xE4, 0x00, WASM_OP_I32_ADD, WASM_OP_END,
+};
+
+// A module that exports "main" : [i32] -> [i32], which counts its argument down
+// to 0 in a loop and returns it.
+static const byte loop_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 6, 1, 0x60, 1, 0x7F, 1, 0x7F, // (func (param i32) (result i32))
+  WASM_SECT_FUNCTION, 2, 1, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 0,
+  WASM_SECT_CODE, 21, 1, 19, 0,
+  WASM_OP_LOOP, 0x40,
+  WASM_OP_LOCAL_GET, 0, WASM_OP_I32_CONST, 1, WASM_OP_I32_SUB, WASM_OP_LOCAL_TEE, 0,
+  WASM_OP_BR_IF, 0x80, 0x80, 0x80, 0x00,
+  WASM_OP_END,
+  WASM_OP_LOCAL_GET, 0, WASM_OP_END,
+};
+
+// A module that imports "test.add" : [i32] -> [i32] as func[0] and exports "main"
+// as func[2], which calls func[1] to call test.add twice, and traps if its
+// argument is 0.
+static const byte calls_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 6, 1, 0x60, 1, 0x7F, 1, 0x7F, // (func (param i32) (result i32))
+  WASM_SECT_IMPORT, 12, 1, 4, 't', 'e', 's', 't', 3, 'a', 'd', 'd', WASM_IMPORT_FUNC, 0,
+  WASM_SECT_FUNCTION, 3, 2, 0, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 2,
+  WASM_SECT_CODE, 25, 2,
+  8, 0, WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_CALL, 0, WASM_OP_END,
+  14, 0, WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 1, WASM_OP_LOCAL_GET, 0,
+  WASM_OP_BR_IF, 0x80, 0x80, 0x80, 0x00, WASM_OP_UNREACHABLE, WASM_OP_END,
+};
+
+// A module that imports the intrinsics "weewasm.obj.box_i32" and
+// "weewasm.i32.unbox", and exports "main" : [i32] -> [i32], which boxes its
+// argument into a local with local.tee, so that the box is kept, and returns it
+// unboxed.
+static const byte box_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 16, 3,
+  0x60, 1, 0x7F, 1, 0x7F, // (func (param i32) (result i32))
+  0x60, 1, 0x7F, 1, 0x6F, // (func (param i32) (result externref))
+  0x60, 1, 0x6F, 1, 0x7F, // (func (param externref) (result i32))
+  WASM_SECT_IMPORT, 43, 2,
+  7, 'w', 'e', 'e', 'w', 'a', 's', 'm', 11, 'o', 'b', 'j', '.', 'b', 'o', 'x', '_', 'i', '3', '2', WASM_IMPORT_FUNC, 1,
+  7, 'w', 'e', 'e', 'w', 'a', 's', 'm', 9, 'i', '3', '2', '.', 'u', 'n', 'b', 'o', 'x', WASM_IMPORT_FUNC, 2,
+  WASM_SECT_FUNCTION, 2, 1, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 2,
+  WASM_SECT_CODE, 14, 1, 12, 1, 1, 0x6F, // (local externref)
+  WASM_OP_LOCAL_GET, 0, WASM_OP_CALL, 0, WASM_OP_LOCAL_TEE, 1, WASM_OP_CALL, 1, WASM_OP_END,
+};
+
+// Adds 1 to its argument.
+static wasm_trap_t test_add(wasm_instance_t* instance, void* data, wasm_value_t* args) {
+  (void)instance;
+  (void)data;
+  args[0] = wasm_i32_value((int32_t)args[0].val.i32 + 1);
+  return TRAP_NONE;
+}
+
+// The argument of the last call to "test.pend", which the test completes.
+static wasm_value_t test_pending;
+
+// Suspends the instance, keeping its argument for the test to complete the call.
+static wasm_trap_t test_pend(wasm_instance_t* instance, void* data, wasm_value_t* args) {
+  (void)instance;
+  (void)data;
+  test_pending = args[0];
+  return TRAP_PENDING;
+}
+
+// Registers the host functions the test modules import, once for all tests.
+// Returns < 0 if they cannot be registered.
+static int register_test_funcs() {
+  static int result = 1;
+  if (result > 0) {
+    result = weerun_register_host_func("test", "add", "i:i", test_add, NULL);
+    if (result == 0) result = weerun_register_host_func("test", "pend", "i:i", test_pend, NULL);
+  }
+  return result;
+}
+
+int test_host_funcs() {
+  wasm_module_t* module = weerun_load_module(host_module, sizeof(host_module));
+  CHECK_EQ(1, module != NULL);
+  int32_t main_func = weerun_find_export(module, "main");
+  CHECK_EQ(1, main_func);
+  CHECK_EQ(-1, weerun_find_export(module, "other"));
+  wasm_value_t args[1] = {wasm_i32_value(41)}, results[1];
+  // imports are bound when instantiated, so an unregistered one traps when called
+  byte other[sizeof(host_module)];
+  memcpy(other, host_module, sizeof(host_module));
+  other[27] = 'x'; // "test.adx"
+  wasm_module_t* other_module = weerun_load_module(other, sizeof(other));
+  wasm_instance_t* instance = weerun_instantiate(other_module, NULL);
+  CHECK_EQ(TRAP_UNBOUND_IMPORT, weerun_call(instance, main_func, args, 1, results));
+  weerun_free_instance(instance);
+  weerun_free_module(other_module);
+
+  CHECK_EQ(-1, weerun_register_host_func("test", "add", "i:x", test_add, NULL));
+  CHECK_EQ(-1, weerun_register_host_func("weewasm", "puti", "i:", test_add, NULL));
+  CHECK_EQ(0, register_test_funcs());
+  instance = weerun_instantiate(module, NULL);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, main_func, args, 1, results));
+  CHECK_EQ(42, results[0].val.i32);
+  CHECK_EQ(TRAP_INVALID_ARGS, weerun_call(instance, main_func, args, 0, results));
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+int test_serve_cache() {
+  wasm_module_t* module = cached_module(host_module, sizeof(host_module));
+  CHECK_EQ(1, module != NULL);
+  CHECK_EQ(1, module == cached_module(host_module, sizeof(host_module)));
+  // the same module with the import named "test.ade"
+  byte other[sizeof(host_module)];
+  memcpy(other, host_module, sizeof(host_module));
+  other[27]++;
+  wasm_module_t* other_module = cached_module(other, sizeof(other));
+  CHECK_EQ(1, other_module != NULL && other_module != module);
+  CHECK_EQ('e', other_module->imports[0].member_name[2]);
+  return 1;
+}
+
+int test_instance_reset() {
+  wasm_module_t* module = weerun_load_module(host_module, sizeof(host_module));
+  module->mem_limits.initial = 2;
+  wasm_instance_t* instance = weerun_instantiate_pooled(module, NULL);
+  CHECK_EQ(1, instance != NULL && instance->template != NULL);
+  CHECK_EQ(2 * WASM_PAGE_SIZE, instance->mem_end - instance->mem_start);
+  instance->mem_start[0] = 1;
+  instance->mem_start[WASM_PAGE_SIZE + 7] = 2;
+  CHECK_EQ(TRAP_NONE, weerun_reset_instance(instance));
+  CHECK_EQ(0, instance->mem_start[0]);
+  CHECK_EQ(0, instance->mem_start[WASM_PAGE_SIZE + 7]);
+  // the reset memory is writable again
+  instance->mem_start[3] = 4;
+  CHECK_EQ(4, instance->mem_start[3]);
+  CHECK_EQ(TRAP_NONE, weerun_reset_instance(instance));
+  CHECK_EQ(0, instance->mem_start[3]);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+// A module that exports "main" : [] -> [i32], which returns 42.
+static const byte const_module[] = {
+  0x00, 0x61, 0x73, 0x6D, 0x01, 0x00, 0x00, 0x00,
+  WASM_SECT_TYPE, 5, 1, 0x60, 0, 1, 0x7F, // (func (result i32))
+  WASM_SECT_FUNCTION, 2, 1, 0,
+  WASM_SECT_EXPORT, 8, 1, 4, 'm', 'a', 'i', 'n', WASM_IMPORT_FUNC, 0,
+  WASM_SECT_CODE, 6, 1, 4, 0, WASM_OP_I32_CONST, 42, WASM_OP_END,
+};
+
+int test_batch() {
+  char args_path[] = "/tmp/weerun-test-XXXXXX";
+  char out_path[] = "/tmp/weerun-test-XXXXXX";
+  int fd = mkstemp(args_path);
+  int out = mkstemp(out_path);
+  CHECK_EQ(1, fd >= 0 && out >= 0);
+  // blank lines are skipped, and lines without arguments call main without any
+  const char* lines = "= 42\n\n  \n=42\n";
+  CHECK_EQ((int)strlen(lines), (int)write(fd, lines, strlen(lines)));
+  close(fd);
+  // the output goes to a file, since the calling thread captures its own lines
+  for (uint32_t workers = 1; workers <= 2; workers++) {
+    CHECK_EQ(0, ftruncate(out, 0) || lseek(out, 0, SEEK_SET));
+    out_set_fd(out);
+    int status = run_batch(const_module, const_module + sizeof(const_module), args_path, workers);
+    out_set_fd(STDOUT_FILENO);
+    char output[16];
+    CHECK_EQ(0, status);
+    CHECK_EQ(6, (int)pread(out, output, sizeof(output), 0));
+    CHECK_EQ(0, memcmp("42\n42\n", output, 6));
+  }
+  close(out);
+  unlink(out_path);
+  unlink(args_path);
+  return 1;
+}
+
+// Creates an empty file with a unique name for a test to write to, filling in
+// the "XXXXXX" at the end of {path}. Returns < 0 if it cannot be created.
+static int make_temp_file(char* path) {
+  int fd = mkstemp(path);
+  if (fd < 0) return -1;
+  close(fd);
+  return 0;
+}
+
+int test_snapshot() {
+  char path[] = "/tmp/weerun-test-XXXXXX";
+  CHECK_EQ(0, make_temp_file(path));
+  // host_module with a memory section of one page after the function section
+  byte bytes[sizeof(host_module) + 5];
+  memcpy(bytes, host_module, 34);
+  memcpy(bytes + 34, (byte[]){WASM_SECT_MEMORY, 3, 1, 0, 1}, 5);
+  memcpy(bytes + 39, host_module + 34, sizeof(host_module) - 34);
+  wasm_module_t* module = weerun_load_module(bytes, sizeof(bytes));
+  CHECK_EQ(1, module != NULL);
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  instance->mem_start[9] = 99;
+  instance->mem_start[WASM_PAGE_SIZE - 1] = 98;
+  CHECK_EQ(0, save_snapshot(path, bytes, sizeof(bytes), instance));
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+
+  instance = restore_snapshot(path);
+  CHECK_EQ(1, instance != NULL);
+  CHECK_EQ(99, instance->mem_start[9]);
+  CHECK_EQ(98, instance->mem_start[WASM_PAGE_SIZE - 1]);
+  CHECK_EQ(0, instance->mem_start[10]);
+  // resetting a restored instance goes back to the snapshot
+  instance->mem_start[9] = 1;
+  CHECK_EQ(TRAP_NONE, weerun_reset_instance(instance));
+  CHECK_EQ(99, instance->mem_start[9]);
+  module = instance->module;
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+
+  // a module is not a snapshot
+  FILE* file = fopen(path, "wb");
+  fwrite(bytes, 1, sizeof(bytes), file);
+  fclose(file);
+  CHECK_EQ(1, restore_snapshot(path) == NULL);
+  unlink(path);
+  return 1;
+}
+
+int test_module_cache() {
+  char dir[] = "/tmp/weerun-test-XXXXXX";
+  CHECK_EQ(1, mkdtemp(dir) != NULL);
+  char path[64];
+  snprintf(path, sizeof(path), "%s/%016llx.wee", dir,
+           (unsigned long long)weerun_hash_bytes(host_module, sizeof(host_module)));
+  CHECK_EQ(1, load_module_cache(dir, host_module, sizeof(host_module)) == NULL);
+  wasm_module_t* parsed = weerun_load_module_cached(dir, host_module, sizeof(host_module));
+  CHECK_EQ(1, parsed != NULL && parsed->mapping == NULL);
+
+  wasm_module_t* module = weerun_load_module_cached(dir, host_module, sizeof(host_module));
+  CHECK_EQ(1, module != NULL && module->mapping != NULL);
+  CHECK_EQ(parsed->bytes_end - parsed->bytes_start, module->bytes_end - module->bytes_start);
+  CHECK_EQ(0, memcmp(parsed->bytes_start, module->bytes_start, parsed->bytes_end - parsed->bytes_start));
+  CHECK_EQ(1, weerun_find_export(module, "main"));
+  CHECK_EQ(0, strcmp("add", module->imports[0].member_name));
+  CHECK_EQ(parsed->funcs[1].instr_start, module->funcs[1].instr_start);
+  CHECK_EQ(1, module->sigs[module->funcs[1].sig_index].num_params);
+  weerun_free_module(module);
+  weerun_free_module(parsed);
+
+  // the same hash with other bytes is not a hit
+  byte other[sizeof(host_module)];
+  memcpy(other, host_module, sizeof(host_module));
+  other[27]++;
+  char other_path[64];
+  snprintf(other_path, sizeof(other_path), "%s/%016llx.wee", dir,
+           (unsigned long long)weerun_hash_bytes(other, sizeof(other)));
+  rename(path, other_path);
+  CHECK_EQ(1, load_module_cache(dir, other, sizeof(other)) == NULL);
+  unlink(other_path);
+  rmdir(dir);
+  return 1;
+}
+
+static void count_job(uint32_t worker, uint32_t index, void* data) {
+  (void)worker;
+  __atomic_fetch_add(&((uint32_t*)data)[index], 1, __ATOMIC_RELAXED);
+}
+
+int test_run_parallel() {
+  uint32_t counts[1000];
+  for (uint32_t workers = 1; workers <= 8; workers *= 2) {
+    memset(counts, 0, sizeof(counts));
+    run_parallel(workers, 1000, count_job, counts);
+    for (uint32_t i = 0; i < 1000; i++) CHECK_EQ(1, counts[i]);
+  }
+  run_parallel(4, 0, count_job, NULL);
+  return 1;
+}
+
+int test_suspend() {
+  CHECK_EQ(0, register_test_funcs());
+  wasm_module_t* module = weerun_load_module(pend_module, sizeof(pend_module));
+  wasm_instance_t* a = weerun_instantiate(module, NULL);
+  wasm_instance_t* b = weerun_instantiate(module, NULL);
+  wasm_value_t args[1] = {wasm_i32_value(5)}, results[1] = {wasm_i32_value(0)};
+  CHECK_EQ(TRAP_PENDING, weerun_call(a, 1, args, 1, results));
+  CHECK_EQ(1, weerun_is_suspended(a));
+  CHECK_EQ(5, test_pending.val.i32);
+  // a suspended instance cannot be called, but others can
+  CHECK_EQ(TRAP_PENDING, weerun_call(a, 1, args, 1, results));
+  args[0] = wasm_i32_value(7);
+  CHECK_EQ(TRAP_PENDING, weerun_call(b, 1, args, 1, results));
+  CHECK_EQ(7, test_pending.val.i32);
+
+  wasm_value_t host_results[1] = {wasm_f64_value(1)};
+  CHECK_EQ(TRAP_INVALID_ARGS, weerun_resume(a, host_results, results));
+  // main continues after the host function returns
+  host_results[0] = wasm_i32_value(105);
+  CHECK_EQ(TRAP_NONE, weerun_resume(a, host_results, results));
+  CHECK_EQ(205, results[0].val.i32);
+  CHECK_EQ(0, weerun_is_suspended(a));
+  host_results[0] = wasm_i32_value(107);
+  CHECK_EQ(TRAP_NONE, weerun_resume(b, host_results, results));
+  CHECK_EQ(207, results[0].val.i32);
+  CHECK_EQ(TRAP_INVALID_ARGS, weerun_resume(b, host_results, results));
+
+  // the host function itself can be the entry
+  CHECK_EQ(TRAP_PENDING, weerun_call(a, 0, args, 1, results));
+  CHECK_EQ(TRAP_NONE, weerun_resume(a, host_results, results));
+  CHECK_EQ(107, results[0].val.i32);
+  weerun_free_instance(a);
+  weerun_free_instance(b);
+  weerun_free_module(module);
+  return 1;
+}
+
+int test_fuel() {
+  wasm_module_t* module = weerun_load_module(loop_module, sizeof(loop_module));
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  CHECK_EQ(1, weerun_fuel(instance) == FUEL_UNLIMITED);
+  wasm_value_t args[1] = {wasm_i32_value(10)}, results[1];
+  // the call and each of the 9 branches back to the loop are charged
+  weerun_set_fuel(instance, 25);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(0, results[0].val.i32);
+  CHECK_EQ(15, (int)weerun_fuel(instance));
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(5, (int)weerun_fuel(instance));
+  CHECK_EQ(TRAP_OUT_OF_FUEL, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(0, (int)weerun_fuel(instance));
+  weerun_set_fuel(instance, 10);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(0, (int)weerun_fuel(instance));
+  // counting opcodes charges fuel the same, and leaves unlimited fuel alone
+  instance->opstats = new_opstats(module);
+  weerun_set_fuel(instance, 25);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(15, (int)weerun_fuel(instance));
+  weerun_set_fuel(instance, FUEL_UNLIMITED);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(1, weerun_fuel(instance) == FUEL_UNLIMITED);
+  free_opstats(instance->opstats);
+  instance->opstats = NULL;
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+int test_profile() {
+  // calls_module with a trailing "name" section that names function 2 "a;b"
+  static const byte names[] = {0, 13, 4, 'n', 'a', 'm', 'e', 1, 6, 1, 2, 3, 'a', ';', 'b'};
+  byte bytes[sizeof(calls_module) + sizeof(names)];
+  memcpy(bytes, calls_module, sizeof(calls_module));
+  memcpy(bytes + sizeof(calls_module), names, sizeof(names));
+  wasm_module_t* module = weerun_load_module(bytes, sizeof(bytes));
+  CHECK_EQ(1, module != NULL);
+  CHECK_EQ(0, strcmp("a;b", wasm_func_name(module, 2)));
+  CHECK_EQ(1, wasm_func_name(module, 1) == NULL);
+
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  profile_t* profile = new_profile();
+  wasm_frame_t* frames = instance->frames_start;
+  frames[0].func_index = 2;
+  frames[1].func_index = 1;
+  profile_sample(profile, instance, &frames[1], 30);
+  profile_sample(profile, instance, &frames[1], 30);
+  profile_sample(profile, instance, &frames[0], 20);
+  CHECK_EQ(3, (int)profile_count(profile));
+  char path[] = "/tmp/weerun-test-XXXXXX";
+  CHECK_EQ(0, make_temp_file(path));
+  CHECK_EQ(0, write_profile(profile, module, path));
+  free_profile(profile);
+  char text[128] = {0};
+  FILE* file = fopen(path, "r");
+  fread(text, 1, sizeof(text) - 1, file);
+  fclose(file);
+  unlink(path);
+  CHECK_EQ(1, strstr(text, "a_b;func[1];@+30 2\n") != NULL);
+  CHECK_EQ(1, strstr(text, "a_b;@+20 1\n") != NULL);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+int test_opstats() {
+  wasm_module_t* module = weerun_load_module(loop_module, sizeof(loop_module));
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  opstats_t* stats = new_opstats(module);
+  instance->opstats = stats;
+  wasm_value_t args[1] = {wasm_i32_value(3)}, results[1];
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  CHECK_EQ(0, results[0].val.i32);
+  uint32_t start = module->funcs[0].instr_start;
+  CHECK_EQ(6, (int)stats->counts[start]); // the loop, which its branch goes back to
+  CHECK_EQ(6, (int)stats->counts[start + 2]); // local.get
+  CHECK_EQ(6, (int)stats->counts[start + 9]); // br_if
+  CHECK_EQ(2, (int)stats->counts[start + 15]); // local.get after the loop
+  CHECK_EQ(6, (int)stats->pairs[WASM_OP_I32_SUB][WASM_OP_LOCAL_TEE]);
+  // pairs are of the rewritten opcodes
+  CHECK_EQ(4, (int)stats->pairs[WASM_OP_JMP_IF][WASM_OP_LOOP]);
+  CHECK_EQ(0, (int)stats->pairs[WASM_OP_BR_IF][WASM_OP_LOOP]);
+  // pairs continue from one call into the next
+  CHECK_EQ(1, (int)stats->pairs[WASM_OP_END][WASM_OP_LOOP]);
+  instance->opstats = NULL;
+  free_opstats(stats);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+// Returns the number of times {pattern} occurs in {text}.
+static int count_matches(const char* text, const char* pattern) {
+  int count = 0;
+  for (const char* p = strstr(text, pattern); p != NULL; p = strstr(p + 1, pattern)) count++;
+  return count;
+}
+
+int test_events() {
+  CHECK_EQ(0, register_test_funcs());
+  // start_events keeps the path, which must outlive a check that fails early
+  static char path[] = "/tmp/weerun-test-XXXXXX";
+  CHECK_EQ(0, make_temp_file(path));
+  start_events(path, 10);
+  CHECK_EQ(16, (int)g_event_capacity);
+  wasm_module_t* module = weerun_load_module(calls_module, sizeof(calls_module));
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  wasm_value_t args[1] = {wasm_i32_value(5)}, results[1];
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 2, args, 1, results));
+  CHECK_EQ(7, results[0].val.i32);
+  // 8 load events, and a begin and an end for each of the 4 calls
+  CHECK_EQ(16, (int)t_event_ring->next);
+  args[0] = wasm_i32_value(0);
+  CHECK_EQ(TRAP_UNREACHABLE, weerun_call(instance, 2, args, 1, results));
+  // 8 more for the calls, and the trap
+  CHECK_EQ(25, (int)t_event_ring->next);
+  CHECK_EQ(0, finish_events(module));
+  CHECK_EQ(0, finish_events(module)); // no longer recording
+  char text[4096] = {0};
+  FILE* file = fopen(path, "r");
+  fread(text, 1, sizeof(text) - 1, file);
+  fclose(file);
+  unlink(path);
+  // the load events and the beginning of the first call to main were
+  // overwritten, and so the end of that call is dropped
+  CHECK_EQ(0, count_matches(text, "\"cat\":\"phase\""));
+  CHECK_EQ(1, count_matches(text, "\"name\":\"main\",\"cat\":\"call\",\"ph\":\"B\""));
+  CHECK_EQ(2, count_matches(text, "\"name\":\"func[1]\",\"cat\":\"call\",\"ph\":\"B\""));
+  CHECK_EQ(4, count_matches(text, "\"name\":\"func[0]\",\"cat\":\"host call\",\"ph\":\"E\""));
+  // the trap ends main, which had not returned
+  const char* trap = strstr(text, "\"name\":\"trap: unreachable\",\"cat\":\"trap\",\"ph\":\"i\"");
+  CHECK_EQ(1, trap != NULL);
+  CHECK_EQ(1, count_matches(trap, "\"name\":\"main\",\"cat\":\"call\",\"ph\":\"E\""));
+  CHECK_EQ(1, count_matches(text, "\"name\":\"main\",\"cat\":\"call\",\"ph\":\"E\""));
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+
+  // intrinsics lowered into opcodes are logged as host calls
+  module = weerun_load_module(box_module, sizeof(box_module));
+  instance = weerun_instantiate(module, NULL);
+  start_events(path, 16);
+  args[0] = wasm_i32_value(9);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 2, args, 1, results));
+  CHECK_EQ(9, results[0].val.i32);
+  CHECK_EQ(6, (int)t_event_ring->next);
+  CHECK_EQ(EVENT_HOST_CALL, t_event_ring->events[1].type);
+  CHECK_EQ(0, (int)t_event_ring->events[1].index);
+  CHECK_EQ(EVENT_END, t_event_ring->events[4].phase);
+  CHECK_EQ(1, (int)t_event_ring->events[4].index);
+  CHECK_EQ(0, finish_events(module));
+  unlink(path);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return 1;
+}
+
+int test_stats() {
+  CHECK_EQ(0, register_test_funcs());
+  g_stats = 1;
+  run_stats_t before = *thread_stats();
+  wasm_module_t* module = weerun_load_module(calls_module, sizeof(calls_module));
+  wasm_instance_t* instance = weerun_instantiate(module, NULL);
+  wasm_value_t args[1] = {wasm_i32_value(5)}, results[1];
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 2, args, 1, results));
+  args[0] = wasm_i32_value(0);
+  CHECK_EQ(TRAP_UNREACHABLE, weerun_call(instance, 2, args, 1, results));
+  // calls with the wrong arguments trap before they start
+  CHECK_EQ(TRAP_INVALID_ARGS, weerun_call(instance, 2, args, 0, results));
+  weerun_free_instance(instance);
+  // intrinsics lowered into opcodes and called directly count as host calls
+  wasm_module_t* box = weerun_load_module(box_module, sizeof(box_module));
+  instance = weerun_instantiate(box, NULL);
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 2, args, 1, results));
+  CHECK_EQ(TRAP_NONE, weerun_call(instance, 0, args, 1, results));
+  weerun_free_instance(instance);
+  weerun_free_module(box);
+  run_stats_t* after = thread_stats();
+  g_stats = 0;
+  CHECK_EQ(2, (int)(after->phases[EVENT_PARSE].count - before.phases[EVENT_PARSE].count));
+  CHECK_EQ(3, (int)(after->phases[EVENT_REWRITE].count - before.phases[EVENT_REWRITE].count));
+  CHECK_EQ(2, (int)(after->phases[EVENT_INSTANTIATE].count - before.phases[EVENT_INSTANTIATE].count));
+  CHECK_EQ(5, (int)(after->calls - before.calls));
+  CHECK_EQ(7, (int)(after->host_calls - before.host_calls));
+  CHECK_EQ(2, (int)(after->traps - before.traps));
+  CHECK_EQ(1, after->bytes[BYTES_MODULE] - before.bytes[BYTES_MODULE] >= sizeof(wasm_module_t));
+  CHECK_EQ(1, after->bytes[BYTES_PARSER] > before.bytes[BYTES_PARSER]);
+  CHECK_EQ(1, thread_stats() == NULL);
+  weerun_free_module(module);
+  return 1;
+}
+
 test_t all_tests[] = {
   {"i32leb", test_i32},
   {"i32leb_ext", test_i32ext},
@@ -405,6 +1327,27 @@ test_t all_tests[] = {
   {"rewrite_br1", test_rewrite_br1},
   {"rewrite_br2", test_rewrite_br2},
   {"rewrite_loop1", test_rewrite_loop1},
+  {"rewrite_box", test_rewrite_box},
+  {"bytecode_length", test_bytecode_length},
+  {"obj_boxing", test_obj_boxing},
+  {"obj_props", test_obj_props},
+  {"obj_caches", test_obj_caches},
+  {"obj_gc", test_obj_gc},
+  {"obj_gc_incremental", test_obj_gc_incremental},
+  {"format_double", test_format_double},
+  {"host_funcs", test_host_funcs},
+  {"serve_cache", test_serve_cache},
+  {"instance_reset", test_instance_reset},
+  {"batch", test_batch},
+  {"snapshot", test_snapshot},
+  {"module_cache", test_module_cache},
+  {"run_parallel", test_run_parallel},
+  {"suspend", test_suspend},
+  {"fuel", test_fuel},
+  {"profile", test_profile},
+  {"opstats", test_opstats},
+  {"events", test_events},
+  {"stats", test_stats},
 };
 
 //================================================================================
@@ -428,3 +1371,109 @@ int run_tests() {
 }
 
       
+
+//================================================================================
+// Microbenchmarks
+
+#define BENCH_LEBS 1000000
+#define BENCH_ROUNDS 20
+
+// Encodes {val} as a signed LEB at {p}, returning the number of bytes written.
+static int encode_sleb(uint8_t* p, int64_t val) {
+  int n = 0;
+  for (;;) {
+    uint8_t b = val & 0x7F;
+    val >>= 7;
+    if ((val == 0 && (b & 0x40) == 0) || (val == -1 && (b & 0x40) != 0)) {
+      p[n++] = b;
+      return n;
+    }
+    p[n++] = b | 0x80;
+  }
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Decodes a buffer of {BENCH_LEBS} LEBs {BENCH_ROUNDS} times and reports throughput.
+#define BENCH_poly(name, type, decode, bits) do {			\
+    uint8_t* p = buf;							\
+    for (int i = 0; i < BENCH_LEBS; i++) {				\
+      int shift = (i * 7) % (bits - 1);					\
+      int64_t val = (int64_t)((uint64_t)rand() << 32 | rand()) >> (63 - shift); \
+      if (bits == 32) val = (int32_t)val;				\
+      p += encode_sleb(p, (name[0] == 'u' && val < 0) ? -val : val);	\
+    }									\
+    const uint8_t* end = p;						\
+    uint64_t sum = 0;							\
+    double start = now_seconds();					\
+    for (int r = 0; r < BENCH_ROUNDS; r++) {				\
+      for (const uint8_t* q = buf; q < end; ) {				\
+        ssize_t len = 0;						\
+        sum += (uint64_t)decode(q, end, &len);				\
+        if (len <= 0) break;						\
+        q += len;							\
+      }									\
+    }									\
+    double secs = now_seconds() - start;				\
+    double count = (double)BENCH_LEBS * BENCH_ROUNDS;			\
+    printf("%-8s %6.2f ns/leb %8.1f MB/s  (avg %.2f bytes, sum %" PRIx64 ")\n", \
+           name, secs * 1e9 / count, (end - buf) * BENCH_ROUNDS / secs / 1e6, \
+           (double)(end - buf) / BENCH_LEBS, sum);			\
+  } while(0)
+
+#define BENCH_COPY_BYTES (4 * 1024 * 1024)
+#define BENCH_COPY_ROUNDS 50
+#define BENCH_RECORD_KEYS 12
+#define BENCH_RECORD_ROUNDS 2000000
+
+int run_benchmarks() {
+  printf("cpu: %s\n", cpu_level_name(g_cpu_level));
+  uint8_t* buf = (uint8_t*)malloc(BENCH_LEBS * 10 + 16);
+  srand(0);
+  BENCH_poly("i32leb", int32_t, decode_i32leb, 32);
+  BENCH_poly("u32leb", uint32_t, decode_u32leb, 32);
+  BENCH_poly("i64leb", int64_t, decode_i64leb, 64);
+  BENCH_poly("u64leb", uint64_t, decode_u64leb, 64);
+  free(buf);
+
+  uint8_t* src = (uint8_t*)malloc(BENCH_COPY_BYTES);
+  uint8_t* dst = (uint8_t*)malloc(BENCH_COPY_BYTES);
+  for (int i = 0; i < BENCH_COPY_BYTES; i++) src[i] = (uint8_t)i;
+  double start = now_seconds();
+  for (int r = 0; r < BENCH_COPY_ROUNDS; r++) {
+    // vary the alignment and length a little, like data segments
+    g_kernels.copy_bytes(dst + (r & 7), src + (r & 15), BENCH_COPY_BYTES - 16 - r);
+  }
+  double secs = now_seconds() - start;
+  printf("%-8s %8.1f MB/s  (check %u)\n", "copy",
+         (double)BENCH_COPY_BYTES * BENCH_COPY_ROUNDS / secs / 1e6, dst[12345]);
+  free(src);
+  free(dst);
+
+  // record-like objects: the same keys set in the same order
+  obj_heap_t* heap = new_obj_heap();
+  void* keys[BENCH_RECORD_KEYS];
+  for (int k = 0; k < BENCH_RECORD_KEYS; k++) keys[k] = obj_box_f64(k + 0.5);
+  void* record = obj_new(heap, NULL);
+  obj_cache_t caches[BENCH_RECORD_KEYS] = {{0}};
+  for (int k = 0; k < BENCH_RECORD_KEYS; k++) obj_set(heap, record, keys[k], keys[k]);
+  void* result = NULL;
+  start = now_seconds();
+  for (int r = 0; r < BENCH_RECORD_ROUNDS; r++) {
+    for (int k = 0; k < BENCH_RECORD_KEYS; k++) obj_get(record, keys[k], &result);
+  }
+  secs = now_seconds() - start;
+  printf("%-8s %8.2f ns/get\n", "obj.get", secs * 1e9 / BENCH_RECORD_ROUNDS / BENCH_RECORD_KEYS);
+  start = now_seconds();
+  for (int r = 0; r < BENCH_RECORD_ROUNDS; r++) {
+    for (int k = 0; k < BENCH_RECORD_KEYS; k++) obj_get_cached(&caches[k], record, keys[k], &result);
+  }
+  secs = now_seconds() - start;
+  printf("%-8s %8.2f ns/get\n", "cached", secs * 1e9 / BENCH_RECORD_ROUNDS / BENCH_RECORD_KEYS);
+  free_obj_heap(heap);
+  return 0;
+}
@@ -1,3 +1,6 @@
 #pragma once
 
 int run_tests();
+
+// Runs the microbenchmarks, printing throughput to standard out.
+int run_benchmarks();
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <sys/time.h>
 
 #include "common.h"
 #include "disass.h"
@@ -11,19 +13,163 @@
 #include "weewasm.h"
 #include "illegal.h"
 #include "ir.h"
+#include "interp.h"
+#include "cpu.h"
+#include "obj.h"
+#include "out.h"
+#include "libweerun.h"
+#include "serve.h"
+#include "snapshot.h"
+#include "profile.h"
+#include "opstats.h"
+#include "events.h"
+#include "stats.h"
 
 // Disassembles and runs a wasm module.
 wasm_values run(const byte* start, const byte* end, wasm_values* args);
 
+// Restores an instance from a snapshot and calls its "main" export with {args}.
+wasm_values run_snapshot(const char* path, wasm_values* args);
+
+// Instantiates a module, runs its start function and saves a snapshot of it.
+int snapshot(const char* path, const byte* start, const byte* end);
+
+// Parses argv[first...] as the arguments to "main".
+static wasm_values parse_args(int argc, char* argv[], int first) {
+  wasm_values args = { argc - first, NULL };
+  if (args.length > 0) {
+    args.vals = (wasm_value_t*)malloc(sizeof(wasm_value_t) * args.length);
+    for (int j = first; j < argc; j++) {
+      int a = j - first;
+      args.vals[a] = parse_wasm_value(argv[j]);
+      TRACE("args[%d] = ", a);
+      trace_wasm_value(args.vals[a]);
+      TRACE("\n");
+    }
+  }
+  return args;
+}
+
+// Prints the results of a run, or "!trap", and exits.
+static int exit_with(wasm_values result) {
+  finish_events(NULL); // if the run did not get to write them
+  if (result.length < 0) {
+    out_str("!trap\n");
+    out_flush();
+    exit(1);
+    return 1;
+  }
+  out_results(result.vals, (uint32_t)result.length);
+  out_flush();
+  exit(0);
+  return 0;
+}
+
+// Whether to print garbage collector statistics to stderr after a run.
+static int g_gcstats = 0;
+
+// The fuel of a run, and its time limit in milliseconds, or 0 for none.
+static int64_t g_fuel = FUEL_UNLIMITED;
+static long g_timeout_ms = 0;
+
+// The instance that a timeout interrupts.
+static wasm_instance_t* volatile g_timed_instance = NULL;
+
+static void on_timeout(int sig) {
+  (void)sig;
+  wasm_instance_t* instance = g_timed_instance;
+  if (instance != NULL) weerun_interrupt(instance);
+}
+
+// Applies the fuel and time limits of the command line to {instance}.
+static void limit_run(wasm_instance_t* instance) {
+  weerun_set_fuel(instance, g_fuel);
+  g_timed_instance = instance;
+  if (g_timeout_ms <= 0) return;
+  signal(SIGALRM, on_timeout);
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = g_timeout_ms / 1000;
+  timer.it_value.tv_usec = (g_timeout_ms % 1000) * 1000;
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// The file to write a profile of the run to, or NULL.
+static const char* g_profile_path = NULL;
+
+// The interval between profile samples, in microseconds of CPU time.
+#define PROFILE_INTERVAL_US 1000
+
+// Starts profiling {instance} if -profile was given.
+static void begin_profile(wasm_instance_t* instance) {
+  if (g_profile_path != NULL) start_profiling(instance, new_profile(), PROFILE_INTERVAL_US);
+}
+
+// Writes and frees the profile of {instance}, if it has one.
+static void end_profile(wasm_instance_t* instance) {
+  profile_t* profile = instance->profile;
+  if (profile == NULL) return;
+  stop_profiling();
+  TRACE("profile: %llu samples\n", (unsigned long long)profile_count(profile));
+  write_profile(profile, instance->module, g_profile_path);
+  free_profile(profile);
+}
+
+// Whether to count executed instructions and print them to stderr after a run.
+static int g_opstats = 0;
+
+// Starts counting the instructions {instance} executes if -opstats was given.
+static void begin_opstats(wasm_instance_t* instance) {
+  if (g_opstats) instance->opstats = new_opstats(instance->module);
+}
+
+// Prints and frees the instruction counts of {instance}, if it has them.
+static void end_opstats(wasm_instance_t* instance) {
+  if (instance->opstats == NULL) return;
+  print_opstats(stderr, instance->opstats, instance->module);
+  free_opstats(instance->opstats);
+  instance->opstats = NULL;
+}
+
+static void print_stats_at_exit() {
+  print_stats(stderr);
+}
+
+// The number of events each thread keeps for -trace-events.
+#define EVENT_RING_CAPACITY (1 << 20)
+
+// The number of threads that run a batch.
+static uint32_t g_parallel = 1;
+
+// The directory of the module cache, or NULL if modules are always parsed.
+static const char* g_cache_dir = NULL;
+
 // Main function.
 // Parses arguments and either runs the tests or runs a file with arguments.
 //  -trace: enable tracing to stderr
 //  -disassemble: disassemble sections and code while parsing
 //  -test: run internal tests
+//  -bench: run internal microbenchmarks
+//  -cpu=scalar|sse|avx2: override the detected kernel implementations
+//  -gcstats: print garbage collector statistics and pause times to stderr
+//  -stats: print phase times, allocated bytes and call counts to stderr as JSON at exit
+//  -opstats: print executed opcodes, opcode pairs and an annotated listing to stderr
+//  -cache=<dir>: map parsed modules from {dir}, adding them if they are not there
+//  -serve <socket>: answer requests from a Unix domain socket, or stdin if "-"
+//  <module> -batch <argsfile>: run "main" once per line of {argsfile}
+//  -parallel <n>: run the lines of a batch on {n} threads
+//  -fuel=<n>: trap after {n} loop iterations and calls
+//  -timeout=<ms>: trap after {ms} milliseconds, checked at loop back-edges
+//  -trace-events=<file>: record load phases and calls and write them to {file} as a Chrome trace
+//  -profile=<file>: sample the wasm call stack and write folded stacks to {file}
+//  -snapshot <file> <module>: run the start function and save the state to {file}
+//  -restore <file> <args>: run "main" from a snapshot, skipping the start function
 int main(int argc, char *argv[]) {
+  init_cpu_kernels(-1);
   for (int i = 1; i < argc; i++) {
     char *arg = argv[i];
     if (strcmp(arg, "-test") == 0) return run_tests();
+    if (strcmp(arg, "-bench") == 0) return run_benchmarks();
     if (strcmp(arg, "-trace") == 0) {
       g_trace = 1;
       continue;
@@ -32,38 +178,101 @@ int main(int argc, char *argv[]) {
       g_disassemble = 1;
       continue;
     }
+    if (strcmp(arg, "-gcstats") == 0) {
+      g_gcstats = 1;
+      continue;
+    }
+    if (strcmp(arg, "-stats") == 0) {
+      if (!g_stats) atexit(print_stats_at_exit);
+      g_stats = 1;
+      continue;
+    }
+    if (strcmp(arg, "-opstats") == 0) {
+      g_opstats = 1;
+      continue;
+    }
+    if (strcmp(arg, "-serve") == 0) {
+      if (i + 1 >= argc) {
+        ERR("!expected a socket path after -serve\n");
+        return 1;
+      }
+      return serve(argv[i + 1]);
+    }
+    if (strcmp(arg, "-snapshot") == 0 || strcmp(arg, "-restore") == 0) {
+      if (i + 1 >= argc || (arg[1] == 's' && i + 2 >= argc)) {
+        ERR("!expected a snapshot file%s after %s\n", arg[1] == 's' ? " and a module" : "", arg);
+        return 1;
+      }
+      if (arg[1] == 'r') {
+        wasm_values args = parse_args(argc, argv, i + 2);
+        return exit_with(run_snapshot(argv[i + 1], &args));
+      }
+      byte* start = NULL;
+      byte* end = NULL;
+      if (load_file(argv[i + 2], &start, &end) < 0) {
+        ERR("failed to load: %s\n", argv[i + 2]);
+        return 1;
+      }
+      int status = snapshot(argv[i + 1], start, end);
+      unload_file(&start, &end);
+      return status;
+    }
+    if (strcmp(arg, "-parallel") == 0) {
+      int n = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+      if (n < 1) {
+        ERR("!expected a number of threads after -parallel\n");
+        return 1;
+      }
+      g_parallel = (uint32_t)n;
+      i++;
+      continue;
+    }
+    if (strncmp(arg, "-fuel=", 6) == 0) {
+      g_fuel = strtoll(arg + 6, NULL, 10);
+      continue;
+    }
+    if (strncmp(arg, "-timeout=", 9) == 0) {
+      g_timeout_ms = strtol(arg + 9, NULL, 10);
+      continue;
+    }
+    if (strncmp(arg, "-trace-events=", 14) == 0) {
+      start_events(arg + 14, EVENT_RING_CAPACITY);
+      continue;
+    }
+    if (strncmp(arg, "-profile=", 9) == 0) {
+      g_profile_path = arg + 9;
+      continue;
+    }
+    if (strncmp(arg, "-cache=", 7) == 0) {
+      g_cache_dir = arg + 7;
+      continue;
+    }
+    if (strncmp(arg, "-cpu=", 5) == 0) {
+      int level = cpu_level_by_name(arg + 5);
+      if (level < 0 || init_cpu_kernels(level) < 0) {
+        ERR("!unsupported cpu level: %s\n", arg + 5);
+        return 1;
+      }
+      continue;
+    }
     
     byte* start = NULL;
     byte* end = NULL;
+    log_event(EVENT_BEGIN, EVENT_LOAD, 0);
     ssize_t r = load_file(arg, &start, &end);
+    log_event(EVENT_END, EVENT_LOAD, 0);
     if (r >= 0) {
+      count_bytes(BYTES_FILE, (uint64_t)r);
       TRACE("loaded %s: %ld bytes\n", arg, r);
-      wasm_values args = { argc - i - 1, NULL };
-      if (args.length > 0) {
-	args.vals = (wasm_value_t*)malloc(sizeof(wasm_value_t) * args.length);
-	for (int j = i + 1; j < argc; j++) {
-	  int a = j - i - 1;
-	  args.vals[a] = parse_wasm_value(argv[j]);
-	  TRACE("args[%d] = ", a);
-	  trace_wasm_value(args.vals[a]);
-	  TRACE("\n");
-	}
+      if (i + 2 < argc && strcmp(argv[i + 1], "-batch") == 0) {
+        int status = run_batch(start, end, argv[i + 2], g_parallel);
+        unload_file(&start, &end);
+        return status;
       }
+      wasm_values args = parse_args(argc, argv, i + 1);
       wasm_values result = run(start, end, &args);
       unload_file(&start, &end);
-      if (result.length < 0) {
-        printf("!trap\n");
-        exit(1);
-        return 1;
-      } else {
-        for (int i = 0; i < result.length; i++) {
-          if (i > 0) printf(" ");
-          print_wasm_value(result.vals[i]);
-        }
-        printf("\n");
-        exit(0);
-        return 0;
-      }
+      return exit_with(result);
     } else {
       ERR("failed to load: %s\n", arg);
       return 1;
@@ -72,4 +281,119 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-// Your solution here
+// Calls the "main" export of {instance} with {args}. Returns a negative length on
+// a trap.
+static wasm_values call_main(wasm_instance_t* instance, wasm_values* args) {
+  wasm_values result = { -1, NULL };
+  wasm_module_t* module = instance->module;
+  wasm_sig_decl_t* sig = &module->sigs[module->funcs[module->main_func].sig_index];
+  wasm_trap_t trap = TRAP_INVALID_ARGS;
+  if ((uint32_t)args->length == sig->num_params) {
+    weerun_box_args(sig, args->vals);
+    result.vals = (wasm_value_t*)malloc(sizeof(wasm_value_t) * (sig->num_results + 1));
+    log_event(EVENT_BEGIN, EVENT_MAIN, module->main_func);
+    trap = invoke_wasm_function(instance, module->main_func, args->vals, result.vals);
+    log_event(EVENT_END, EVENT_MAIN, module->main_func);
+    result.length = (int32_t)sig->num_results;
+  } else {
+    log_event(EVENT_INSTANT, EVENT_TRAP, trap);
+  }
+  if (trap != TRAP_NONE) {
+    TRACE("trap: %s\n", trap_name(trap));
+    result.length = -1;
+  }
+  if (g_gcstats && instance->heap != NULL) print_gc_stats(stderr, obj_gc_stats(instance->heap));
+  return result;
+}
+
+// Parses and instantiates a module, runs its start function, and then calls
+// its "main" export with {args}. Returns a negative length on a trap.
+wasm_values run(const byte* start, const byte* end, wasm_values* args) {
+  wasm_values result = { -1, NULL };
+
+  wasm_module_t parsed;
+  wasm_module_t* module = &parsed;
+  if (g_cache_dir != NULL) {
+    module = weerun_load_module_cached(g_cache_dir, start, (size_t)(end - start));
+    if (module == NULL) return result;
+  } else {
+    // code is validated and rewritten in place while parsing
+    buffer_t buf = { start, start, end };
+    init_wasm_module(module);
+    if (parse_wasm_module(&buf, module) < 0) {
+      ERR("!failed to parse module\n");
+      return result;
+    }
+  }
+  if (module->main_func < 0 || (uint32_t)module->main_func >= module->num_funcs) {
+    ERR("!module has no main function\n");
+    return result;
+  }
+  if (module->start_func >= 0 && (uint32_t)module->start_func >= module->num_funcs) {
+    ERR("!invalid start function %d\n", module->start_func);
+    return result;
+  }
+
+  wasm_instance_t instance;
+  wasm_trap_t trap = instantiate_wasm_module(module, &instance);
+  if (trap == TRAP_NONE) {
+    limit_run(&instance);
+    begin_profile(&instance);
+    begin_opstats(&instance);
+  }
+  if (trap == TRAP_NONE && module->start_func >= 0) {
+    log_event(EVENT_BEGIN, EVENT_START, module->start_func);
+    trap = invoke_wasm_function(&instance, module->start_func, NULL, NULL);
+    log_event(EVENT_END, EVENT_START, module->start_func);
+  }
+  if (trap == TRAP_NONE) {
+    result = call_main(&instance, args);
+  } else {
+    TRACE("trap: %s\n", trap_name(trap));
+  }
+  g_timed_instance = NULL;
+  end_profile(&instance);
+  end_opstats(&instance);
+  finish_events(module);
+  free_wasm_instance(&instance);
+  return result;
+}
+
+wasm_values run_snapshot(const char* path, wasm_values* args) {
+  wasm_values result = { -1, NULL };
+  wasm_instance_t* instance = restore_snapshot(path);
+  if (instance == NULL) return result;
+  wasm_module_t* module = instance->module;
+  if (module->main_func < 0 || (uint32_t)module->main_func >= module->num_funcs) {
+    ERR("!module has no main function\n");
+  } else {
+    limit_run(instance);
+    begin_profile(instance);
+    begin_opstats(instance);
+    result = call_main(instance, args);
+  }
+  g_timed_instance = NULL;
+  end_profile(instance);
+  end_opstats(instance);
+  finish_events(module);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return result;
+}
+
+int snapshot(const char* path, const byte* start, const byte* end) {
+  wasm_module_t* module = weerun_load_module(start, (size_t)(end - start));
+  if (module == NULL) return 1;
+  wasm_trap_t trap = TRAP_NONE;
+  wasm_instance_t* instance = weerun_instantiate(module, &trap);
+  int r = -1;
+  if (instance == NULL) {
+    ERR("!trap in start function: %s\n", trap_name(trap));
+  } else {
+    r = save_snapshot(path, start, (size_t)(end - start), instance);
+  }
+  finish_events(module);
+  weerun_free_instance(instance);
+  weerun_free_module(module);
+  return r < 0 ? 1 : 0;
+}
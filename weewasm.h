@@ -16,87 +16,144 @@
 #define WASM_SECT_CODE 10
 #define WASM_SECT_DATA 11
 
-// Opcode constants
-#define WASM_OP_UNREACHABLE		0x00 /* "unreachable" */
-#define WASM_OP_NOP			0x01 /* "nop" */
-#define WASM_OP_BLOCK			0x02 /* "block" BLOCKT */
-#define WASM_OP_LOOP			0x03 /* "loop" BLOCKT */
-#define WASM_OP_END			0x0B /* "end" */
-#define WASM_OP_BR			0x0C /* "br" LABEL */
-#define WASM_OP_BR_IF			0x0D /* "br_if" LABEL */
-#define WASM_OP_BR_TABLE		0x0E /* "br_table" LABELS */
-#define WASM_OP_RETURN			0x0F /* "return" */
-#define WASM_OP_CALL			0x10 /* "call" FUNC */
-#define WASM_OP_CALL_INDIRECT		0x11 /* "call_indirect" SIG_TABLE */
-#define WASM_OP_DROP			0x1A /* "drop" */
-#define WASM_OP_SELECT			0x1B /* "select" */
-#define WASM_OP_LOCAL_GET		0x20 /* "local.get" LOCAL */
-#define WASM_OP_LOCAL_SET		0x21 /* "local.set" LOCAL */
-#define WASM_OP_LOCAL_TEE		0x22 /* "local.tee" LOCAL */
-#define WASM_OP_GLOBAL_GET		0x23 /* "global.get" GLOBAL */
-#define WASM_OP_GLOBAL_SET		0x24 /* "global.set" GLOBAL */
-#define WASM_OP_I32_LOAD		0x28 /* "i32.load" MEMARG */
-#define WASM_OP_F64_LOAD		0x2B /* "f64.load" MEMARG */
-#define WASM_OP_I32_LOAD8_S		0x2C /* "i32.load8_s" MEMARG */
-#define WASM_OP_I32_LOAD8_U		0x2D /* "i32.load8_u" MEMARG */
-#define WASM_OP_I32_LOAD16_S		0x2E /* "i32.load16_s" MEMARG */
-#define WASM_OP_I32_LOAD16_U		0x2F /* "i32.load16_u" MEMARG */
-#define WASM_OP_I32_STORE		0x36 /* "i32.store" MEMARG */
-#define WASM_OP_F64_STORE		0x39 /* "f64.store" MEMARG */
-#define WASM_OP_I32_STORE8		0x3A /* "i32.store8" MEMARG */
-#define WASM_OP_I32_STORE16		0x3B /* "i32.store16" MEMARG */
-#define WASM_OP_I32_CONST		0x41 /* "i32.const" I32 */
-#define WASM_OP_F64_CONST		0x44 /* "f64.const" F64 */
-#define WASM_OP_I32_EQZ			0x45 /* "i32.eqz" */
-#define WASM_OP_I32_EQ			0x46 /* "i32.eq" */
-#define WASM_OP_I32_NE			0x47 /* "i32.ne" */
-#define WASM_OP_I32_LT_S		0x48 /* "i32.lt_s" */
-#define WASM_OP_I32_LT_U		0x49 /* "i32.lt_u" */
-#define WASM_OP_I32_GT_S		0x4A /* "i32.gt_s" */
-#define WASM_OP_I32_GT_U		0x4B /* "i32.gt_u" */
-#define WASM_OP_I32_LE_S		0x4C /* "i32.le_s" */
-#define WASM_OP_I32_LE_U		0x4D /* "i32.le_u" */
-#define WASM_OP_I32_GE_S		0x4E /* "i32.ge_s" */
-#define WASM_OP_I32_GE_U		0x4F /* "i32.ge_u" */
-#define WASM_OP_F64_EQ			0x61 /* "f64.eq" */
-#define WASM_OP_F64_NE			0x62 /* "f64.ne" */
-#define WASM_OP_F64_LT			0x63 /* "f64.lt" */
-#define WASM_OP_F64_GT			0x64 /* "f64.gt" */
-#define WASM_OP_F64_LE			0x65 /* "f64.le" */
-#define WASM_OP_F64_GE			0x66 /* "f64.ge" */
-#define WASM_OP_I32_CLZ			0x67 /* "i32.clz" */
-#define WASM_OP_I32_CTZ			0x68 /* "i32.ctz" */
-#define WASM_OP_I32_POPCNT		0x69 /* "i32.popcnt" */
-#define WASM_OP_I32_ADD			0x6A /* "i32.add" */
-#define WASM_OP_I32_SUB			0x6B /* "i32.sub" */
-#define WASM_OP_I32_MUL			0x6C /* "i32.mul" */
-#define WASM_OP_I32_DIV_S		0x6D /* "i32.div_s" */
-#define WASM_OP_I32_DIV_U		0x6E /* "i32.div_u" */
-#define WASM_OP_I32_REM_S		0x6F /* "i32.rem_s" */
-#define WASM_OP_I32_REM_U		0x70 /* "i32.rem_u" */
-#define WASM_OP_I32_AND			0x71 /* "i32.and" */
-#define WASM_OP_I32_OR			0x72 /* "i32.or" */
-#define WASM_OP_I32_XOR			0x73 /* "i32.xor" */
-#define WASM_OP_I32_SHL			0x74 /* "i32.shl" */
-#define WASM_OP_I32_SHR_S		0x75 /* "i32.shr_s" */
-#define WASM_OP_I32_SHR_U		0x76 /* "i32.shr_u" */
-#define WASM_OP_I32_ROTL		0x77 /* "i32.rotl" */
-#define WASM_OP_I32_ROTR		0x78 /* "i32.rotr" */
-#define WASM_OP_F64_ADD			0xA0 /* "f64.add" */
-#define WASM_OP_F64_SUB			0xA1 /* "f64.sub" */
-#define WASM_OP_F64_MUL			0xA2 /* "f64.mul" */
-#define WASM_OP_F64_DIV			0xA3 /* "f64.div" */
-#define WASM_OP_I32_TRUNC_F64_S		0xAA /* "i32.trunc_f64_s" */
-#define WASM_OP_I32_TRUNC_F64_U		0xAB /* "i32.trunc_f64_u" */
-#define WASM_OP_F64_CONVERT_I32_S	0xB7 /* "f64.convert_i32_s" */
-#define WASM_OP_F64_CONVERT_I32_U	0xB8 /* "f64.convert_i32_u" */
-#define WASM_OP_I32_EXTEND8_S		0xC0 /* "i32.extend8_s" */
-#define WASM_OP_I32_EXTEND16_S		0xC1 /* "i32.extend16_s" */
+// Immediate kinds of bytecodes
+#define IMM_NONE 0
+#define IMM_BLOCKT 1
+#define IMM_LABEL 2
+#define IMM_LABELS 3
+#define IMM_FUNC 4
+#define IMM_SIG_TABLE 5
+#define IMM_LOCAL 6
+#define IMM_GLOBAL 7
+#define IMM_TABLE 8
+#define IMM_MEMARG 9
+#define IMM_I32 10
+#define IMM_F64 11
+#define IMM_MEMORY 12
+#define IMM_TAG 13
+#define IMM_I64 14
+#define IMM_F32 15
+#define IMM_REFNULLT 16
+#define IMM_VALTS 17
+#define IMM_PCDELTA 18
+#define IMM_PCDELTAS 19
+#define IMM_CACHE 20
+#define IMM_SKIP 21
+
+// The opcode specification, V(NAME, code, mnemonic, immediate kind), from which
+// the opcode constants, the disassembly tables, and the interpreter dispatch
+// table are all generated. Illegal opcodes are listed in illegal.h.
+#define FOREACH_OPCODE(V) \
+  V(UNREACHABLE, 0x00, "unreachable", NONE)                 \
+  V(NOP, 0x01, "nop", NONE)                                 \
+  V(BLOCK, 0x02, "block", BLOCKT)                           \
+  V(LOOP, 0x03, "loop", BLOCKT)                             \
+  V(END, 0x0B, "end", NONE)                                 \
+  V(BR, 0x0C, "br", LABEL)                                  \
+  V(BR_IF, 0x0D, "br_if", LABEL)                            \
+  V(BR_TABLE, 0x0E, "br_table", LABELS)                     \
+  V(RETURN, 0x0F, "return", NONE)                           \
+  V(CALL, 0x10, "call", FUNC)                               \
+  V(CALL_INDIRECT, 0x11, "call_indirect", SIG_TABLE)        \
+  V(DROP, 0x1A, "drop", NONE)                               \
+  V(SELECT, 0x1B, "select", NONE)                           \
+  V(LOCAL_GET, 0x20, "local.get", LOCAL)                    \
+  V(LOCAL_SET, 0x21, "local.set", LOCAL)                    \
+  V(LOCAL_TEE, 0x22, "local.tee", LOCAL)                    \
+  V(GLOBAL_GET, 0x23, "global.get", GLOBAL)                 \
+  V(GLOBAL_SET, 0x24, "global.set", GLOBAL)                 \
+  V(I32_LOAD, 0x28, "i32.load", MEMARG)                     \
+  V(F64_LOAD, 0x2B, "f64.load", MEMARG)                     \
+  V(I32_LOAD8_S, 0x2C, "i32.load8_s", MEMARG)               \
+  V(I32_LOAD8_U, 0x2D, "i32.load8_u", MEMARG)               \
+  V(I32_LOAD16_S, 0x2E, "i32.load16_s", MEMARG)             \
+  V(I32_LOAD16_U, 0x2F, "i32.load16_u", MEMARG)             \
+  V(I32_STORE, 0x36, "i32.store", MEMARG)                   \
+  V(F64_STORE, 0x39, "f64.store", MEMARG)                   \
+  V(I32_STORE8, 0x3A, "i32.store8", MEMARG)                 \
+  V(I32_STORE16, 0x3B, "i32.store16", MEMARG)               \
+  V(I32_CONST, 0x41, "i32.const", I32)                      \
+  V(F64_CONST, 0x44, "f64.const", F64)                      \
+  V(I32_EQZ, 0x45, "i32.eqz", NONE)                         \
+  V(I32_EQ, 0x46, "i32.eq", NONE)                           \
+  V(I32_NE, 0x47, "i32.ne", NONE)                           \
+  V(I32_LT_S, 0x48, "i32.lt_s", NONE)                       \
+  V(I32_LT_U, 0x49, "i32.lt_u", NONE)                       \
+  V(I32_GT_S, 0x4A, "i32.gt_s", NONE)                       \
+  V(I32_GT_U, 0x4B, "i32.gt_u", NONE)                       \
+  V(I32_LE_S, 0x4C, "i32.le_s", NONE)                       \
+  V(I32_LE_U, 0x4D, "i32.le_u", NONE)                       \
+  V(I32_GE_S, 0x4E, "i32.ge_s", NONE)                       \
+  V(I32_GE_U, 0x4F, "i32.ge_u", NONE)                       \
+  V(F64_EQ, 0x61, "f64.eq", NONE)                           \
+  V(F64_NE, 0x62, "f64.ne", NONE)                           \
+  V(F64_LT, 0x63, "f64.lt", NONE)                           \
+  V(F64_GT, 0x64, "f64.gt", NONE)                           \
+  V(F64_LE, 0x65, "f64.le", NONE)                           \
+  V(F64_GE, 0x66, "f64.ge", NONE)                           \
+  V(I32_CLZ, 0x67, "i32.clz", NONE)                         \
+  V(I32_CTZ, 0x68, "i32.ctz", NONE)                         \
+  V(I32_POPCNT, 0x69, "i32.popcnt", NONE)                   \
+  V(I32_ADD, 0x6A, "i32.add", NONE)                         \
+  V(I32_SUB, 0x6B, "i32.sub", NONE)                         \
+  V(I32_MUL, 0x6C, "i32.mul", NONE)                         \
+  V(I32_DIV_S, 0x6D, "i32.div_s", NONE)                     \
+  V(I32_DIV_U, 0x6E, "i32.div_u", NONE)                     \
+  V(I32_REM_S, 0x6F, "i32.rem_s", NONE)                     \
+  V(I32_REM_U, 0x70, "i32.rem_u", NONE)                     \
+  V(I32_AND, 0x71, "i32.and", NONE)                         \
+  V(I32_OR, 0x72, "i32.or", NONE)                           \
+  V(I32_XOR, 0x73, "i32.xor", NONE)                         \
+  V(I32_SHL, 0x74, "i32.shl", NONE)                         \
+  V(I32_SHR_S, 0x75, "i32.shr_s", NONE)                     \
+  V(I32_SHR_U, 0x76, "i32.shr_u", NONE)                     \
+  V(I32_ROTL, 0x77, "i32.rotl", NONE)                       \
+  V(I32_ROTR, 0x78, "i32.rotr", NONE)                       \
+  V(F64_ADD, 0xA0, "f64.add", NONE)                         \
+  V(F64_SUB, 0xA1, "f64.sub", NONE)                         \
+  V(F64_MUL, 0xA2, "f64.mul", NONE)                         \
+  V(F64_DIV, 0xA3, "f64.div", NONE)                         \
+  V(I32_TRUNC_F64_S, 0xAA, "i32.trunc_f64_s", NONE)         \
+  V(I32_TRUNC_F64_U, 0xAB, "i32.trunc_f64_u", NONE)         \
+  V(F64_CONVERT_I32_S, 0xB7, "f64.convert_i32_s", NONE)     \
+  V(F64_CONVERT_I32_U, 0xB8, "f64.convert_i32_u", NONE)     \
+  V(I32_EXTEND8_S, 0xC0, "i32.extend8_s", NONE)             \
+  V(I32_EXTEND16_S, 0xC1, "i32.extend16_s", NONE)
 
-#define WASM_OP_JMP                     0xF0 /* "jmp" */
-#define WASM_OP_JMP_IF                  0xF1 /* "jmp_if */
-#define WASM_OP_JMP_TABLE               0xF2 /*  jmp_table */
+// Opcodes that only appear in code after it has been rewritten by the loader.
+#define FOREACH_INTERNAL_OPCODE(V) \
+  V(JMP, 0xF0, "jmp", PCDELTA)                              \
+  V(JMP_IF, 0xF1, "jmp_if", PCDELTA)                        \
+  V(JMP_TABLE, 0xF2, "jmp_table", PCDELTAS)                 \
+  V(OBJ_GET_CACHED, 0xF3, "obj.get_cached", CACHE)          \
+  V(OBJ_SET_CACHED, 0xF4, "obj.set_cached", CACHE)          \
+  V(SKIP, 0xF5, "skip", SKIP)                               \
+  V(PUTI, 0xF6, "puti", FUNC)                               \
+  V(PUTD, 0xF7, "putd", FUNC)                               \
+  V(PUTS, 0xF8, "puts", FUNC)                               \
+  V(OBJ_NEW, 0xF9, "obj.new", FUNC)                         \
+  V(OBJ_BOX_I32, 0xFA, "obj.box_i32", FUNC)                 \
+  V(OBJ_BOX_F64, 0xFB, "obj.box_f64", FUNC)                 \
+  V(I32_UNBOX, 0xFC, "i32.unbox", FUNC)                     \
+  V(F64_UNBOX, 0xFD, "f64.unbox", FUNC)                     \
+  V(OBJ_EQ, 0xFE, "obj.eq", FUNC)
+
+// Opcode constants
+#define DECLARE_OPCODE(name, code, mnemonic, imm) WASM_OP_##name = code,
+enum {
+  FOREACH_OPCODE(DECLARE_OPCODE)
+  FOREACH_INTERNAL_OPCODE(DECLARE_OPCODE)
+};
 
 #define WEEWASM_INTRINSIC_PUTI 0x01
 #define WEEWASM_INTRINSIC_PUTD 0x02
 #define WEEWASM_INTRINSIC_PUTS 0x03
+#define WEEWASM_INTRINSIC_OBJ_NEW 0x04
+#define WEEWASM_INTRINSIC_OBJ_GET 0x05
+#define WEEWASM_INTRINSIC_OBJ_SET 0x06
+#define WEEWASM_INTRINSIC_OBJ_BOX_I32 0x07
+#define WEEWASM_INTRINSIC_OBJ_BOX_F64 0x08
+#define WEEWASM_INTRINSIC_I32_UNBOX 0x09
+#define WEEWASM_INTRINSIC_F64_UNBOX 0x0A
+#define WEEWASM_INTRINSIC_OBJ_EQ 0x0B
+#define WEEWASM_INTRINSIC_HOST 0xFF // a function registered by the host, see imports.h